@@ -0,0 +1,331 @@
+#!/usr/bin/env python3
+
+"""Throughput benchmark of s21_cat and s21_grep against GNU cat and grep.
+
+Synthetic corpora modeled on datasets/cat and datasets/grep are generated
+once per size. Every flag combination the test suites cover is run on them,
+and MB/s, lines/s and peak RSS are reported as a table and as JSON. The
+JSON of an earlier run can be passed with --baseline to gate regressions.
+"""
+
+from itertools import combinations
+import argparse
+import ctypes
+import json
+import os
+import platform
+import random
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+
+DATASETS_DIR = "../datasets"
+S21_CAT = "./cat/s21_cat"
+S21_GREP = "./grep/s21_grep"
+MB = 1024 * 1024
+UNIQUE_BLOCK = 4 * MB
+
+CAT_FLAGS = ("-b", "-e", "-n", "-s", "-t", "-E", "-T", "-v",
+             "--number-nonblank", "--number", "--squeeze-blank")
+CAT_CORPORA = ("lorem", "code", "bytes", "empty_lines")
+
+GREP_OPTIONS = ("-i", "-v", "-c", "-l", "-n", "-h", "-s", "-o")
+GREP_CORPORA = ("lorem", "git_log", "ip", "emails")
+# The regexes of grep/tests.py
+GREP_REGEXES = ("e", "E", "commit", "Lorem", "protec", "[[:digit:]a-fA-F]]\\{1,\\}",
+                "[[:digit:]]\\{1,\\}", "[0-7]\\{1,\\}", "[01]\\{1,\\}", "[[:alnum:]]\\{1,\\}")
+
+
+def read_words():
+    with open(os.path.join(DATASETS_DIR, "grep", "lorem_ipsum.txt")) as f:
+        return f.read().replace(",", "").replace(".", "").split()
+
+
+def lorem_lines(rng, words):
+    while True:
+        line = " ".join(rng.choice(words) for _ in range(rng.randint(4, 18)))
+        yield line.capitalize() + rng.choice((".", ",", ""))
+
+
+def git_log_lines(rng, words):
+    names = ("Werlag Deckard", "Ivan Petrov", "Anna Smith", "Lee Chen")
+    while True:
+        name = rng.choice(names)
+        yield "commit " + "".join(rng.choice("0123456789abcdef") for _ in range(40))
+        yield f"Author: {name} <{name.split()[0].lower()}@student.21-school.ru>"
+        yield time.strftime("Date:   %a %b %d %H:%M:%S %Y +0000", time.gmtime(rng.randint(0, 2 ** 31)))
+        yield ""
+        yield "    " + " ".join(rng.choice(words) for _ in range(rng.randint(3, 10)))
+        yield ""
+
+
+def ip_lines(rng, words):
+    while True:
+        parts = [str(rng.randint(0, 999 if rng.random() < 0.2 else 255)) for _ in range(rng.choice((3, 4, 4, 4)))]
+        yield ".".join(parts)
+
+
+def email_lines(rng, words):
+    domains = ("gmail.com", "test.org", "ihateregex.io", "testing.com", "gmail")
+    while True:
+        user = rng.choice(words).lower() + str(rng.randint(0, 99))
+        form = rng.random()
+        if form < 0.8:
+            yield f"{user}@{rng.choice(domains)}"
+        elif form < 0.9:
+            yield f"{user}@"
+        else:
+            yield f"{user} with@space.com"
+
+
+def code_lines(rng, words):
+    while True:
+        depth = rng.randint(0, 4)
+        yield "\t" * depth + rng.choice(("int", "return", "printf(\"")) + " " + \
+            "\t".join(rng.choice(words) for _ in range(rng.randint(1, 6)))
+
+
+def empty_lines_lines(rng, words):
+    lines = lorem_lines(rng, words)
+    while True:
+        for _ in range(rng.choice((0, 1, 1, 2, 5))):
+            yield ""
+        yield next(lines)
+
+
+LINE_GENERATORS = {
+    "lorem": lorem_lines,
+    "git_log": git_log_lines,
+    "ip": ip_lines,
+    "emails": email_lines,
+    "code": code_lines,
+    "empty_lines": empty_lines_lines,
+}
+
+
+def unique_block(name, rng, words):
+    if name == "bytes":
+        # All byte values, with a newline about every 80 bytes like datasets/cat/bytes.txt
+        data = bytearray(rng.getrandbits(8) for _ in range(UNIQUE_BLOCK))
+        for i in range(0, len(data), 80):
+            data[i] = 10
+        return bytes(data)
+    chunks, size = [], 0
+    for line in LINE_GENERATORS[name](rng, words):
+        chunks.append(line)
+        size += len(line) + 1
+        if size >= UNIQUE_BLOCK:
+            break
+    return ("\n".join(chunks) + "\n").encode()
+
+
+# Corpora are kept between runs, the name holds everything they depend on
+def make_corpus(name, size_mb, data_dir, words):
+    path = os.path.join(data_dir, f"{name}_{size_mb}mb.txt")
+    if not os.path.exists(path):
+        rng = random.Random(name)
+        block = unique_block(name, rng, words)
+        with open(path + ".tmp", "wb") as f:
+            for _ in range(size_mb * MB // len(block)):
+                f.write(block)
+            f.write(block[:size_mb * MB % len(block)])
+        os.rename(path + ".tmp", path)
+    return path
+
+
+def count_lines(path):
+    lines = 0
+    with open(path, "rb") as f:
+        for block in iter(lambda: f.read(MB), b""):
+            lines += block.count(b"\n")
+    return lines
+
+
+def cat_cases(suite):
+    sets = [()] + [(flag,) for flag in CAT_FLAGS]
+    if suite == "full":
+        sets += list(combinations(CAT_FLAGS, 2))
+    for flags in sets:
+        yield " ".join(flags) or "(none)", list(flags)
+
+
+def grep_cases(suite):
+    regexes = []
+    for regex in GREP_REGEXES:
+        regexes += ["-e", regex]
+    literals = os.path.join(DATASETS_DIR, "grep", "regex", "literals.txt")
+    yield "-e regexes", regexes
+    yield "-F -f literals", ["-F", "-f", literals]
+    yield "-f literals", ["-f", literals]
+    sets = [(option,) for option in GREP_OPTIONS]
+    if suite == "full":
+        sets += list(combinations(GREP_OPTIONS, 2))
+    for options in sets:
+        yield " ".join(options) + " -e regexes", list(options) + regexes
+
+
+# Best wall time of repeat runs, output is discarded
+def measure(command, repeat):
+    best = None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        subprocess.run(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+PTRACE_TRACEME, PTRACE_CONT, PTRACE_SETOPTIONS = 0, 7, 0x4200
+PTRACE_O_TRACEEXIT, PTRACE_EVENT_EXIT = 0x40, 6
+
+
+def trace_me():
+    libc = ctypes.CDLL(None)
+    libc.ptrace(PTRACE_TRACEME, 0, None, None)
+
+
+# Peak RSS in KB of one more run. ru_maxrss of wait4() also holds the memory
+# of this Python process the child was forked from, so on Linux the child is
+# stopped at its exit under ptrace and VmHWM of its own memory is read.
+def peak_rss(command):
+    linux = sys.platform == "linux"
+    process = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL,
+                               preexec_fn=trace_me if linux else None)
+    libc = ctypes.CDLL(None) if linux else None
+    hwm = 0
+    while True:
+        _, status, usage = os.wait4(process.pid, 0)
+        if os.WIFEXITED(status) or os.WIFSIGNALED(status):
+            break
+        sig = os.WSTOPSIG(status)
+        if status >> 16 == PTRACE_EVENT_EXIT:
+            with open(f"/proc/{process.pid}/status") as f:
+                hwm = max([int(line.split()[1]) for line in f if line.startswith("VmHWM:")] + [0])
+            sig = 0
+        elif sig == signal.SIGTRAP:
+            # stopped at exec
+            libc.ptrace(PTRACE_SETOPTIONS, process.pid, None, ctypes.c_void_p(PTRACE_O_TRACEEXIT))
+            sig = 0
+        libc.ptrace(PTRACE_CONT, process.pid, None, ctypes.c_void_p(sig))
+    # ru_maxrss is in kilobytes on Linux and in bytes on macOS
+    return hwm or (usage.ru_maxrss // 1024 if sys.platform == "darwin" else usage.ru_maxrss)
+
+
+def run_case(tool, name, args, corpus, path, sizes, args_ns):
+    size, lines = sizes
+    s21 = S21_CAT if tool == "cat" else S21_GREP
+    seconds = measure([s21] + args + [path], args_ns.repeat)
+    result = {
+        "tool": tool,
+        "case": name,
+        "corpus": corpus,
+        "args": args,
+        "bytes": size,
+        "lines": lines,
+        "seconds": round(seconds, 6),
+        "mb_per_s": round(size / MB / seconds, 2),
+        "lines_per_s": round(lines / seconds),
+        "max_rss_kb": peak_rss([s21] + args + [path]),
+    }
+    if not args_ns.no_gnu:
+        gnu_seconds = measure([tool] + args + [path], args_ns.repeat)
+        result["gnu_seconds"] = round(gnu_seconds, 6)
+        result["gnu_max_rss_kb"] = peak_rss([tool] + args + [path])
+        # above 1 when faster than GNU
+        result["gnu_ratio"] = round(gnu_seconds / seconds, 3)
+    return result
+
+
+def print_row(result):
+    ratio = f"{result['gnu_ratio']:7.2f}" if "gnu_ratio" in result else "      -"
+    print(f"{result['tool']:5} {result['corpus']:12} {result['case'][:40]:40} "
+          f"{result['mb_per_s']:10.1f} {result['lines_per_s']:13} {result['max_rss_kb']:9} {ratio}", flush=True)
+
+
+def key(result):
+    return f"{result['tool']}|{result['corpus']}|{result['case']}"
+
+
+# Cases slower than the baseline by more than the tolerance
+def regressions(results, baseline_path, tolerance):
+    with open(baseline_path) as f:
+        baseline = {key(result): result for result in json.load(f)["results"]}
+    slower = []
+    for result in results:
+        old = baseline.get(key(result))
+        if old is not None and result["mb_per_s"] < old["mb_per_s"] * (1 - tolerance):
+            slower.append((key(result), old["mb_per_s"], result["mb_per_s"]))
+    return slower
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--size", type=int, default=100, help="corpus size in MB (default 100)")
+    parser.add_argument("--suite", choices=("quick", "full"), default="full",
+                        help="quick: single flags only, full: pairs of flags too")
+    parser.add_argument("--tools", default="cat,grep")
+    parser.add_argument("--filter", default="", help="only cases whose name contains this")
+    parser.add_argument("--repeat", type=int, default=3, help="runs per case, the best one counts")
+    parser.add_argument("--data-dir", default=os.path.join(tempfile.gettempdir(), "s21_bench"))
+    parser.add_argument("--json", default="bench.json", help="where to write the results")
+    parser.add_argument("--baseline", help="results of an earlier run to compare with")
+    parser.add_argument("--tolerance", type=float, default=0.1,
+                        help="allowed slowdown against the baseline (default 0.1)")
+    parser.add_argument("--no-gnu", action="store_true", help="do not run GNU cat and grep")
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+    os.makedirs(args.data_dir, exist_ok=True)
+    words = read_words()
+    tools = args.tools.split(",")
+    plan = []
+    if "cat" in tools:
+        plan += [("cat", corpus, case) for corpus in CAT_CORPORA for case in cat_cases(args.suite)]
+    if "grep" in tools:
+        plan += [("grep", corpus, case) for corpus in GREP_CORPORA
+                 for case in grep_cases(args.suite)]
+    plan = [item for item in plan if args.filter in item[2][0]]
+
+    print(f"{'tool':5} {'corpus':12} {'case':40} {'MB/s':>10} {'lines/s':>13} {'RSS KB':>9} {'x GNU':>7}")
+    results, sizes = [], {}
+    for tool, corpus, (name, case_args) in plan:
+        if corpus not in sizes:
+            path = make_corpus(corpus, args.size, args.data_dir, words)
+            sizes[corpus] = (path, (os.path.getsize(path), count_lines(path)))
+        path, corpus_sizes = sizes[corpus]
+        result = run_case(tool, name, case_args, corpus, path, corpus_sizes, args)
+        print_row(result)
+        results.append(result)
+
+    report = {
+        "meta": {
+            "size_mb": args.size,
+            "suite": args.suite,
+            "repeat": args.repeat,
+            "machine": platform.machine(),
+            "system": platform.platform(),
+            "cpus": os.cpu_count(),
+            "time": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        },
+        "results": results,
+    }
+    with open(args.json, "w") as f:
+        json.dump(report, f, indent=2)
+    print(f"results written to {args.json}")
+
+    status = 0
+    if args.baseline:
+        slower = regressions(results, args.baseline, args.tolerance)
+        for case, old, new in slower:
+            print(f"REGRESSION {case}: {old} -> {new} MB/s")
+        status = 1 if slower else 0
+    return status
+
+
+if __name__ == "__main__":
+    sys.exit(main())
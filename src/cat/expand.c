@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "expand.h"
+#include "../common/output.h"
+#include "../common/prefetch.h"
+#include "s21_cat.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define BLOCK 16
+#endif
+
+static const unsigned char* skip_printable(const unsigned char *in, const unsigned char *end);
+
+// Table of all 256 bytes, built once from the flags: the same output
+// cat used to produce with a printf() per byte
+void build_expansions(struct expansion *table, bool v_flag, bool t_flag, bool e_flag) {
+    for (int ch = 0; ch < 256; ch++) {
+        struct expansion *e = table + ch;
+        if (ch == '\n' && e_flag) {
+            e->len = 2;
+            memcpy(e->text, "$\n", 2);
+        } else if (ch == '\t' && t_flag) {
+            e->len = strlen(T_TAB);
+            memcpy(e->text, T_TAB, e->len);
+        } else if (ch != '\n' && v_flag) {
+            e->len = format_v(ch, e->text);
+        } else {
+            e->len = 1;
+            e->text[0] = ch;
+        }
+    }
+}
+
+// ^X, M-X and M-^X notation of a byte, written to out
+size_t format_v(int ch, char *out) {
+    int converted_ch = ch % 128;
+    size_t len = 0;
+    if (ch >= 128 && (converted_ch == 127 || converted_ch < 32 || BYTE_M_NOTATION)) {
+        memcpy(out, M_NOT, strlen(M_NOT));
+        len = strlen(M_NOT);
+    }
+    if (ch == 127 || (ch >= 128 && converted_ch == 127)) {
+        out[len++] = '^';
+        out[len++] = converted_ch - 64;
+    } else if (converted_ch < 32 && (ch >= 128 || (converted_ch != 9 && converted_ch != 10))) {
+        out[len++] = '^';
+        out[len++] = converted_ch + 64;
+    } else if (ch >= 128 && BYTE_M_NOTATION) {
+        out[len++] = converted_ch;
+    } else {
+        out[len++] = ch;
+    }
+    return len;
+}
+
+// Expands len bytes of in to out, which needs room for EXPANSION_MAX bytes
+// per input byte. Printable ASCII is never changed and is copied in runs.
+// Returns the end of the output.
+char* expand_block(const unsigned char *in, size_t len, char *out, const struct expansion *table) {
+    const unsigned char *end = in + len;
+    while (in < end) {
+        const unsigned char *plain = skip_printable(in, end);
+        memcpy(out, in, plain - in);
+        out += plain - in;
+        in = plain;
+        while (in < end && (*in < ' ' || *in > '~')) {
+            const struct expansion *e = table + *in++;
+            memcpy(out, e->text, EXPANSION_MAX);
+            out += e->len;
+        }
+    }
+    return out;
+}
+
+// First byte outside ' '..'~', or end
+static const unsigned char* skip_printable(const unsigned char *in, const unsigned char *end) {
+    #ifdef __SSE2__
+    const __m128i below = _mm_set1_epi8(' ' - 1);
+    const __m128i above = _mm_set1_epi8('~' + 1);
+    while (end - in >= BLOCK) {
+        __m128i block = _mm_loadu_si128((const __m128i*) in);
+        // bytes from 128 are negative and fail the first compare
+        __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(block, below), _mm_cmplt_epi8(block, above));
+        unsigned mask = ~_mm_movemask_epi8(printable) & 0xffff;
+        if (mask != 0) return in + __builtin_ctz(mask);
+        in += BLOCK;
+    }
+    #endif
+    while (in < end && *in >= ' ' && *in <= '~')
+        in++;
+    return in;
+}
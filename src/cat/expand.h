@@ -0,0 +1,20 @@
+#ifndef EXPAND
+#define EXPAND
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Longest expansion of one byte: M-^X
+#define EXPANSION_MAX 4
+
+// How -v, -t and -e print one input byte
+struct expansion {
+    unsigned char len;
+    char text[EXPANSION_MAX];
+};
+
+void build_expansions(struct expansion *table, bool v_flag, bool t_flag, bool e_flag);
+size_t format_v(int ch, char *out);
+char* expand_block(const unsigned char *in, size_t len, char *out, const struct expansion *table);
+
+#endif  // EXPAND
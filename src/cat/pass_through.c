@@ -0,0 +1,115 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sys/sendfile.h>
+#endif
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pass_through.h"
+#include "../common/stats.h"
+
+// A kernel copy that cannot handle these descriptors, the next one is tried
+#define COPY_UNSUPPORTED -1
+
+#ifdef __linux__
+static int copy_range(int in_fd, int out_fd);
+static int copy_sendfile(int in_fd, int out_fd);
+static int copy_splice(int in_fd, int out_fd);
+static bool unsupported(int error);
+#endif
+static int copy_buffered(int in_fd, int out_fd);
+
+// Copies the rest of in_fd to out_fd without looking at the bytes: in the
+// kernel when the descriptor types allow it, with read()/write() otherwise.
+// Every call works on the file offsets, so a fallback picks up where the
+// previous one stopped. Returns errno of the failed call, 0 on success.
+int copy_fd(int in_fd, int out_fd) {
+    int status = COPY_UNSUPPORTED;
+    #ifdef __linux__
+    struct stat in, out;
+    bool in_stat = fstat(in_fd, &in) == 0;
+    bool out_stat = fstat(out_fd, &out) == 0;
+    // files of /proc and the like report no size but are not empty
+    bool in_regular = in_stat && S_ISREG(in.st_mode) && in.st_size > 0;
+    if (in_regular && out_stat && S_ISREG(out.st_mode))
+        status = copy_range(in_fd, out_fd);
+    if (status == COPY_UNSUPPORTED && in_regular)
+        status = copy_sendfile(in_fd, out_fd);
+    if (status == COPY_UNSUPPORTED && ((in_stat && S_ISFIFO(in.st_mode)) ||
+                                       (out_stat && S_ISFIFO(out.st_mode))))
+        status = copy_splice(in_fd, out_fd);
+    #endif
+    if (status == COPY_UNSUPPORTED)
+        status = copy_buffered(in_fd, out_fd);
+    return status;
+}
+
+#ifdef __linux__
+static int copy_range(int in_fd, int out_fd) {
+    ssize_t n = 1;
+    while (n != 0) {
+        n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0);
+        if (n < 0 && errno != EINTR) return unsupported(errno) ? COPY_UNSUPPORTED : errno;
+        if (n > 0) STAT_ADD(STAT_BYTES_READ, n);
+        if (n > 0) STAT_ADD(STAT_BYTES_WRITTEN, n);
+    }
+    return 0;
+}
+
+static int copy_sendfile(int in_fd, int out_fd) {
+    ssize_t n = 1;
+    while (n != 0) {
+        n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK_SIZE);
+        if (n < 0 && errno != EINTR) return unsupported(errno) ? COPY_UNSUPPORTED : errno;
+        if (n > 0) STAT_ADD(STAT_BYTES_READ, n);
+        if (n > 0) STAT_ADD(STAT_BYTES_WRITTEN, n);
+    }
+    return 0;
+}
+
+// One of the descriptors is a pipe
+static int copy_splice(int in_fd, int out_fd) {
+    ssize_t n = 1;
+    while (n != 0) {
+        n = splice(in_fd, NULL, out_fd, NULL, SPLICE_CHUNK_SIZE, SPLICE_F_MOVE);
+        if (n < 0 && errno != EINTR) return unsupported(errno) ? COPY_UNSUPPORTED : errno;
+        if (n > 0) STAT_ADD(STAT_BYTES_READ, n);
+        if (n > 0) STAT_ADD(STAT_BYTES_WRITTEN, n);
+    }
+    return 0;
+}
+
+// Errors of a kernel too old or descriptors of the wrong kind
+static bool unsupported(int error) {
+    return error == EINVAL || error == ENOSYS || error == EXDEV || error == EBADF ||
+           error == EOPNOTSUPP || error == ETXTBSY;
+}
+#endif
+
+static int copy_buffered(int in_fd, int out_fd) {
+    static char buffer[COPY_BUFFER_SIZE];
+    ssize_t n = 1;
+    while (n != 0) {
+        n = read(in_fd, buffer, sizeof(buffer));
+        if (n < 0 && errno != EINTR) return errno;
+        if (n > 0) STAT_ADD(STAT_BYTES_READ, n);
+        int error = n > 0 ? write_all(out_fd, buffer, n) : 0;
+        if (error != 0) return error;
+    }
+    return 0;
+}
+
+// write() that goes on after short writes and signals, returns errno or 0
+int write_all(int fd, const char *buffer, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, buffer + written, len - written);
+        if (n < 0 && errno != EINTR) return errno;
+        if (n > 0) written += n;
+        if (n > 0) STAT_ADD(STAT_BYTES_WRITTEN, n);
+    }
+    return 0;
+}
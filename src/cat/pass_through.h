@@ -0,0 +1,16 @@
+#ifndef PASS_THROUGH
+#define PASS_THROUGH
+
+#include <stddef.h>
+
+// Buffer of the read()/write() fallback
+#define COPY_BUFFER_SIZE (128 * 1024)
+
+// Bytes asked from the kernel by one copy_file_range(), sendfile() or splice()
+#define COPY_CHUNK_SIZE (1024 * 1024 * 1024)
+#define SPLICE_CHUNK_SIZE (1024 * 1024)
+
+int copy_fd(int in_fd, int out_fd);
+int write_all(int fd, const char *buffer, size_t len);
+
+#endif  // PASS_THROUGH
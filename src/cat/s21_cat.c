@@ -1,21 +1,44 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <locale.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
 
+#include "expand.h"
+#include "../common/output.h"
+#include "../common/prefetch.h"
 #include "s21_cat.h"
+#include "pass_through.h"
 #include "../common/utils.h"
+#include "../common/stats.h"
+
+// One buffer for the whole run, so the output of small files is written together
+static struct output out = { NULL, 0, 0, -1, false, 0 };
 
 int main(int argc, char *argv[]) {
     struct cat_state state = CAT_DEFAULT;
-    setlocale(LC_ALL, "");
 
+    uint64_t since = STAT_NOW();
     read_cmd_flags(&state, argc - 1, argv + 1);
+    STAT_PHASE(PHASE_PARSE, since);
+    build_expansions(state.expansion, state.flags.v_flag, state.flags.t_flag, state.flags.e_flag);
+    // without the buffer the output is written as it comes
+    output_init(&out, STDOUT_FILENO, CAT_OUTPUT_SIZE);
     if (state.filenames)
         cat_files(argv + 1, argc - 1, &state);
     else
         cat_stdin(&state);
+    flush_output();
+    if (out.error != 0) {
+        errno = out.error;
+        print_error("cat", "write error");
+    }
+    output_free(&out);
 
+    stats_report("cat");
     return 0;
 }
 
@@ -31,6 +54,7 @@ void read_arg_flags(struct cat_state *st, char *str) {
         st->flags.b_flag |= !strcmp(str, "number-nonblank");
         st->flags.n_flag |= !strcmp(str, "number");
         st->flags.s_flag |= !strcmp(str, "squeeze-blank");
+        if (!strcmp(str, "stats")) stats_enable();
     } else if (last_dash == 1) {
         while (*str) {
             st->flags.b_flag |= *str == 'b';
@@ -48,34 +72,141 @@ void read_arg_flags(struct cat_state *st, char *str) {
 }
 
 void cat_files(char *args[], size_t argc, struct cat_state *st) {
-    for (size_t i = 0; i < argc; i++) {
+    char **paths = malloc((argc + 1) * sizeof(char*));
+    size_t count = 0;
+    for (size_t i = 0; paths != NULL && i < argc; i++) {
         size_t last_dash = get_dash_index(args[i]);
         if (last_dash == 0 || last_dash > 2)
-            print_file(args[i], st);
+            paths[count++] = args[i];
+    }
+    struct prefetch prefetch;
+    // the files after the one printed are opened and read meanwhile
+    bool ahead = paths != NULL && prefetch_init(&prefetch, paths, count);
+    for (size_t i = 0; i < count; i++) {
+        print_file(paths[i], ahead ? prefetch_next(&prefetch) : NULL, st);
+        if (ahead) prefetch_done(&prefetch);
         #ifdef __APPLE__
         st->line_count = 1;
         #endif
     }
+    if (ahead) prefetch_free(&prefetch);
+    if (paths == NULL) report_error("-", ENOMEM);
+    free(paths);
 }
 
 void cat_stdin(struct cat_state *st) {
-    while (true) print_line(stdin, st);
+    struct prefetched_file in = { "-", STDIN_FILENO, 0, NULL, 0, false };
+    cat_file(&in, st);
 }
 
-void print_file(const char *filename, struct cat_state *st) {
-    FILE *f = fopen(filename, "r");
-    if (f != NULL) {
-        while (print_line(f, st) != EOF) {}
-        fclose(f);
-    } else {
-        print_error("cat", filename);
+// Without flags the bytes are copied as they are
+bool has_flags(const struct cat_state *st) {
+    return st->flags.b_flag || st->flags.e_flag || st->flags.n_flag ||
+           st->flags.s_flag || st->flags.t_flag || st->flags.v_flag;
+}
+
+// -b, -n and -s keep state between lines, the other flags work on any block
+bool line_flags(const struct cat_state *st) {
+    return st->flags.b_flag || st->flags.n_flag || st->flags.s_flag;
+}
+
+void cat_file(const struct prefetched_file *file, struct cat_state *st) {
+    if (has_flags(st))
+        expand_file(file, st);
+    else
+        copy_file(file);
+}
+
+// The bytes read ahead go through the output buffer, the rest of a larger
+// file is copied by the kernel, which reads and writes at once. The copy is
+// timed as output.
+void copy_file(const struct prefetched_file *file) {
+    uint64_t since = STAT_CLOCK();
+    output_write(&out, file->data, file->len);
+    int error = 0;
+    if (!file->eof || out.terminal) output_flush(&out);
+    if (!file->eof && out.error == 0) error = copy_fd(file->fd, STDOUT_FILENO);
+    STAT_PHASE(PHASE_OUTPUT, since);
+    end_file(file->path, error);
+}
+
+// Every block is expanded through the table into the output buffer, which is
+// written out when full. Input from a pipe or a terminal, and output to a
+// terminal, are written after every read, so lines show up as they come.
+void expand_file(const struct prefetched_file *file, struct cat_state *st) {
+    static unsigned char in[CAT_BLOCK_SIZE];
+    struct stat info;
+    bool live = out.terminal || fstat(file->fd, &info) != 0 || !S_ISREG(info.st_mode);
+    int error = 0;
+    ssize_t n = file->eof ? 0 : 1;
+    st->line_start = true;
+    expand_input((const unsigned char*) file->data, file->len, st);
+    if (live && file->len > 0) flush_output();
+    while (n != 0 && error == 0 && out.error == 0) {
+        uint64_t since = STAT_CLOCK();
+        n = read(file->fd, in, sizeof(in));
+        STAT_PHASE(PHASE_READ, since);
+        if (n < 0 && errno != EINTR) error = errno;
+        if (n > 0) STAT_ADD(STAT_BYTES_READ, n);
+        if (n > 0) expand_input(in, n, st);
+        if (n > 0 && live) flush_output();
+    }
+    // squeezing starts over in every file
+    st->empty_prev_line = false;
+    end_file(file->path, error);
+}
+
+void expand_input(const unsigned char *in, size_t len, struct cat_state *st) {
+    if (len > 0 && STAT_ENABLED) STAT_ADD(STAT_LINES_SCANNED, count_newlines(in, len));
+    uint64_t since = STAT_CLOCK();
+    if (len > 0 && line_flags(st)) {
+        number_block(in, len, &out, st);
+    } else if (len > 0) {
+        char *end = output_reserve(&out, len * EXPANSION_MAX);
+        out.len = expand_block(in, len, end, st->expansion) - out.data;
+    }
+    STAT_PHASE(PHASE_OUTPUT, since);
+}
+
+// The error of the file, or of the output written since the last one
+void end_file(const char *filename, int error) {
+    if (error == 0) error = out.error;
+    out.error = 0;
+    if (error != 0) report_error(filename, error);
+}
+
+// The output before the message is written first
+void report_error(const char *filename, int error) {
+    flush_output();
+    errno = error;
+    print_error("cat", filename);
+}
+
+// -b, -n and -s a line at a time. The state carries over blocks and files:
+// a line number is only printed when the previous file ended with a newline,
+// a blank line is one that starts with a newline.
+void number_block(const unsigned char *in, size_t len, struct output *out, struct cat_state *st) {
+    const unsigned char *end = in + len;
+    while (in < end) {
+        if (st->line_start) {
+            in = start_line(in, end, out, st);
+        } else {
+            const unsigned char *nl = memchr(in, '\n', end - in);
+            const unsigned char *stop = nl != NULL ? nl : end;
+            output_text(in, stop - in, out, st);
+            st->last_symbol = nl != NULL ? '\n' : stop[-1];
+            if (nl != NULL) output_newline(out, st);
+            st->line_start = nl != NULL;
+            in = nl != NULL ? nl + 1 : end;
+        }
     }
 }
 
-int print_line(FILE *f_stream, struct cat_state *st) {
-    int ch = getc(f_stream);
-    bool only_newline = ch == '\n';
-    bool is_eof = ch == EOF;
+// Prints the line number and handles a blank line as a whole. A run of blank
+// lines after a squeezed one is skipped at once.
+const unsigned char* start_line(const unsigned char *in, const unsigned char *end,
+                                struct output *out, struct cat_state *st) {
+    bool only_newline = *in == '\n';
     #ifdef __APPLE__
     bool is_prev_nl = true;
     #else
@@ -83,51 +214,76 @@ int print_line(FILE *f_stream, struct cat_state *st) {
     #endif
     st->empty_prev_line &= only_newline && st->flags.s_flag;
 
-    if (st->flags.b_flag && !only_newline && !is_eof && is_prev_nl)
-        printf(LINE_N_FMT, st->line_count++);
-    else if (st->flags.n_flag && !is_eof && !st->empty_prev_line && is_prev_nl)
-        printf(LINE_N_FMT, st->line_count++);
-
-    while (ch != EOF && ch != '\n') {
-        if (st->flags.t_flag && ch == '\t')
-            printf("%s", T_TAB);
-        else if (st->flags.v_flag)
-            print_v_format(ch);
-        else
-            putchar(ch);
-        st->last_symbol = ch;
-        ch = getc(f_stream);
+    if (st->flags.b_flag && !only_newline && is_prev_nl)
+        output_line_number(out, st->line_count++);
+    else if (st->flags.n_flag && !st->empty_prev_line && is_prev_nl)
+        output_line_number(out, st->line_count++);
+
+    if (only_newline) {
+        if (!st->empty_prev_line) output_newline(out, st);
+        st->last_symbol = '\n';
+        st->empty_prev_line = st->flags.s_flag;
+        in++;
+        while (st->empty_prev_line && in < end && *in == '\n')
+            in++;
+    } else {
+        st->empty_prev_line = false;
+        st->line_start = false;
     }
+    return in;
+}
 
-    if (ch != EOF) st->last_symbol = ch;
-    if (ch != EOF && !st->empty_prev_line) {
-        if (st->flags.e_flag) putchar('$');
-        putchar(ch);
+// Text of a line without its newline. Expanded text goes right into the
+// buffer, plain text is copied in one span.
+void output_text(const unsigned char *in, size_t len, struct output *out, struct cat_state *st) {
+    if (st->flags.v_flag || st->flags.t_flag) {
+        char *end = output_reserve(out, len * EXPANSION_MAX);
+        out->len = expand_block(in, len, end, st->expansion) - out->data;
+    } else {
+        output_write(out, (const char*) in, len);
     }
+}
 
-    st->empty_prev_line = only_newline && st->flags.s_flag;
+void output_newline(struct output *out, struct cat_state *st) {
+    const struct expansion *e = st->expansion + '\n';
+    output_write(out, e->text, e->len);
+}
 
-    if (ferror(f_stream))
-        print_error();
+// %6zu\t: right-aligned number and a tab
+void output_line_number(struct output *out, size_t number) {
+    output_number(out, number, LINE_N_WIDTH);
+    output_char(out, '\t');
+}
 
-    return ch;
+size_t count_newlines(const unsigned char *in, size_t len) {
+    size_t count = 0;
+    const unsigned char *end = in + len;
+    while ((in = memchr(in, '\n', end - in)) != NULL) {
+        count++;
+        in++;
+    }
+    return count;
 }
 
-void print_v_format(int ch) {
-    int converted_ch = ch % 128;
-    if (ch == 127)
-        printf("^%c", converted_ch - 64);
-    else if (ch >= 128 && converted_ch == 127)
-        printf("%s^%c", M_NOT, converted_ch - 64);
-    else if (ch < 128 && converted_ch < 32 &&
-            converted_ch != 9 && converted_ch != 10)
-        printf("^%c", converted_ch + 64);
-    else if (ch >= 128 && converted_ch < 32)
-        printf("%s^%c", M_NOT, converted_ch + 64);
-    #ifndef __APPLE__
-    else if (ch >= 128)
-        printf("%s%c", M_NOT, converted_ch);
-    #endif
+void flush_output(void) {
+    uint64_t since = STAT_CLOCK();
+    output_flush(&out);
+    STAT_PHASE(PHASE_OUTPUT, since);
+}
+
+// A file read ahead starts on its data, others are opened here
+void print_file(const char *filename, const struct prefetched_file *file, struct cat_state *st) {
+    struct prefetched_file own = { filename, -1, 0, NULL, 0, false };
+    // files that are not regular are left to be opened here
+    if (file == NULL || (file->fd == -1 && file->error == 0)) {
+        own.fd = open(filename, O_RDONLY);
+        own.error = own.fd == -1 ? errno : 0;
+        STAT_ADD(own.fd != -1 ? STAT_FILES_OPENED : STAT_FILES_FAILED, 1);
+        file = &own;
+    }
+    if (file->error == 0)
+        cat_file(file, st);
     else
-        putchar(ch);
+        report_error(filename, file->error);
+    if (own.fd != -1) close(own.fd);
 }
@@ -3,15 +3,31 @@
 
 #define CAT_DEFAULT { \
     { false, false, false, false, false, false }, \
-    1, false, false, '\n' \
+    1, false, false, '\n', true, { { 0 } } \
 };
 
-#define LINE_N_FMT "%6zu\t"
+// Line numbers are right-aligned in this many columns and followed by a tab
+#define LINE_N_WIDTH 6
+
+// Bytes read and expanded at once
+#define CAT_BLOCK_SIZE (64 * 1024)
+
+// Line number, tab and "$\n" at most
+#define LINE_PREFIX_MAX 32
+
+#define CAT_OUTPUT_SIZE (CAT_BLOCK_SIZE * EXPANSION_MAX + LINE_PREFIX_MAX)
 
 #define T_TAB "^I"
 #define M_NOT "M-"
 #define V_NL "^J"
 
+// Bytes from 160 to 254 get M- notation, macOS prints them as they are
+#ifdef __APPLE__
+#define BYTE_M_NOTATION false
+#else
+#define BYTE_M_NOTATION true
+#endif
+
 struct cat_state {
     struct {
         bool b_flag;
@@ -25,14 +41,30 @@ struct cat_state {
     bool empty_prev_line;
     bool filenames;
     int last_symbol;
+    bool line_start;  // the next byte starts a line of the current file
+    struct expansion expansion[256];  // output of every byte under the flags
 };
 
 void read_cmd_flags(struct cat_state *st, size_t argv, char *args[]);
 void read_arg_flags(struct cat_state *st, char *str);
 void cat_files(char *args[], size_t argv, struct cat_state *st);
 void cat_stdin(struct cat_state *st);
-void print_file(const char *filename, struct cat_state *st);
-int print_line(FILE *f_stream, struct cat_state *st);
-void print_v_format(int ch);
+bool has_flags(const struct cat_state *st);
+bool line_flags(const struct cat_state *st);
+void cat_file(const struct prefetched_file *file, struct cat_state *st);
+void copy_file(const struct prefetched_file *file);
+void expand_file(const struct prefetched_file *file, struct cat_state *st);
+void expand_input(const unsigned char *in, size_t len, struct cat_state *st);
+void end_file(const char *filename, int error);
+void report_error(const char *filename, int error);
+void flush_output(void);
+void number_block(const unsigned char *in, size_t len, struct output *out, struct cat_state *st);
+const unsigned char* start_line(const unsigned char *in, const unsigned char *end,
+                                struct output *out, struct cat_state *st);
+void output_text(const unsigned char *in, size_t len, struct output *out, struct cat_state *st);
+void output_newline(struct output *out, struct cat_state *st);
+void output_line_number(struct output *out, size_t number);
+size_t count_newlines(const unsigned char *in, size_t len);
+void print_file(const char *filename, const struct prefetched_file *file, struct cat_state *st);
 
 #endif  // S21_CAT
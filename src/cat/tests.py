@@ -19,7 +19,7 @@ def get_test_files():
 
 
 def get_diff(file1=S21_CAT_FILE, file2=CAT_FILE):
-    with open(file2, "r") as f1, open(file2, "r") as f2:
+    with open(file1, "r") as f1, open(file2, "r") as f2:
         s1 = f1.readlines()
         s2 = f2.readlines()
     return "".join(
@@ -48,6 +48,14 @@ class CatSingleOptionsTestCase(unittest.TestCase):
                 diff = get_diff()
                 self.assertFalse(diff, diff)
 
+    def test_stdin(self):
+        for file in self.test_files:
+            for opts in ('', '-n'):
+                with self.subTest(file=file, options=opts):
+                    execute_cat(opts, '<', file)
+                    diff = get_diff()
+                    self.assertFalse(diff, diff)
+
     def test_n_option(self):
         for file in self.test_files:
             with self.subTest(file=file):
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "output.h"
+#include "stats.h"
+
+// First allocation of an output kept in memory
+#define OUTPUT_MEMORY_SIZE (4 * 1024)
+
+static bool grow(struct output *out, size_t need);
+static void write_spans(struct output *out, const char *data, size_t len);
+
+// An output kept in memory may start without a buffer, it allocates on the first write
+bool output_init(struct output *out, int fd, size_t capacity) {
+    out->data = capacity > 0 ? malloc(capacity) : NULL;
+    out->capacity = out->data != NULL ? capacity : 0;
+    out->len = 0;
+    out->fd = fd;
+    out->terminal = fd != -1 && isatty(fd);
+    out->error = 0;
+    return capacity == 0 || out->data != NULL;
+}
+
+void output_free(struct output *out) {
+    free(out->data);
+    out->data = NULL;
+    out->capacity = 0;
+    out->len = 0;
+}
+
+// Room for need more bytes at the returned end of the data, to be taken by
+// adding to len. NULL once an output kept in memory cannot grow.
+char* output_reserve(struct output *out, size_t need) {
+    if (out->len + need > out->capacity && out->fd != -1) output_flush(out);
+    if (out->len + need > out->capacity && !grow(out, out->len + need)) return NULL;
+    return out->data + out->len;
+}
+
+void output_write(struct output *out, const char *data, size_t len) {
+    if (len == 0) return;
+    if (out->len + len <= out->capacity || (out->fd == -1 && grow(out, out->len + len))) {
+        memcpy(out->data + out->len, data, len);
+        out->len += len;
+    } else if (out->fd != -1) {
+        write_spans(out, data, len);
+    }
+}
+
+void output_string(struct output *out, const char *str) {
+    output_write(out, str, strlen(str));
+}
+
+void output_char(struct output *out, char ch) {
+    if (out->len < out->capacity)
+        out->data[out->len++] = ch;
+    else
+        output_write(out, &ch, 1);
+}
+
+// Right-aligned in width columns, without printf()
+void output_number(struct output *out, size_t number, size_t width) {
+    char digits[OUTPUT_NUMBER_MAX];
+    size_t len = 0;
+    do {
+        digits[OUTPUT_NUMBER_MAX - ++len] = '0' + number % 10;
+        number /= 10;
+    } while (number != 0);
+    for (; width > len; width--)
+        output_char(out, ' ');
+    output_write(out, digits + OUTPUT_NUMBER_MAX - len, len);
+}
+
+void output_flush(struct output *out) {
+    if (out->fd != -1) write_spans(out, NULL, 0);
+}
+
+// Hands the data of an output kept in memory over to the caller, who frees
+// it. The output starts over empty.
+char* output_release(struct output *out, size_t *len) {
+    char *data = out->data;
+    *len = out->len;
+    out->data = NULL;
+    out->capacity = 0;
+    out->len = 0;
+    return data;
+}
+
+static bool grow(struct output *out, size_t need) {
+    size_t capacity = out->capacity > 0 ? out->capacity : OUTPUT_MEMORY_SIZE;
+    while (capacity < need)
+        capacity *= 2;
+    char *data = out->error == 0 ? realloc(out->data, capacity) : NULL;
+    if (data != NULL) {
+        out->data = data;
+        out->capacity = capacity;
+    } else if (out->error == 0) {
+        out->error = ENOMEM;
+    }
+    return data != NULL;
+}
+
+// The buffered bytes and the span after them, written on after short writes
+// and signals. The buffer is empty afterwards, even when the write failed.
+// Callers time the output phase, formatting counts as output too.
+static void write_spans(struct output *out, const char *data, size_t len) {
+    struct iovec spans[2] = { { out->data, out->len }, { (char*) data, len } };
+    struct iovec *next = spans;
+    struct iovec *end = spans + 2;
+    while (next < end && out->error == 0) {
+        ssize_t n = next->iov_len > 0 ? writev(out->fd, next, end - next) : 0;
+        if (n < 0 && errno != EINTR) out->error = errno;
+        if (n > 0) STAT_ADD(STAT_BYTES_WRITTEN, n);
+        while (next < end && n >= 0 && (size_t) n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+        }
+        if (next < end && n > 0) {
+            next->iov_base = (char*) next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+    out->len = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef OUTPUT
+#define OUTPUT
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Buffer of an output written to a descriptor
+#define OUTPUT_BUFFER_SIZE (128 * 1024)
+
+// Widest number output_number() prints
+#define OUTPUT_NUMBER_MAX 20
+
+// Output gathered in one buffer, so it is written with few system calls. A
+// span that does not fit goes out in one writev() with the bytes before it,
+// without being copied. With fd -1 nothing is written: the buffer grows and
+// keeps everything, for output that is printed later.
+struct output {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int fd;
+    bool terminal;  // fd is a terminal, its lines are not held back for long
+    int error;      // errno of the failed write or growth, later output is dropped
+};
+
+bool output_init(struct output *out, int fd, size_t capacity);
+void output_free(struct output *out);
+char* output_reserve(struct output *out, size_t need);
+void output_write(struct output *out, const char *data, size_t len);
+void output_string(struct output *out, const char *str);
+void output_char(struct output *out, char ch);
+void output_number(struct output *out, size_t number, size_t width);
+void output_flush(struct output *out);
+char* output_release(struct output *out, size_t *len);
+
+#endif  // OUTPUT
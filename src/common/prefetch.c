@@ -0,0 +1,359 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "prefetch.h"
+#include "stats.h"
+
+// user_data of a close, the other operations carry the index of their file
+#define CLOSE_DATA UINT64_MAX
+
+static void reset_slot(struct prefetch *p, size_t i);
+static bool start_threads(struct prefetch *p);
+static void* fetch_thread(void *arg);
+static void fetch_file(struct prefetched_file *file);
+static void close_waiting(struct prefetch *p);
+#ifdef __linux__
+static bool uring_init(struct uring *ring, unsigned entries);
+static void uring_free(struct uring *ring);
+static void start_files(struct prefetch *p);
+static void uring_submit(struct prefetch *p, uint8_t opcode, int fd, const void *addr,
+                         uint32_t len, uint64_t offset, uint32_t flags, uint64_t data);
+static void uring_enter(struct prefetch *p, unsigned wait);
+static void uring_step(struct prefetch *p, size_t i, int res);
+#endif
+
+// False when neither io_uring nor a thread can be had, the caller opens and
+// reads the files itself then. So it is for a single file, which has nothing
+// to be read ahead of and is not worth a ring and the buffers.
+bool prefetch_init(struct prefetch *p, char **paths, size_t count) {
+    memset(p, 0, sizeof(*p));
+    if (count < 2) return false;
+    p->paths = paths;
+    p->count = count;
+    p->ring.fd = -1;
+    p->slots = calloc(PREFETCH_FILES, sizeof(struct prefetch_slot));
+    p->buffers = malloc((size_t) PREFETCH_FILES * PREFETCH_SIZE);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->ready, NULL);
+    bool ok = p->slots != NULL && p->buffers != NULL;
+    #ifdef __linux__
+    p->uring = ok && uring_init(&p->ring, 2 * PREFETCH_FILES);
+    if (p->uring) start_files(p);
+    #endif
+    if (ok && !p->uring) ok = start_threads(p);
+    if (!ok) prefetch_free(p);
+    return ok;
+}
+
+// The next operand in order, waited for when it is not ready yet. NULL after
+// the last one. Once the ring fails a file not ready is handed out unopened,
+// its descriptor is closed when the slot is given up.
+struct prefetched_file* prefetch_next(struct prefetch *p) {
+    if (p->next == p->count) return NULL;
+    struct prefetch_slot *slot = p->slots + p->next % PREFETCH_FILES;
+    uint64_t since = STAT_CLOCK();
+    if (p->uring) {
+        #ifdef __linux__
+        uring_enter(p, 0);
+        while (slot->step != STEP_READY && !p->broken)
+            uring_enter(p, 1);
+        if (slot->step != STEP_READY) {
+            struct prefetched_file unopened = { slot->file.path, -1, 0, slot->file.data, 0, false };
+            p->handed = unopened;
+            STAT_PHASE(PHASE_READ, since);
+            return &p->handed;
+        }
+        #endif
+    } else {
+        pthread_mutex_lock(&p->lock);
+        while (p->started <= p->next || slot->step != STEP_READY)
+            pthread_cond_wait(&p->ready, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+    }
+    STAT_PHASE(PHASE_READ, since);
+    return &slot->file;
+}
+
+// Closes the file handed out last, its slot goes to a file further on. With
+// io_uring the close is sent along with the next wait.
+void prefetch_done(struct prefetch *p) {
+    struct prefetch_slot *slot = p->slots + p->next % PREFETCH_FILES;
+    if (p->uring) {
+        #ifdef __linux__
+        if (slot->file.fd != -1 && !p->broken)
+            uring_submit(p, IORING_OP_CLOSE, slot->file.fd, NULL, 0, 0, 0, CLOSE_DATA);
+        else if (slot->file.fd != -1)
+            close(slot->file.fd);
+        slot->step = STEP_WAITING;
+        p->next++;
+        start_files(p);
+        #endif
+    } else {
+        if (slot->file.fd != -1) close(slot->file.fd);
+        pthread_mutex_lock(&p->lock);
+        slot->step = STEP_WAITING;
+        p->next++;
+        pthread_cond_broadcast(&p->work);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+// Files not handed out are given up once the work on them in flight is done.
+// Work a failed ring never completed may still read into the buffers, they
+// are not freed then.
+void prefetch_free(struct prefetch *p) {
+    p->stop = true;
+    if (p->uring) {
+        #ifdef __linux__
+        uring_enter(p, 0);
+        while (p->ring.in_flight > 0 && !p->broken)
+            uring_enter(p, 1);
+        if (p->ring.in_flight > 0) p->buffers = NULL;
+        uring_free(&p->ring);
+        #endif
+    } else {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->work);
+        pthread_mutex_unlock(&p->lock);
+        for (size_t i = 0; i < p->thread_count; i++)
+            pthread_join(p->threads[i], NULL);
+    }
+    if (p->slots != NULL) close_waiting(p);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->ready);
+    free(p->slots);
+    free(p->buffers);
+    p->slots = NULL;
+    p->buffers = NULL;
+}
+
+static void reset_slot(struct prefetch *p, size_t i) {
+    struct prefetch_slot *slot = p->slots + i % PREFETCH_FILES;
+    struct prefetched_file file = { p->paths[i], -1, 0, p->buffers + i % PREFETCH_FILES * PREFETCH_SIZE, 0, false };
+    slot->file = file;
+    slot->step = STEP_OPEN;
+    slot->regular = false;
+}
+
+static void close_waiting(struct prefetch *p) {
+    for (size_t i = p->next; i < p->started; i++) {
+        if (p->slots[i % PREFETCH_FILES].file.fd != -1) close(p->slots[i % PREFETCH_FILES].file.fd);
+    }
+}
+
+static bool start_threads(struct prefetch *p) {
+    while (p->thread_count < PREFETCH_THREADS &&
+           pthread_create(p->threads + p->thread_count, NULL, &fetch_thread, p) == 0)
+        p->thread_count++;
+    return p->thread_count > 0;
+}
+
+// A thread of the fallback takes the next file with a free slot
+static void* fetch_thread(void *arg) {
+    struct prefetch *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        if (p->started < p->count && p->started < p->next + PREFETCH_FILES) {
+            size_t i = p->started++;
+            struct prefetch_slot *slot = p->slots + i % PREFETCH_FILES;
+            reset_slot(p, i);
+            pthread_mutex_unlock(&p->lock);
+            fetch_file(&slot->file);
+            pthread_mutex_lock(&p->lock);
+            slot->step = STEP_READY;
+            pthread_cond_broadcast(&p->ready);
+        } else {
+            pthread_cond_wait(&p->work, &p->lock);
+        }
+    }
+    stats_merge_thread();
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+// Only regular files are opened: opening a FIFO or a terminal ahead of its
+// turn could block, or take input meant for later
+static void fetch_file(struct prefetched_file *file) {
+    struct stat info;
+    if (stat(file->path, &info) != 0 || !S_ISREG(info.st_mode)) return;
+    file->fd = open(file->path, O_RDONLY);
+    STAT_ADD(file->fd != -1 ? STAT_FILES_OPENED : STAT_FILES_FAILED, 1);
+    if (file->fd == -1) file->error = errno;
+    ssize_t n = 1;
+    while (file->fd != -1 && n != 0 && file->error == 0 && file->len < PREFETCH_SIZE) {
+        n = read(file->fd, file->data + file->len, PREFETCH_SIZE - file->len);
+        if (n < 0 && errno != EINTR) file->error = errno;
+        if (n > 0) file->len += n;
+        if (n > 0) STAT_ADD(STAT_BYTES_READ, n);
+    }
+    file->eof = n == 0;
+}
+
+#ifdef __linux__
+// Reads at the file position are needed, so the rest of a file is read by
+// the caller from where the ring stopped. Kernels without them get the
+// fallback, as do systems where io_uring is missing or not allowed.
+static bool uring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    r->fd = syscall(__NR_io_uring_setup, entries, &params);
+    bool ok = r->fd != -1 && (params.features & IORING_FEAT_RW_CUR_POS);
+    if (ok) {
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        r->entries = params.sq_entries;
+        r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (single && r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+        r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->fd, IORING_OFF_SQ_RING);
+        r->cq_ring = single ? r->sq_ring : mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       r->fd, IORING_OFF_SQES);
+        ok = r->sq_ring != MAP_FAILED && r->cq_ring != MAP_FAILED && r->sqes != MAP_FAILED;
+    }
+    if (ok) {
+        char *sq = r->sq_ring;
+        char *cq = r->cq_ring;
+        r->sq_head = (unsigned*) (sq + params.sq_off.head);
+        r->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+        r->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+        r->sq_array = (unsigned*) (sq + params.sq_off.array);
+        r->cq_head = (unsigned*) (cq + params.cq_off.head);
+        r->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+        r->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+        r->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    }
+    if (!ok) uring_free(r);
+    return ok;
+}
+
+static void uring_free(struct uring *r) {
+    if (r->sqes != NULL && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != NULL && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_size);
+    if (r->fd != -1) close(r->fd);
+    r->sqes = NULL;
+    r->cq_ring = NULL;
+    r->sq_ring = NULL;
+    r->fd = -1;
+}
+
+// Files are opened without blocking, so a FIFO does not wait for a writer
+// and the reads of a file in the page cache are done within the submitting
+// call. What that cannot tell apart is looked at with a plain call.
+static void start_files(struct prefetch *p) {
+    for (; !p->broken && p->started < p->count && p->started < p->next + PREFETCH_FILES; p->started++) {
+        reset_slot(p, p->started);
+        uring_submit(p, IORING_OP_OPENAT, AT_FDCWD, p->paths[p->started], 0, 0,
+                     O_RDONLY | O_NONBLOCK, p->started);
+    }
+}
+
+// Queues one operation, submitted with the next uring_enter(). Entries
+// queued and in flight stay below the size of the submission ring, the
+// completion ring is twice that and cannot overflow. Nothing is queued on
+// a failed ring, the file waits to be handed out unopened.
+static void uring_submit(struct prefetch *p, uint8_t opcode, int fd, const void *addr,
+                         uint32_t len, uint64_t offset, uint32_t flags, uint64_t data) {
+    struct uring *r = &p->ring;
+    while (r->queued + r->in_flight >= r->entries && !p->broken)
+        uring_enter(p, r->queued > 0 ? 0 : 1);
+    if (p->broken) return;
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = r->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->open_flags = flags;
+    sqe->user_data = data;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+}
+
+// Submits the queued operations and takes the completions, waiting for at
+// least wait of them. A completion may queue the next step of its file. An
+// error other than an interrupt or a shortage of the moment would come back
+// on every call, the ring is not waited on any more then.
+static void uring_enter(struct prefetch *p, unsigned wait) {
+    struct uring *r = &p->ring;
+    int n = syscall(__NR_io_uring_enter, r->fd, r->queued, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0,
+                    NULL, 0);
+    if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) p->broken = true;
+    if (n > 0) {
+        r->queued -= n;
+        r->in_flight += n;
+    }
+    unsigned head;
+    // re-read every time: a step may take completions itself
+    while ((head = *r->cq_head) != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        const struct io_uring_cqe *cqe = r->cqes + (head & *r->cq_mask);
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+        r->in_flight--;
+        if (data != CLOSE_DATA) uring_step(p, data, res);
+    }
+}
+
+// Like fetch_file(), a step at a time. The first read tells whether the file
+// is regular: one that is not gets its descriptor back in blocking mode, with
+// what that read found, and is read on by the caller. So a FIFO or a terminal
+// is not read ahead past its first chunk. An empty one is closed and left to
+// the caller, a FIFO without a writer reads as empty here.
+static void uring_step(struct prefetch *p, size_t i, int res) {
+    struct prefetch_slot *slot = p->slots + i % PREFETCH_FILES;
+    struct prefetched_file *file = &slot->file;
+    struct stat info;
+    bool regular = true;
+    enum prefetch_step step = STEP_READY;
+    if (slot->step == STEP_OPEN) {
+        file->fd = res >= 0 ? res : -1;
+        file->error = res < 0 ? -res : 0;
+        if (res < 0) STAT_ADD(STAT_FILES_FAILED, 1);
+        if (res >= 0 && !p->stop) step = STEP_READ;
+    } else if (slot->step == STEP_READ) {
+        if (res > 0) file->len += res;
+        if (res > 0) STAT_ADD(STAT_BYTES_READ, res);
+        if (res != -EINTR && !slot->regular)
+            regular = slot->regular = fstat(file->fd, &info) == 0 && S_ISREG(info.st_mode);
+        if (res == -EAGAIN || !regular)
+            fcntl(file->fd, F_SETFL, fcntl(file->fd, F_GETFL) & ~O_NONBLOCK);
+        // not in the page cache: read again, blocking in the kernel's threads
+        bool again = (res > 0 && file->len < PREFETCH_SIZE) || res == -EINTR || res == -EAGAIN;
+        if (again && regular && !p->stop) step = STEP_READ;
+        file->eof = res == 0 && regular;
+        if (res < 0 && res != -EINTR && res != -EAGAIN) file->error = -res;
+        if (res == 0 && !regular) {
+            close(file->fd);
+            file->fd = -1;
+        }
+    }
+    if (step == STEP_READ)
+        uring_submit(p, IORING_OP_READ, file->fd, file->data + file->len, PREFETCH_SIZE - file->len,
+                     (uint64_t) -1, 0, i);
+    if (step == STEP_READY && file->fd != -1) STAT_ADD(STAT_FILES_OPENED, 1);
+    slot->step = step;
+}
+#endif
@@ -0,0 +1,88 @@
+#ifndef PREFETCH
+#define PREFETCH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Files opened and read ahead, the one in use included
+#define PREFETCH_FILES 16
+
+// Bytes read ahead of each file, a file up to this size is read whole
+#define PREFETCH_SIZE (64 * 1024)
+
+// Threads reading ahead where io_uring cannot be used
+#define PREFETCH_THREADS 4
+
+// A file as it is handed over. The data was read from fd already, the rest
+// of the file is read from fd by the caller. A file that is not regular or
+// could not be looked up is not opened: fd is -1 with no error, and the
+// caller opens it and reports its errors as it always did.
+struct prefetched_file {
+    const char *path;
+    int fd;       // -1 when not opened
+    int error;    // errno of the open, or of a read after the data
+    char *data;
+    size_t len;
+    bool eof;     // data is the whole file
+};
+
+enum prefetch_step { STEP_WAITING, STEP_OPEN, STEP_READ, STEP_READY };
+
+struct prefetch_slot {
+    struct prefetched_file file;
+    enum prefetch_step step;
+    bool regular;  // fstat after the first read found a regular file
+};
+
+// Submission and completion rings shared with the kernel
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned queued;     // entries not submitted yet
+    unsigned in_flight;  // submitted and not completed
+};
+
+// Operands read ahead of the one in use, handed out in their order. With
+// io_uring the lookups, opens, reads and closes of all slots go to the kernel
+// in one system call; without it a few threads do them with plain calls.
+struct prefetch {
+    char **paths;
+    size_t count;
+    size_t next;     // file handed out next
+    size_t started;  // files given a slot
+    struct prefetch_slot *slots;  // file i is in slot i % PREFETCH_FILES
+    struct prefetched_file handed;  // a file handed out unopened by a failed ring
+    char *buffers;
+    bool uring;
+    bool broken;     // io_uring_enter failed, files not ready are left to the caller
+    bool stop;
+    struct uring ring;
+    pthread_t threads[PREFETCH_THREADS];
+    size_t thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;   // a slot is free or the threads stop
+    pthread_cond_t ready;  // a file is ready
+};
+
+bool prefetch_init(struct prefetch *p, char **paths, size_t count);
+struct prefetched_file* prefetch_next(struct prefetch *p);
+void prefetch_done(struct prefetch *p);
+void prefetch_free(struct prefetch *p);
+
+#endif  // PREFETCH
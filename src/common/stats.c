@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#ifndef NO_STATS
+
+bool stats_enabled = false;
+_Thread_local struct stats thread_stats;
+static struct stats totals;  // merged worker threads
+
+static const char *counter_names[STAT_COUNTERS] = {
+    "bytes_read", "lines_scanned", "files_opened", "files_failed", "regcomp_calls",
+    "regexec_calls", "matches", "offset_merges", "bytes_written"
+};
+
+static const char *phase_names[STAT_PHASES] = {
+    "parse", "compile", "read", "match", "output"
+};
+
+void stats_enable() {
+    stats_enabled = true;
+}
+
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Adds the counts of the calling thread to the totals. The caller holds
+// whatever lock serializes the threads.
+void stats_merge_thread() {
+    for (int i = 0; i < STAT_COUNTERS; i++)
+        totals.counters[i] += thread_stats.counters[i];
+    for (int i = 0; i < STAT_PHASES; i++)
+        totals.phase_ns[i] += thread_stats.phase_ns[i];
+    memset(&thread_stats, 0, sizeof(thread_stats));
+}
+
+// One line of JSON on stderr, called by the main thread at exit
+void stats_report(const char *program) {
+    if (stats_enabled) {
+        stats_merge_thread();
+        fprintf(stderr, "{\"program\": \"%s\"", program);
+        for (int i = 0; i < STAT_COUNTERS; i++)
+            fprintf(stderr, ", \"%s\": %llu", counter_names[i], (unsigned long long) totals.counters[i]);
+        fprintf(stderr, ", \"time_ns\": {");
+        for (int i = 0; i < STAT_PHASES; i++)
+            fprintf(stderr, "%s\"%s\": %llu", i ? ", " : "", phase_names[i],
+                    (unsigned long long) totals.phase_ns[i]);
+        fprintf(stderr, "}}\n");
+    }
+}
+
+#endif  // NO_STATS
@@ -0,0 +1,80 @@
+#ifndef STATS
+#define STATS
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Counters and phase times of --stats. Every thread counts into its own copy,
+// worker threads merge theirs into the totals before they end. Built with
+// -DNO_STATS all of it compiles to nothing.
+
+enum stats_counter {
+    STAT_BYTES_READ,
+    STAT_LINES_SCANNED,
+    STAT_FILES_OPENED,
+    STAT_FILES_FAILED,
+    STAT_REGCOMP_CALLS,
+    STAT_REGEXEC_CALLS,
+    STAT_MATCHES,
+    STAT_OFFSET_MERGES,
+    STAT_BYTES_WRITTEN,
+    STAT_COUNTERS
+};
+
+enum stats_phase {
+    PHASE_PARSE,
+    PHASE_COMPILE,
+    PHASE_READ,
+    PHASE_MATCH,
+    PHASE_OUTPUT,
+    STAT_PHASES
+};
+
+struct stats {
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t phase_ns[STAT_PHASES];  // summed over all threads
+};
+
+#ifndef NO_STATS
+
+extern bool stats_enabled;
+extern _Thread_local struct stats thread_stats;
+
+#define STAT_ENABLED stats_enabled
+// Counters are plain thread-local adds and are always on
+#define STAT_ADD(counter, n) (thread_stats.counters[counter] += (n))
+#define STAT_NOW() stats_now()
+// Clock reads in hot paths only happen with --stats
+#define STAT_CLOCK() (stats_enabled ? stats_now() : 0)
+#define STAT_PHASE(phase, since) \
+    do { if (stats_enabled) thread_stats.phase_ns[phase] += stats_now() - (since); } while (0)
+// Time spent in an inner phase is taken off the enclosing one
+#define STAT_NESTED_PHASE(phase, outer, since) \
+    do { \
+        if (stats_enabled) { \
+            uint64_t spent = stats_now() - (since); \
+            thread_stats.phase_ns[phase] += spent; \
+            thread_stats.phase_ns[outer] -= spent; \
+        } \
+    } while (0)
+
+void stats_enable();
+uint64_t stats_now();
+void stats_merge_thread();
+void stats_report(const char *program);
+
+#else
+
+#define STAT_ENABLED false
+#define STAT_ADD(counter, n) ((void) 0)
+#define STAT_NOW() 0
+#define STAT_CLOCK() 0
+#define STAT_PHASE(phase, since) ((void) (since))
+#define STAT_NESTED_PHASE(phase, outer, since) ((void) (since))
+#define stats_enable() ((void) 0)
+#define stats_merge_thread() ((void) 0)
+#define stats_report(program) ((void) (program))
+
+#endif  // NO_STATS
+
+#endif  // STATS
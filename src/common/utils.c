@@ -15,3 +15,13 @@ void print_error(char *program, char *context) {
 size_t get_dash_index(const char *str) {
     return strspn(str, "-");
 }
+
+// Portable memrchr()
+const char* find_last(const char *str, int ch, size_t len) {
+    const char *result = NULL;
+    while (len > 0 && result == NULL) {
+        len--;
+        if (str[len] == (char) ch) result = str + len;
+    }
+    return result;
+}
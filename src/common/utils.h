@@ -3,5 +3,6 @@
 
 void print_error();
 size_t get_dash_index(const char *str);
+const char* find_last(const char *str, int ch, size_t len);
 
 #endif  // UTILS
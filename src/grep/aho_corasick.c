@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "aho_corasick.h"
+#include "fixed_search.h"
+
+static bool grow_states(struct aho_corasick *ac);
+static bool grow_patterns(struct aho_corasick *ac);
+static uint32_t trie_child(const struct aho_corasick *ac, uint32_t state, unsigned char ch);
+static uint32_t new_state(struct aho_corasick *ac, uint32_t parent, unsigned char ch);
+static bool link_failures(struct aho_corasick *ac, uint32_t *order);
+static bool flatten(struct aho_corasick *ac, const uint32_t *order);
+static uint32_t find_edge(const struct aho_corasick *ac, uint32_t state, unsigned char ch);
+static uint32_t ac_next(const struct aho_corasick *ac, uint32_t state, unsigned char ch);
+
+bool ac_init(struct aho_corasick *ac, bool icase) {
+    memset(ac, 0, sizeof(*ac));
+    ac->icase = icase;
+    ac->fold = icase ? fold_table : same_table;
+    return new_state(ac, AC_NONE, 0) == 0;
+}
+
+void ac_free(struct aho_corasick *ac) {
+    free(ac->ids);
+    free(ac->lengths);
+    free(ac->next_out);
+    free(ac->states);
+    free(ac->edges);
+    free(ac->dense);
+    free(ac->child);
+    free(ac->sibling);
+    free(ac->label);
+    memset(ac, 0, sizeof(*ac));
+}
+
+// Inserts the pattern into the trie, id is reported back for every occurrence
+bool ac_add(struct aho_corasick *ac, const char *pattern, size_t id) {
+    bool ok = grow_patterns(ac);
+    uint32_t state = 0;
+    size_t len = 0;
+    for (; ok && pattern[len]; len++) {
+        unsigned char ch = ac->fold[(unsigned char) pattern[len]];
+        uint32_t next = trie_child(ac, state, ch);
+        if (next == AC_NONE) next = new_state(ac, state, ch);
+        ok = next != AC_NONE;
+        state = next;
+    }
+    if (ok) {
+        uint32_t index = ac->pattern_count++;
+        ac->ids[index] = id;
+        ac->lengths[index] = len;
+        ac->next_out[index] = ac->states[state].out;
+        ac->states[state].out = index;
+    }
+    return ok;
+}
+
+// Computes failure links and lays the trie out for scanning
+bool ac_compile(struct aho_corasick *ac) {
+    uint32_t *order = malloc(sizeof(uint32_t) * ac->state_count);
+    bool ok = order != NULL && link_failures(ac, order) && flatten(ac, order);
+    free(order);
+    free(ac->child);
+    free(ac->sibling);
+    free(ac->label);
+    ac->child = ac->sibling = NULL;
+    ac->label = NULL;
+    return ok;
+}
+
+// Finds the occurrence that ends first, end is set past its last byte
+bool ac_find(const struct aho_corasick *ac, const char *text, size_t len, size_t *end) {
+    uint32_t state = 0;
+    bool match = false;
+    size_t i = 0;
+    for (; i < len && !match; i++) {
+        unsigned char ch = ac->fold[(unsigned char) text[i]];
+        state = ac_next(ac, state, ch);
+        match = ac->states[state].out != AC_NONE || ac->states[state].dict != AC_NONE;
+    }
+    *end = i;
+    return match;
+}
+
+// Reports all occurrences of all patterns, overlapping ones included
+bool ac_find_all(const struct aho_corasick *ac, const char *text, size_t len, ac_callback cb, void *ctx) {
+    uint32_t state = 0;
+    bool proceed = true;
+    for (size_t i = 0; i < len && proceed; i++) {
+        unsigned char ch = ac->fold[(unsigned char) text[i]];
+        state = ac_next(ac, state, ch);
+        uint32_t out_state = ac->states[state].out != AC_NONE ? state : ac->states[state].dict;
+        while (out_state != AC_NONE && proceed) {
+            for (uint32_t p = ac->states[out_state].out; p != AC_NONE && proceed; p = ac->next_out[p])
+                proceed = cb(ctx, ac->ids[p], i + 1 - ac->lengths[p], i + 1);
+            out_state = ac->states[out_state].dict;
+        }
+    }
+    return proceed;
+}
+
+static uint32_t ac_next(const struct aho_corasick *ac, uint32_t state, unsigned char ch) {
+    uint32_t next = AC_NONE;
+    while (next == AC_NONE && state >= ac->dense_count) {
+        next = find_edge(ac, state, ch);
+        state = ac->states[state].fail;
+    }
+    return next != AC_NONE ? next : ac->dense[state * AC_ALPHABET + ch];
+}
+
+// Edges of sparse states are sorted by byte
+static uint32_t find_edge(const struct aho_corasick *ac, uint32_t state, unsigned char ch) {
+    const struct ac_edge *edges = ac->edges + ac->states[state].first_edge;
+    size_t lo = 0, hi = ac->states[state].edge_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (edges[mid].byte < ch) lo = mid + 1;
+        else                      hi = mid;
+    }
+    return lo < ac->states[state].edge_count && edges[lo].byte == ch ? edges[lo].next : AC_NONE;
+}
+
+static uint32_t trie_child(const struct aho_corasick *ac, uint32_t state, unsigned char ch) {
+    uint32_t child = ac->child[state];
+    while (child != AC_NONE && ac->label[child] != ch)
+        child = ac->sibling[child];
+    return child;
+}
+
+static uint32_t new_state(struct aho_corasick *ac, uint32_t parent, unsigned char ch) {
+    if (!grow_states(ac)) return AC_NONE;
+    uint32_t state = ac->state_count++;
+    ac->states[state] = (struct ac_state) { 0, 0, 0, AC_NONE, AC_NONE };
+    ac->child[state] = AC_NONE;
+    ac->label[state] = ch;
+    ac->sibling[state] = AC_NONE;
+    if (parent != AC_NONE) {
+        ac->sibling[state] = ac->child[parent];
+        ac->child[parent] = state;
+    }
+    return state;
+}
+
+// Breadth-first walk: fills order and sets fail/dict links in trie numbering
+static bool link_failures(struct aho_corasick *ac, uint32_t *order) {
+    size_t head = 0, tail = 0;
+    order[tail++] = 0;
+    while (head < tail) {
+        uint32_t state = order[head++];
+        for (uint32_t child = ac->child[state]; child != AC_NONE; child = ac->sibling[child]) {
+            uint32_t fail = AC_NONE;
+            uint32_t f = state;
+            while (fail == AC_NONE && f != 0) {
+                f = ac->states[f].fail;
+                fail = trie_child(ac, f, ac->label[child]);
+            }
+            ac->states[child].fail = fail == AC_NONE ? 0 : fail;
+            f = ac->states[child].fail;
+            ac->states[child].dict = ac->states[f].out != AC_NONE ? f : ac->states[f].dict;
+            order[tail++] = child;
+        }
+    }
+    return tail == ac->state_count;
+}
+
+// Renumbers states in BFS order, stores sorted edges and dense rows
+static bool flatten(struct aho_corasick *ac, const uint32_t *order) {
+    uint32_t *new_id = malloc(sizeof(uint32_t) * ac->state_count);
+    struct ac_state *states = malloc(sizeof(struct ac_state) * ac->state_count);
+    struct ac_edge *edges = malloc(sizeof(struct ac_edge) * (ac->state_count + 1));
+    ac->dense_count = ac->state_count < AC_DENSE_STATES ? ac->state_count : AC_DENSE_STATES;
+    ac->dense = malloc(sizeof(uint32_t) * AC_ALPHABET * ac->dense_count);
+    bool ok = new_id != NULL && states != NULL && edges != NULL && ac->dense != NULL;
+    for (size_t i = 0; ok && i < ac->state_count; i++)
+        new_id[order[i]] = i;
+    size_t edge_count = 0;
+    for (size_t i = 0; ok && i < ac->state_count; i++) {
+        const struct ac_state *old = ac->states + order[i];
+        states[i].first_edge = edge_count;
+        for (uint32_t child = ac->child[order[i]]; child != AC_NONE; child = ac->sibling[child]) {
+            struct ac_edge edge = { ac->label[child], new_id[child] };
+            size_t j = edge_count++;
+            for (; j > states[i].first_edge && edges[j - 1].byte > edge.byte; j--)
+                edges[j] = edges[j - 1];
+            edges[j] = edge;
+        }
+        states[i].edge_count = edge_count - states[i].first_edge;
+        states[i].fail = new_id[old->fail];
+        states[i].out = old->out;
+        states[i].dict = old->dict == AC_NONE ? AC_NONE : new_id[old->dict];
+    }
+    if (ok) {
+        free(ac->states);
+        ac->states = states;
+        ac->edges = edges;
+        ac->edge_count = edge_count;
+        states = NULL;
+        edges = NULL;
+    }
+    // Parents and failure targets are shallower, so their rows are ready first
+    for (size_t i = 0; ok && i < ac->dense_count; i++) {
+        uint32_t *row = ac->dense + i * AC_ALPHABET;
+        for (int ch = 0; ch < AC_ALPHABET; ch++)
+            row[ch] = i == 0 ? 0 : ac->dense[ac->states[i].fail * AC_ALPHABET + ch];
+        for (uint32_t e = 0; e < ac->states[i].edge_count; e++) {
+            const struct ac_edge *edge = ac->edges + ac->states[i].first_edge + e;
+            row[edge->byte] = edge->next;
+        }
+    }
+    free(new_id);
+    free(states);
+    free(edges);
+    return ok;
+}
+
+static bool grow_states(struct aho_corasick *ac) {
+    bool ok = true;
+    if (ac->state_count == ac->state_capacity) {
+        size_t capacity = ac->state_capacity ? ac->state_capacity * 2 : 64;
+        struct ac_state *states = realloc(ac->states, sizeof(struct ac_state) * capacity);
+        if (states != NULL) ac->states = states;
+        uint32_t *child = realloc(ac->child, sizeof(uint32_t) * capacity);
+        if (child != NULL) ac->child = child;
+        uint32_t *sibling = realloc(ac->sibling, sizeof(uint32_t) * capacity);
+        if (sibling != NULL) ac->sibling = sibling;
+        unsigned char *label = realloc(ac->label, capacity);
+        if (label != NULL) ac->label = label;
+        ok = states != NULL && child != NULL && sibling != NULL && label != NULL;
+        if (ok) ac->state_capacity = capacity;
+    }
+    return ok;
+}
+
+static bool grow_patterns(struct aho_corasick *ac) {
+    bool ok = true;
+    size_t count = ac->pattern_count;
+    if ((count & (count - 1)) == 0) {
+        size_t capacity = count ? count * 2 : 1;
+        size_t *ids = realloc(ac->ids, sizeof(size_t) * capacity);
+        if (ids != NULL) ac->ids = ids;
+        size_t *lengths = realloc(ac->lengths, sizeof(size_t) * capacity);
+        if (lengths != NULL) ac->lengths = lengths;
+        uint32_t *next_out = realloc(ac->next_out, sizeof(uint32_t) * capacity);
+        if (next_out != NULL) ac->next_out = next_out;
+        ok = ids != NULL && lengths != NULL && next_out != NULL;
+    }
+    return ok;
+}
@@ -0,0 +1,59 @@
+#ifndef AHO_CORASICK
+#define AHO_CORASICK
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define AC_ALPHABET 256
+#define AC_DENSE_STATES 256  // shallowest states get full 256-entry rows
+#define AC_NONE UINT32_MAX
+
+struct ac_edge {
+    unsigned char byte;
+    uint32_t next;
+};
+
+// After ac_compile() states are numbered in BFS order, so the hot shallow
+// states come first and have dense rows; deeper ones keep sorted edge lists
+struct ac_state {
+    uint32_t first_edge;
+    uint32_t edge_count;
+    uint32_t fail;
+    uint32_t out;   // first pattern ending in this state
+    uint32_t dict;  // nearest state on the failure chain with output
+};
+
+struct aho_corasick {
+    bool icase;
+    const unsigned char *fold;  // fold_table under icase, same_table otherwise
+    // Patterns
+    size_t pattern_count;
+    size_t *ids;
+    size_t *lengths;
+    uint32_t *next_out;  // next pattern ending in the same state
+    // Automaton
+    size_t state_count;
+    size_t state_capacity;
+    struct ac_state *states;
+    struct ac_edge *edges;
+    size_t edge_count;
+    uint32_t *dense;
+    size_t dense_count;
+    uint32_t *child;    // trie links used only while building
+    uint32_t *sibling;
+    unsigned char *label;
+};
+
+// Receives every occurrence in the order of its end offset; false stops the scan
+typedef bool (*ac_callback)(void *ctx, size_t id, size_t start, size_t end);
+
+bool ac_init(struct aho_corasick *ac, bool icase);
+bool ac_add(struct aho_corasick *ac, const char *pattern, size_t id);
+bool ac_compile(struct aho_corasick *ac);
+void ac_free(struct aho_corasick *ac);
+
+bool ac_find(const struct aho_corasick *ac, const char *text, size_t len, size_t *end);
+bool ac_find_all(const struct aho_corasick *ac, const char *text, size_t len, ac_callback cb, void *ctx);
+
+#endif  // AHO_CORASICK
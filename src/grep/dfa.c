@@ -0,0 +1,983 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <regex.h>
+
+#include "dfa.h"
+#include "fixed_search.h"
+
+#define DFA_DUP_MAX 0x7fff     // RE_DUP_MAX of the regex library
+#define DFA_MAX_NODES 4096
+#define DFA_TABLE_SIZE (2 * DFA_MAX_STATES)
+
+// State flags: the anchored start is not added again after every byte, at
+// a line start ^ can match
+#define STATE_ANCHORED 1
+#define STATE_LINE_START 2
+
+enum node_type {
+    NODE_EMPTY, NODE_SET, NODE_CAT, NODE_ALT, NODE_REPEAT, NODE_BOL, NODE_EOL, NODE_OPAQUE
+};
+
+struct node {
+    uint8_t type;
+    int32_t a, b;  // children, a is the byte set of NODE_SET
+    int min, max;  // NODE_REPEAT, max is -1 without a limit
+};
+
+enum token_type {
+    TOKEN_CHAR, TOKEN_ANY, TOKEN_BRACKET, TOKEN_OPEN, TOKEN_CLOSE, TOKEN_ALT, TOKEN_STAR,
+    TOKEN_PLUS, TOKEN_QUESTION, TOKEN_INTERVAL, TOKEN_BOL, TOKEN_EOL, TOKEN_OPAQUE, TOKEN_END
+};
+
+// Anything the parser does not know for sure how regcomp() would take sets
+// failed, and the pattern is left to the regex library. Looking for literals
+// only, backreferences and word operators are taken as opaque atoms.
+struct parser {
+    const char *pos;
+    bool ere;
+    bool icase;
+    bool opaque;
+    bool failed;
+    int depth;
+    enum token_type token;
+    unsigned char ch;
+    struct node *nodes;
+    size_t node_count;
+    uint64_t (*sets)[4];
+    size_t set_count;
+    size_t set_capacity;
+};
+
+// What a subexpression tells about the literals in its matches, cut to
+// DFA_LITERAL_SIZE bytes: a prefix keeps its start, a suffix its end
+struct literal_info {
+    bool exact;                 // it only matches whole
+    char whole[DFA_LITERAL_SIZE + 1];
+    char prefix[DFA_LITERAL_SIZE + 1];
+    char suffix[DFA_LITERAL_SIZE + 1];
+    struct dfa_literals must;   // one of them is in every match
+};
+
+struct compiler {
+    struct dfa_inst *insts;
+    size_t count;
+    const struct node *nodes;
+    bool failed;
+};
+
+static int32_t parse_patterns(struct parser *ps, const char *const *patterns, size_t count);
+static void next_token(struct parser *ps, bool expression_start);
+static int32_t parse_regexp(struct parser *ps);
+static int32_t parse_branch(struct parser *ps);
+static int32_t parse_piece(struct parser *ps);
+static int32_t parse_atom(struct parser *ps);
+static int32_t parse_interval(struct parser *ps, int32_t sub);
+static bool parse_number(struct parser *ps, int *number);
+static int32_t parse_bracket(struct parser *ps);
+static bool add_class(uint64_t *set, const char *name, size_t len);
+static int32_t new_node(struct parser *ps, uint8_t type, int32_t a, int32_t b);
+static int32_t new_set(struct parser *ps, const uint64_t *set);
+static int32_t char_node(struct parser *ps, unsigned char ch);
+static void set_add(uint64_t *set, unsigned char ch);
+static bool set_has(const uint64_t *set, unsigned ch);
+static void fold_set(uint64_t *set);
+
+static void analyze(const struct parser *ps, int32_t n, struct literal_info *info);
+static void analyze_cat(struct literal_info *a, const struct literal_info *b);
+static void analyze_alt(struct literal_info *a, const struct literal_info *b);
+static void analyze_repeat(struct literal_info *info, int min, int max);
+static int set_literal(const struct parser *ps, const uint64_t *set);
+static void join(char *to, const char *s1, const char *s2, bool keep_end);
+static void take_better(struct dfa_literals *must, const struct dfa_literals *other);
+static void take_better_string(struct dfa_literals *must, const char *str);
+static size_t shortest(const struct dfa_literals *literals);
+
+static uint32_t emit(struct compiler *c, uint8_t op, uint32_t x, uint32_t y);
+static void compile_node(struct compiler *c, int32_t n);
+static void compile_repeat(struct compiler *c, const struct node *node);
+static bool build_classes(struct dfa_program *prog, uint64_t (*sets)[4], size_t set_count);
+static void free_program(struct dfa_program *prog);
+static void find_skip(struct dfa *d);
+
+static bool init_cache(struct dfa *d);
+static void flush_cache(struct dfa *d);
+static uint32_t start_state(struct dfa *d, bool anchored, bool line_start);
+static uint32_t transition(struct dfa *d, uint32_t *state, unsigned cls);
+static bool eot_match(struct dfa *d, uint32_t state);
+static size_t closure(struct dfa *d, const uint32_t *from, size_t count, uint8_t flags, bool eol,
+                      uint32_t *out);
+static uint32_t add_state(struct dfa *d, const uint32_t *pcs, size_t count, uint8_t flags);
+static bool dfa_longest(struct dfa *d, const char *text, size_t start, size_t len, size_t *end);
+
+// Parses the pattern like regcomp() with REG_NEWLINE does and builds the
+// NFA. False means the pattern is for regexec(): backreferences, word
+// operators, equivalence classes, errors, and programs too large.
+bool dfa_compile(struct dfa *d, const char *pattern, int cflags) {
+    return dfa_compile_set(d, &pattern, 1, cflags);
+}
+
+// One DFA for the alternation of all patterns. Each is parsed on its own,
+// so ^ and * at its start mean what they mean there.
+bool dfa_compile_set(struct dfa *d, const char *const *patterns, size_t count, int cflags) {
+    struct parser ps = { NULL, cflags & REG_EXTENDED, cflags & REG_ICASE, false, false, 0,
+                         TOKEN_END, 0, NULL, 0, NULL, 0, 0 };
+    memset(d, 0, sizeof(*d));
+    int32_t root = parse_patterns(&ps, patterns, count);
+    struct compiler c = { malloc(sizeof(struct dfa_inst) * DFA_MAX_INSTS), 0, ps.nodes, false };
+    c.failed = ps.failed || c.insts == NULL;
+    if (!c.failed) {
+        compile_node(&c, root);
+        emit(&c, DFA_MATCH, 0, 0);
+    }
+    d->prog = c.failed ? NULL : calloc(1, sizeof(struct dfa_program));
+    bool ok = d->prog != NULL;
+    if (ok) {
+        d->prog->insts = c.insts;
+        d->prog->inst_count = c.count;
+        c.insts = NULL;
+        ok = build_classes(d->prog, ps.sets, ps.set_count) && init_cache(d);
+    }
+    if (ok) find_skip(d);
+    free(c.insts);
+    free(ps.nodes);
+    free(ps.sets);
+    if (!ok) dfa_free(d);
+    return ok;
+}
+
+// Literals one of which every match of any of the patterns contains, for a
+// prefilter. Under REG_ICASE they are lowercase and meant to be searched
+// without case. False if there are none, or none worth searching for.
+bool dfa_literals(const char *const *patterns, size_t count, int cflags,
+                  struct dfa_literals *literals) {
+    struct parser ps = { NULL, cflags & REG_EXTENDED, cflags & REG_ICASE, true, false, 0,
+                         TOKEN_END, 0, NULL, 0, NULL, 0, 0 };
+    int32_t root = parse_patterns(&ps, patterns, count);
+    struct literal_info info;
+    info.must.count = 0;
+    if (!ps.failed) analyze(&ps, root, &info);
+    *literals = info.must;
+    free(ps.nodes);
+    free(ps.sets);
+    return literals->count > 0 && shortest(literals) > 0;
+}
+
+bool dfa_clone(const struct dfa *d, struct dfa *clone) {
+    memset(clone, 0, sizeof(*clone));
+    clone->prog = d->prog;
+    clone->shared = true;
+    bool ok = init_cache(clone);
+    if (!ok) dfa_free(clone);
+    return ok;
+}
+
+void dfa_free(struct dfa *d) {
+    if (d->prog != NULL && !d->shared) {
+        free_program(d->prog);
+        free(d->prog);
+    }
+    free(d->states);
+    free(d->trans);
+    free(d->pool);
+    free(d->table);
+    free(d->work);
+    free(d->stack);
+    free(d->mark);
+    memset(d, 0, sizeof(*d));
+}
+
+// Byte the search start state jumps to with memchr, -1 if it has to step
+int dfa_lead_byte(const struct dfa *d) {
+    return d->prog->skip_to;
+}
+
+// Earliest position at or after start where a match ends. Lines are split
+// at '\n', ^ matches at start only when it is a line start.
+bool dfa_first_end(struct dfa *d, const char *text, size_t start, size_t len, size_t *end) {
+    const uint8_t *classes = d->prog->classes;
+    size_t class_count = d->prog->class_count;
+    const bool *skip = d->prog->skip;
+    int skip_to = d->prog->skip_to;
+    uint32_t state = start_state(d, false, start == 0 || text[start - 1] == '\n');
+    for (size_t i = start; i < len; i++) {
+        // nothing has begun to match: go to the next byte that starts a match
+        if (state == d->starts[0] && skip_to >= 0) {
+            const char *next = memchr(text + i, skip_to, len - i);
+            i = next != NULL ? (size_t) (next - text) : len;
+        } else if (state == d->starts[0]) {
+            while (i < len && skip[(unsigned char) text[i]])
+                i++;
+        }
+        if (i == len) break;
+        unsigned cls = classes[(unsigned char) text[i]];
+        uint32_t t = d->trans[state * class_count + cls];
+        if (t == DFA_UNKNOWN) t = transition(d, &state, cls);
+        if (t & DFA_MATCH_BIT) {
+            *end = i;
+            return true;
+        }
+        state = t;
+    }
+    bool match = eot_match(d, state);
+    if (match) *end = len;
+    return match;
+}
+
+// Leftmost-longest match at or after start, like regexec() with REG_STARTEND.
+// The earliest match end bounds the leftmost start, the starts up to it are
+// tried in order with the anchored DFA.
+bool dfa_exec(struct dfa *d, const char *text, size_t start, size_t len, size_t *so, size_t *eo) {
+    size_t first_end = 0;
+    bool match = dfa_first_end(d, text, start, len, &first_end);
+    bool found = false;
+    for (size_t s = start; match && !found && s <= first_end; s++) {
+        if (s < len && !d->prog->first[(unsigned char) text[s]]) continue;
+        found = dfa_longest(d, text, s, len, eo);
+        *so = s;
+    }
+    return found;
+}
+
+static bool dfa_longest(struct dfa *d, const char *text, size_t start, size_t len, size_t *end) {
+    const uint8_t *classes = d->prog->classes;
+    size_t class_count = d->prog->class_count;
+    uint32_t state = start_state(d, true, start == 0 || text[start - 1] == '\n');
+    bool found = false;
+    size_t i = start;
+    for (; i < len && d->states[state].count > 0; i++) {
+        unsigned cls = classes[(unsigned char) text[i]];
+        uint32_t t = d->trans[state * class_count + cls];
+        if (t == DFA_UNKNOWN) t = transition(d, &state, cls);
+        if (t & DFA_MATCH_BIT) {
+            found = true;
+            *end = i;
+        }
+        state = t & ~DFA_MATCH_BIT;
+    }
+    if (i == len && eot_match(d, state)) {
+        found = true;
+        *end = len;
+    }
+    return found;
+}
+
+// Parser
+
+// The alternation of the patterns, each parsed on its own
+static int32_t parse_patterns(struct parser *ps, const char *const *patterns, size_t count) {
+    ps->nodes = malloc(sizeof(struct node) * DFA_MAX_NODES);
+    ps->failed = ps->nodes == NULL || count == 0;
+    int32_t root = -1;
+    for (size_t i = 0; i < count && !ps->failed; i++) {
+        ps->pos = patterns[i];
+        ps->failed = strchr(patterns[i], '\n') != NULL;
+        if (!ps->failed) next_token(ps, true);
+        int32_t branch = parse_regexp(ps);
+        ps->failed |= ps->token != TOKEN_END;
+        root = i == 0 ? branch : new_node(ps, NODE_ALT, root, branch);
+    }
+    return root;
+}
+
+static void next_token(struct parser *ps, bool expression_start) {
+    const char *p = ps->pos;
+    unsigned char ch = *p;
+    ps->ch = ch;
+    ps->pos = p + 1;
+    if (ch == '\0') {
+        ps->token = TOKEN_END;
+        ps->pos = p;
+    } else if (ch == '\\') {
+        unsigned char next = p[1];
+        ps->pos = p + 2;
+        ps->ch = next;
+        ps->token = TOKEN_CHAR;
+        if (next != '\0' && (isalnum(next) || strchr("<>`'", next)) && ps->opaque) {
+            ps->token = TOKEN_OPAQUE;
+        } else if (next == '\0' || isalnum(next) || strchr("<>`'", next)) {
+            ps->failed = true;
+            ps->token = TOKEN_END;
+        } else if (!ps->ere) {
+            if (next == '(')      ps->token = TOKEN_OPEN;
+            else if (next == ')') ps->token = TOKEN_CLOSE;
+            else if (next == '|') ps->token = TOKEN_ALT;
+            else if (next == '{') ps->token = TOKEN_INTERVAL;
+            else if (next == '+') ps->token = TOKEN_PLUS;
+            else if (next == '?') ps->token = TOKEN_QUESTION;
+        }
+    } else if (ch == '.') {
+        ps->token = TOKEN_ANY;
+    } else if (ch == '[') {
+        ps->token = TOKEN_BRACKET;
+    } else if (ch == '*') {
+        // a BRE starting with * takes it literally
+        ps->token = ps->ere || !expression_start ? TOKEN_STAR : TOKEN_CHAR;
+    } else if (ch == '^') {
+        ps->token = ps->ere || expression_start ? TOKEN_BOL : TOKEN_CHAR;
+    } else if (ch == '$') {
+        // in a BRE $ anchors only at the end of the pattern or a branch
+        bool last = p[1] == '\0' || (p[1] == '\\' && (p[2] == ')' || p[2] == '|'));
+        ps->token = ps->ere || last ? TOKEN_EOL : TOKEN_CHAR;
+    } else if (ps->ere && strchr("()|{+?", ch)) {
+        const enum token_type types[] = { TOKEN_OPEN, TOKEN_CLOSE, TOKEN_ALT, TOKEN_INTERVAL,
+                                          TOKEN_PLUS, TOKEN_QUESTION };
+        ps->token = types[strchr("()|{+?", ch) - "()|{+?"];
+    } else {
+        ps->token = TOKEN_CHAR;
+    }
+}
+
+static int32_t parse_regexp(struct parser *ps) {
+    int32_t left = parse_branch(ps);
+    while (!ps->failed && ps->token == TOKEN_ALT) {
+        next_token(ps, true);
+        int32_t right = parse_branch(ps);
+        left = new_node(ps, NODE_ALT, left, right);
+    }
+    return left;
+}
+
+static int32_t parse_branch(struct parser *ps) {
+    int32_t left = new_node(ps, NODE_EMPTY, -1, -1);
+    while (!ps->failed && ps->token != TOKEN_ALT && ps->token != TOKEN_END &&
+           (ps->token != TOKEN_CLOSE || ps->depth == 0)) {
+        int32_t piece = parse_piece(ps);
+        left = new_node(ps, NODE_CAT, left, piece);
+    }
+    // an unmatched ) is an error in a BRE and a literal in an ERE
+    ps->failed |= ps->token == TOKEN_CLOSE && ps->depth == 0;
+    return left;
+}
+
+static int32_t parse_piece(struct parser *ps) {
+    int32_t atom = parse_atom(ps);
+    bool repeatable = atom >= 0 && ps->nodes[atom].type != NODE_BOL &&
+                      ps->nodes[atom].type != NODE_EOL;
+    while (!ps->failed && (ps->token == TOKEN_STAR || ps->token == TOKEN_PLUS ||
+                           ps->token == TOKEN_QUESTION || ps->token == TOKEN_INTERVAL)) {
+        // a BRE takes no operator after another one
+        ps->failed |= !repeatable;
+        repeatable = ps->ere;
+        int32_t repeat = new_node(ps, NODE_REPEAT, atom, -1);
+        if (ps->failed) break;
+        struct node *node = ps->nodes + repeat;
+        node->min = ps->token == TOKEN_PLUS ? 1 : 0;
+        node->max = ps->token == TOKEN_QUESTION ? 1 : -1;
+        if (ps->token == TOKEN_INTERVAL) repeat = parse_interval(ps, repeat);
+        atom = repeat;
+        next_token(ps, false);
+    }
+    return atom;
+}
+
+// Operators with nothing to repeat are errors or literals depending on the
+// syntax, those patterns are left to regcomp()
+static int32_t parse_atom(struct parser *ps) {
+    int32_t atom = -1;
+    bool expression_start = false;
+    if (ps->token == TOKEN_CHAR) {
+        atom = char_node(ps, ps->ch);
+    } else if (ps->token == TOKEN_ANY) {
+        uint64_t set[4] = { ~0ull, ~0ull, ~0ull, ~0ull };
+        set[0] &= ~(1ull << '\n' | 1ull);
+        atom = new_set(ps, set);
+    } else if (ps->token == TOKEN_BRACKET) {
+        atom = parse_bracket(ps);
+    } else if (ps->token == TOKEN_OPAQUE) {
+        atom = new_node(ps, NODE_OPAQUE, -1, -1);
+    } else if (ps->token == TOKEN_OPEN) {
+        ps->depth++;
+        next_token(ps, true);
+        atom = parse_regexp(ps);
+        ps->failed |= ps->token != TOKEN_CLOSE;
+        ps->depth--;
+    } else if (ps->token == TOKEN_BOL || ps->token == TOKEN_EOL) {
+        atom = new_node(ps, ps->token == TOKEN_BOL ? NODE_BOL : NODE_EOL, -1, -1);
+        expression_start = true;
+        // a BRE takes ^^ as an anchor and a literal
+        ps->failed |= !ps->ere && *ps->pos == '^';
+    } else {
+        ps->failed = true;
+    }
+    if (!ps->failed) next_token(ps, expression_start);
+    return atom;
+}
+
+// {m}, {m,}, {m,n} and {,n}, the opening brace is already read
+static int32_t parse_interval(struct parser *ps, int32_t repeat) {
+    struct node *node = ps->nodes + repeat;
+    int min = 0, max = -1;
+    bool has_min = parse_number(ps, &min);
+    if (*ps->pos == ',') {
+        ps->pos++;
+        if (!parse_number(ps, &max)) max = -1;
+    } else {
+        max = min;
+        ps->failed |= !has_min;
+    }
+    const char *close = ps->ere ? "}" : "\\}";
+    ps->failed |= strncmp(ps->pos, close, strlen(close)) != 0 || (max >= 0 && max < min) ||
+                  min > DFA_DUP_MAX || max > DFA_DUP_MAX;
+    if (!ps->failed) {
+        ps->pos += strlen(close);
+        node->min = min;
+        node->max = max;
+    }
+    return repeat;
+}
+
+static bool parse_number(struct parser *ps, int *number) {
+    bool digits = false;
+    *number = 0;
+    while (isdigit((unsigned char) *ps->pos) && *number <= DFA_DUP_MAX) {
+        *number = *number * 10 + (*ps->pos++ - '0');
+        digits = true;
+    }
+    return digits;
+}
+
+// The opening bracket is already read. With REG_NEWLINE a negated list
+// never matches a newline.
+static int32_t parse_bracket(struct parser *ps) {
+    uint64_t set[4] = { 0, 0, 0, 0 };
+    const char *p = ps->pos;
+    bool negate = *p == '^';
+    if (negate) p++;
+    bool first = true;
+    while (!ps->failed && (*p != ']' || first)) {
+        unsigned char lo = *p;
+        if (lo == '\0' || (lo == '[' && (p[1] == '=' || p[1] == '.'))) {
+            ps->failed = true;
+        } else if (lo == '[' && p[1] == ':') {
+            const char *end = strstr(p + 2, ":]");
+            ps->failed = end == NULL || !add_class(set, p + 2, end - p - 2);
+            p = end != NULL ? end + 2 : p;
+            // a class cannot start a range
+            ps->failed |= *p == '-' && p[1] != ']';
+        } else if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+            // regcomp() lowers the ends of a range under REG_ICASE, letter
+            // ranges are only taken between two letters of one case
+            unsigned char hi = ps->icase ? tolower(p[2]) : p[2];
+            bool letters = (islower(lo) && islower(p[2])) || (isupper(lo) && isupper(p[2]));
+            lo = ps->icase ? tolower(lo) : lo;
+            ps->failed = hi == '[' || lo > hi || (p[3] == '-' && p[4] != ']') ||
+                         (ps->icase && !letters && lo <= 'z' && hi >= 'A');
+            for (unsigned ch = lo; !ps->failed && ch <= hi; ch++)
+                set_add(set, ch);
+            p += 3;
+        } else {
+            set_add(set, lo);
+            p++;
+        }
+        first = false;
+    }
+    ps->pos = p + 1;
+    if (ps->icase) fold_set(set);
+    if (negate) {
+        for (int i = 0; i < 4; i++)
+            set[i] = ~set[i];
+        set[0] &= ~(1ull << '\n');
+    }
+    return ps->failed ? -1 : new_set(ps, set);
+}
+
+static bool add_class(uint64_t *set, const char *name, size_t len) {
+    static const char *names[] = { "alpha", "upper", "lower", "digit", "xdigit", "space",
+                                   "print", "punct", "graph", "cntrl", "blank", "alnum" };
+    int (*tests[])(int) = { isalpha, isupper, islower, isdigit, isxdigit, isspace,
+                            isprint, ispunct, isgraph, iscntrl, isblank, isalnum };
+    int found = -1;
+    for (int i = 0; i < 12 && found < 0; i++)
+        if (strlen(names[i]) == len && !strncmp(names[i], name, len)) found = i;
+    for (unsigned ch = 0; found >= 0 && ch < 256; ch++)
+        if (tests[found](ch)) set_add(set, ch);
+    return found >= 0;
+}
+
+static int32_t new_node(struct parser *ps, uint8_t type, int32_t a, int32_t b) {
+    ps->failed |= ps->node_count == DFA_MAX_NODES;
+    if (ps->failed) return -1;
+    struct node *node = ps->nodes + ps->node_count;
+    node->type = type;
+    node->a = a;
+    node->b = b;
+    node->min = node->max = 0;
+    return ps->node_count++;
+}
+
+static int32_t new_set(struct parser *ps, const uint64_t *set) {
+    if (ps->set_count == ps->set_capacity) {
+        size_t capacity = ps->set_capacity ? ps->set_capacity * 2 : 16;
+        uint64_t (*sets)[4] = realloc(ps->sets, sizeof(*sets) * capacity);
+        ps->failed |= sets == NULL;
+        if (sets != NULL) {
+            ps->sets = sets;
+            ps->set_capacity = capacity;
+        }
+    }
+    if (ps->failed) return -1;
+    memcpy(ps->sets[ps->set_count], set, sizeof(ps->sets[0]));
+    return new_node(ps, NODE_SET, ps->set_count++, -1);
+}
+
+static int32_t char_node(struct parser *ps, unsigned char ch) {
+    uint64_t set[4] = { 0, 0, 0, 0 };
+    set_add(set, ch);
+    if (ps->icase) fold_set(set);
+    return new_set(ps, set);
+}
+
+static void set_add(uint64_t *set, unsigned char ch) {
+    set[ch >> 6] |= 1ull << (ch & 63);
+}
+
+static bool set_has(const uint64_t *set, unsigned ch) {
+    return set[ch >> 6] >> (ch & 63) & 1;
+}
+
+// Both cases of every letter in the set
+static void fold_set(uint64_t *set) {
+    for (unsigned ch = 0; ch < 256; ch++) {
+        if (set_has(set, ch) || set_has(set, fold_table[ch])) {
+            set_add(set, ch);
+            set_add(set, fold_table[ch]);
+        }
+    }
+}
+
+// Literals
+
+// The usual rules for required factors: a concatenation joins the suffix of
+// the left side with the prefix of the right one, an alternation needs one
+// of the literals of each side or their common prefix or suffix
+static void analyze(const struct parser *ps, int32_t n, struct literal_info *info) {
+    const struct node *node = ps->nodes + n;
+    int literal = node->type == NODE_SET ? set_literal(ps, ps->sets[node->a]) : -1;
+    bool empty = node->type == NODE_EMPTY || node->type == NODE_BOL || node->type == NODE_EOL;
+    info->exact = empty || literal >= 0;
+    info->whole[0] = info->prefix[0] = info->suffix[0] = '\0';
+    info->must.count = 0;
+    if (literal >= 0) {
+        info->whole[0] = info->prefix[0] = info->suffix[0] = literal;
+        info->whole[1] = info->prefix[1] = info->suffix[1] = '\0';
+        take_better_string(&info->must, info->whole);
+    } else if (node->type == NODE_CAT || node->type == NODE_ALT) {
+        struct literal_info right;
+        analyze(ps, node->a, info);
+        analyze(ps, node->b, &right);
+        if (node->type == NODE_CAT) analyze_cat(info, &right);
+        else                        analyze_alt(info, &right);
+    } else if (node->type == NODE_REPEAT) {
+        analyze(ps, node->a, info);
+        analyze_repeat(info, node->min, node->max);
+    }
+}
+
+static void analyze_cat(struct literal_info *a, const struct literal_info *b) {
+    char middle[DFA_LITERAL_SIZE + 1];
+    join(middle, a->suffix, b->prefix, false);
+    take_better_string(&a->must, middle);
+    take_better(&a->must, &b->must);
+    if (a->exact) join(a->prefix, a->whole, b->prefix, false);
+    if (b->exact) join(a->suffix, a->suffix, b->whole, true);
+    else          strcpy(a->suffix, b->suffix);
+    a->exact &= b->exact && strlen(a->whole) + strlen(b->whole) <= DFA_LITERAL_SIZE;
+    if (a->exact) strcat(a->whole, b->whole);
+    take_better_string(&a->must, a->prefix);
+    take_better_string(&a->must, a->suffix);
+}
+
+static void analyze_alt(struct literal_info *a, const struct literal_info *b) {
+    size_t len = 0, a_len = strlen(a->suffix), b_len = strlen(b->suffix);
+    while (a->prefix[len] != '\0' && a->prefix[len] == b->prefix[len])
+        len++;
+    a->prefix[len] = '\0';
+    for (len = 0; len < a_len && len < b_len && a->suffix[a_len - len - 1] == b->suffix[b_len - len - 1];)
+        len++;
+    memmove(a->suffix, a->suffix + a_len - len, len + 1);
+    a->exact &= b->exact && !strcmp(a->whole, b->whole);
+    bool both = a->must.count > 0 && b->must.count > 0 &&
+                a->must.count + b->must.count <= DFA_MAX_LITERALS;
+    for (size_t i = 0; both && i < b->must.count; i++)
+        strcpy(a->must.strings[a->must.count++], b->must.strings[i]);
+    if (!both) a->must.count = 0;
+    take_better_string(&a->must, a->prefix);
+    take_better_string(&a->must, a->suffix);
+}
+
+// Without a lower bound a repetition may match nothing at all. x{m,n} starts
+// and ends with m copies of x, x{m} is the m copies when x is exact.
+static void analyze_repeat(struct literal_info *info, int min, int max) {
+    char repeated[DFA_LITERAL_SIZE + 1] = "";
+    for (int i = 0; info->exact && i < min && strlen(repeated) < DFA_LITERAL_SIZE; i++)
+        join(repeated, repeated, info->whole, false);
+    if (min == 0) {
+        info->exact = max == 0;
+        info->whole[0] = info->prefix[0] = info->suffix[0] = '\0';
+        info->must.count = 0;
+    } else if (info->exact) {
+        bool whole = min == max && strlen(info->whole) * min <= DFA_LITERAL_SIZE;
+        strcpy(info->prefix, repeated);
+        info->suffix[0] = '\0';
+        for (int i = 0; i < min && strlen(info->suffix) < DFA_LITERAL_SIZE; i++)
+            join(info->suffix, info->whole, info->suffix, true);
+        if (whole) strcpy(info->whole, repeated);
+        info->exact = whole;
+        take_better_string(&info->must, repeated);
+    }
+}
+
+// The byte a set stands for, both cases of it under REG_ICASE, -1 otherwise
+static int set_literal(const struct parser *ps, const uint64_t *set) {
+    int first = -1, count = 0;
+    for (unsigned ch = 0; ch < 256; ch++) {
+        if (set_has(set, ch)) {
+            first = first < 0 ? (int) ch : first;
+            count++;
+        }
+    }
+    // the uppercase letter comes first
+    bool folded = ps->icase && count == 2 && first >= 0 && fold_table[first] != first &&
+                  set_has(set, fold_table[first]);
+    int literal = folded ? fold_table[first] : first;
+    return first > 0 && (count == 1 || folded) ? literal : -1;
+}
+
+// s1 followed by s2, its first or last DFA_LITERAL_SIZE bytes. to may be s1.
+static void join(char *to, const char *s1, const char *s2, bool keep_end) {
+    char buffer[2 * DFA_LITERAL_SIZE + 1];
+    strcpy(buffer, s1);
+    strcat(buffer, s2);
+    size_t len = strlen(buffer);
+    size_t from = keep_end && len > DFA_LITERAL_SIZE ? len - DFA_LITERAL_SIZE : 0;
+    buffer[from + DFA_LITERAL_SIZE] = '\0';
+    strcpy(to, buffer + from);
+}
+
+// A set of literals is as good as its shortest one, one literal is better
+// than several as long
+static void take_better(struct dfa_literals *must, const struct dfa_literals *other) {
+    size_t length = shortest(must), other_length = shortest(other);
+    if (other_length > length || (other_length == length && other->count < must->count))
+        *must = *other;
+}
+
+static void take_better_string(struct dfa_literals *must, const char *str) {
+    struct dfa_literals single = { .count = 1 };
+    strcpy(single.strings[0], str);
+    take_better(must, &single);
+}
+
+static size_t shortest(const struct dfa_literals *literals) {
+    size_t length = literals->count > 0 ? SIZE_MAX : 0;
+    for (size_t i = 0; i < literals->count; i++) {
+        size_t len = strlen(literals->strings[i]);
+        length = len < length ? len : length;
+    }
+    return length;
+}
+
+// NFA
+
+static uint32_t emit(struct compiler *c, uint8_t op, uint32_t x, uint32_t y) {
+    c->failed |= c->count == DFA_MAX_INSTS;
+    if (c->failed) return 0;
+    c->insts[c->count] = (struct dfa_inst) { op, x, y };
+    return c->count++;
+}
+
+static void compile_node(struct compiler *c, int32_t n) {
+    const struct node *node = c->nodes + n;
+    if (c->failed) return;
+    if (node->type == NODE_SET) {
+        emit(c, DFA_BYTE, node->a, 0);
+    } else if (node->type == NODE_CAT) {
+        compile_node(c, node->a);
+        compile_node(c, node->b);
+    } else if (node->type == NODE_ALT) {
+        uint32_t split = emit(c, DFA_SPLIT, 0, 0);
+        compile_node(c, node->a);
+        uint32_t jmp = emit(c, DFA_JMP, 0, 0);
+        uint32_t right = c->count;
+        compile_node(c, node->b);
+        if (!c->failed) {
+            c->insts[split].x = split + 1;
+            c->insts[split].y = right;
+            c->insts[jmp].x = c->count;
+        }
+    } else if (node->type == NODE_REPEAT) {
+        compile_repeat(c, node);
+    } else if (node->type == NODE_BOL || node->type == NODE_EOL) {
+        emit(c, node->type == NODE_BOL ? DFA_BOL : DFA_EOL, 0, 0);
+    }
+}
+
+// x{m,n} becomes m copies of x and n - m optional ones, x{m,} ends with a loop
+static void compile_repeat(struct compiler *c, const struct node *node) {
+    int copies = node->max < 0 && node->min > 0 ? node->min - 1 : node->min;
+    for (int i = 0; i < copies && !c->failed; i++)
+        compile_node(c, node->a);
+    if (node->max < 0 && node->min > 0) {
+        uint32_t loop = c->count;
+        compile_node(c, node->a);
+        emit(c, DFA_SPLIT, loop, c->count + 1);
+    } else if (node->max < 0) {
+        uint32_t split = emit(c, DFA_SPLIT, 0, 0);
+        compile_node(c, node->a);
+        emit(c, DFA_JMP, split, 0);
+        if (!c->failed) {
+            c->insts[split].x = split + 1;
+            c->insts[split].y = c->count;
+        }
+    } else {
+        // optional copies: each split skips to the end, chained through y
+        uint32_t chain = DFA_UNKNOWN;
+        for (int i = node->min; i < node->max && !c->failed; i++) {
+            uint32_t split = emit(c, DFA_SPLIT, 0, chain);
+            compile_node(c, node->a);
+            if (!c->failed) c->insts[split].x = split + 1;
+            chain = split;
+        }
+        while (!c->failed && chain != DFA_UNKNOWN) {
+            uint32_t previous = c->insts[chain].y;
+            c->insts[chain].y = c->count;
+            chain = previous;
+        }
+    }
+}
+
+// Bytes no set tells apart share a class. Newline gets its own, it ends
+// lines and decides $.
+static bool build_classes(struct dfa_program *prog, uint64_t (*sets)[4], size_t set_count) {
+    uint8_t classes[256] = { 0 };
+    size_t class_count = 1;
+    uint64_t newline[4] = { 1ull << '\n', 0, 0, 0 };
+    for (size_t s = 0; s <= set_count; s++) {
+        const uint64_t *set = s < set_count ? sets[s] : newline;
+        int16_t map[512];
+        memset(map, -1, sizeof(map));
+        size_t count = 0;
+        for (unsigned ch = 0; ch < 256; ch++) {
+            int key = classes[ch] * 2 + set_has(set, ch);
+            if (map[key] < 0) map[key] = count++;
+            classes[ch] = map[key];
+        }
+        class_count = count;
+    }
+    memcpy(prog->classes, classes, sizeof(classes));
+    prog->class_count = class_count;
+    prog->newline_class = classes['\n'];
+    for (size_t i = 0; i < prog->inst_count; i++)
+        prog->line_starts |= prog->insts[i].op == DFA_BOL;
+    prog->sets = calloc(set_count ? set_count : 1, sizeof(*prog->sets));
+    prog->set_count = set_count;
+    for (size_t s = 0; prog->sets != NULL && s < set_count; s++)
+        for (unsigned ch = 0; ch < 256; ch++)
+            if (set_has(sets[s], ch)) set_add(prog->sets[s], classes[ch]);
+    return prog->sets != NULL;
+}
+
+// Bytes on which the search start state goes back to itself without a match
+// can be passed over without looking at the DFA. Bytes that take no anchored
+// start anywhere cannot begin a match. The cache is fresh, it is not flushed
+// on the way.
+static void find_skip(struct dfa *d) {
+    struct dfa_program *prog = d->prog;
+    uint32_t state = start_state(d, false, false);
+    uint32_t anchored[2] = { start_state(d, true, false), start_state(d, true, true) };
+    int others = 0;
+    prog->skip_to = -1;
+    for (unsigned ch = 0; ch < 256; ch++) {
+        unsigned cls = prog->classes[ch];
+        uint32_t t = d->trans[state * prog->class_count + cls];
+        if (t == DFA_UNKNOWN) t = transition(d, &state, cls);
+        prog->skip[ch] = t == state;
+        if (!prog->skip[ch]) {
+            prog->skip_to = ch;
+            others++;
+        }
+        prog->first[ch] = false;
+        for (int i = 0; i < 2; i++) {
+            t = d->trans[anchored[i] * prog->class_count + cls];
+            if (t == DFA_UNKNOWN) t = transition(d, anchored + i, cls);
+            prog->first[ch] |= (t & DFA_MATCH_BIT) || d->states[t].count > 0;
+        }
+    }
+    if (others != 1) prog->skip_to = -1;
+}
+
+static void free_program(struct dfa_program *prog) {
+    free(prog->insts);
+    free(prog->sets);
+}
+
+// Lazy DFA
+
+static bool init_cache(struct dfa *d) {
+    size_t insts = d->prog->inst_count;
+    d->states = malloc(sizeof(struct dfa_state) * DFA_MAX_STATES);
+    d->trans = malloc(sizeof(uint32_t) * DFA_MAX_STATES * d->prog->class_count);
+    d->pool_capacity = 4 * insts + 64;
+    d->pool = malloc(sizeof(uint32_t) * d->pool_capacity);
+    d->table = malloc(sizeof(uint32_t) * DFA_TABLE_SIZE);
+    d->work = malloc(sizeof(uint32_t) * 3 * (insts + 1));
+    d->stack = malloc(sizeof(uint32_t) * (3 * insts + 2));
+    d->mark = calloc(insts, sizeof(uint32_t));
+    bool ok = d->states != NULL && d->trans != NULL && d->pool != NULL && d->table != NULL &&
+              d->work != NULL && d->stack != NULL && d->mark != NULL;
+    if (ok) flush_cache(d);
+    return ok;
+}
+
+static void flush_cache(struct dfa *d) {
+    d->state_count = 0;
+    d->pool_len = 0;
+    memset(d->table, 0xff, sizeof(uint32_t) * DFA_TABLE_SIZE);
+    for (int i = 0; i < 4; i++)
+        d->starts[i] = DFA_UNKNOWN;
+}
+
+static uint32_t start_state(struct dfa *d, bool anchored, bool line_start) {
+    uint8_t flags = (anchored ? STATE_ANCHORED : 0) |
+                    (line_start && d->prog->line_starts ? STATE_LINE_START : 0);
+    if (d->starts[flags] == DFA_UNKNOWN) {
+        uint32_t first = 0;
+        size_t count = closure(d, &first, 1, flags, false, d->work);
+        uint32_t state = add_state(d, d->work, count, flags);
+        if (state == DFA_UNKNOWN) {
+            flush_cache(d);
+            state = add_state(d, d->work, count, flags);
+        }
+        d->starts[flags] = state;
+    }
+    return d->starts[flags];
+}
+
+// Builds the transition of state on a byte class. Before a newline $ holds,
+// so a match can end right there. The match bit in the result tells that a
+// match ends before the byte. When the cache is full it starts over with
+// just the current state, which gets a new number.
+static uint32_t transition(struct dfa *d, uint32_t *state, unsigned cls) {
+    const struct dfa_program *prog = d->prog;
+    size_t size = prog->inst_count + 1;
+    uint32_t *before = d->work, *after = d->work + size, *next = d->work + 2 * size;
+    const struct dfa_state *s = d->states + *state;
+    uint8_t flags = s->flags;
+    bool newline = cls == prog->newline_class;
+    size_t count = s->count;
+    if (newline) count = closure(d, d->pool + s->first, s->count, flags, true, before);
+    else         memcpy(before, d->pool + s->first, sizeof(uint32_t) * count);
+    bool match = false;
+    size_t stepped = 0;
+    for (size_t i = 0; i < count; i++) {
+        const struct dfa_inst *inst = prog->insts + before[i];
+        match |= inst->op == DFA_MATCH;
+        if (inst->op == DFA_BYTE && set_has(prog->sets[inst->x], cls))
+            after[stepped++] = before[i] + 1;
+    }
+    uint8_t next_flags = (flags & STATE_ANCHORED) |
+                         (newline && prog->line_starts ? STATE_LINE_START : 0);
+    if (!(flags & STATE_ANCHORED)) after[stepped++] = 0;
+    size_t next_count = closure(d, after, stepped, next_flags, false, next);
+    uint32_t target = add_state(d, next, next_count, next_flags);
+    if (target == DFA_UNKNOWN) {
+        memcpy(after, d->pool + s->first, sizeof(uint32_t) * s->count);
+        count = s->count;
+        flush_cache(d);
+        *state = add_state(d, after, count, flags);
+        target = add_state(d, next, next_count, next_flags);
+    }
+    uint32_t t = target | (match ? DFA_MATCH_BIT : 0);
+    d->trans[*state * prog->class_count + cls] = t;
+    return t;
+}
+
+// At the end of the text $ holds as well
+static bool eot_match(struct dfa *d, uint32_t state) {
+    struct dfa_state *s = d->states + state;
+    if (s->eot_match < 0) {
+        size_t count = closure(d, d->pool + s->first, s->count, s->flags, true, d->work);
+        s->eot_match = false;
+        for (size_t i = 0; i < count; i++)
+            s->eot_match |= d->prog->insts[d->work[i]].op == DFA_MATCH;
+    }
+    return s->eot_match;
+}
+
+static int compare_pcs(const void *pc1, const void *pc2) {
+    uint32_t a = *(const uint32_t*) pc1, b = *(const uint32_t*) pc2;
+    return (a > b) - (a < b);
+}
+
+// Follows splits and jumps from the given instructions. ^ is passed at a
+// line start and dropped elsewhere; $ is passed when eol is set and kept
+// for the next byte to decide otherwise. The result is sorted.
+static size_t closure(struct dfa *d, const uint32_t *from, size_t count, uint8_t flags, bool eol,
+                      uint32_t *out) {
+    const struct dfa_inst *insts = d->prog->insts;
+    if (++d->generation == 0) {
+        memset(d->mark, 0, sizeof(uint32_t) * d->prog->inst_count);
+        d->generation = 1;
+    }
+    size_t top = 0, n = 0;
+    for (size_t i = count; i-- > 0;)
+        d->stack[top++] = from[i];
+    while (top > 0) {
+        uint32_t pc = d->stack[--top];
+        if (d->mark[pc] == d->generation) continue;
+        d->mark[pc] = d->generation;
+        const struct dfa_inst *inst = insts + pc;
+        if (inst->op == DFA_SPLIT) {
+            d->stack[top++] = inst->y;
+            d->stack[top++] = inst->x;
+        } else if (inst->op == DFA_JMP) {
+            d->stack[top++] = inst->x;
+        } else if (inst->op == DFA_BOL) {
+            if (flags & STATE_LINE_START) d->stack[top++] = pc + 1;
+        } else if (inst->op == DFA_EOL && eol) {
+            d->stack[top++] = pc + 1;
+        } else {
+            out[n++] = pc;
+        }
+    }
+    qsort(out, n, sizeof(uint32_t), &compare_pcs);
+    return n;
+}
+
+static uint32_t hash_state(const uint32_t *pcs, size_t count, uint8_t flags) {
+    uint32_t hash = 2166136261u ^ flags;
+    for (size_t i = 0; i < count; i++)
+        hash = (hash ^ pcs[i]) * 16777619u;
+    return hash;
+}
+
+// Returns the number of the state with this set, DFA_UNKNOWN when the cache is full
+static uint32_t add_state(struct dfa *d, const uint32_t *pcs, size_t count, uint8_t flags) {
+    size_t slot = hash_state(pcs, count, flags) & (DFA_TABLE_SIZE - 1);
+    uint32_t found = DFA_UNKNOWN;
+    while (d->table[slot] != DFA_UNKNOWN && found == DFA_UNKNOWN) {
+        const struct dfa_state *s = d->states + d->table[slot];
+        if (s->flags == flags && s->count == count &&
+            !memcmp(d->pool + s->first, pcs, sizeof(uint32_t) * count))
+            found = d->table[slot];
+        else
+            slot = (slot + 1) & (DFA_TABLE_SIZE - 1);
+    }
+    if (found != DFA_UNKNOWN || d->state_count == DFA_MAX_STATES) return found;
+    if (d->pool_len + count > d->pool_capacity) {
+        size_t capacity = 2 * (d->pool_capacity + count);
+        uint32_t *pool = realloc(d->pool, sizeof(uint32_t) * capacity);
+        if (pool == NULL) return DFA_UNKNOWN;
+        d->pool = pool;
+        d->pool_capacity = capacity;
+    }
+    uint32_t state = d->state_count++;
+    d->states[state] = (struct dfa_state) { d->pool_len, count, flags, -1 };
+    memcpy(d->pool + d->pool_len, pcs, sizeof(uint32_t) * count);
+    d->pool_len += count;
+    for (size_t i = 0; i < d->prog->class_count; i++)
+        d->trans[state * d->prog->class_count + i] = DFA_UNKNOWN;
+    d->table[slot] = state;
+    return state;
+}
@@ -0,0 +1,83 @@
+#ifndef DFA
+#define DFA
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DFA_MAX_INSTS 8192     // larger programs are left to regexec()
+#define DFA_MAX_STATES 2048    // the cache is flushed when it holds this many
+#define DFA_UNKNOWN UINT32_MAX
+#define DFA_MATCH_BIT 0x80000000u
+
+#define DFA_MAX_LITERALS 4     // alternatives a prefilter looks for
+#define DFA_LITERAL_SIZE 32
+
+enum dfa_op { DFA_BYTE, DFA_SPLIT, DFA_JMP, DFA_BOL, DFA_EOL, DFA_MATCH };
+
+// One NFA instruction. BYTE goes on to the next instruction when the byte
+// class is in its set, SPLIT and JMP continue at x and y.
+struct dfa_inst {
+    uint8_t op;
+    uint32_t x, y;
+};
+
+// Thompson NFA of a pattern with its byte classes, never changed once built
+struct dfa_program {
+    struct dfa_inst *insts;
+    size_t inst_count;
+    uint64_t (*sets)[4];      // BYTE sets over byte classes, by inst.x
+    size_t set_count;
+    uint8_t classes[256];     // byte to byte class
+    size_t class_count;
+    uint8_t newline_class;
+    bool line_starts;         // has ^, otherwise line starts are not told apart
+    bool skip[256];           // bytes that keep the search start state
+    int skip_to;              // the only other byte, -1 if more
+    bool first[256];          // bytes a match can start with or end before
+};
+
+struct dfa_state {
+    uint32_t first;           // NFA instructions in the pool
+    uint32_t count;
+    uint8_t flags;
+    int8_t eot_match;         // match at the end of the text, -1 unknown
+};
+
+// Lazily built DFA over sets of NFA instructions. Every thread has its own
+// cache, clones share the program of the original.
+struct dfa {
+    struct dfa_program *prog;
+    bool shared;
+    struct dfa_state *states;
+    size_t state_count;
+    uint32_t *trans;          // state * class_count + class, DFA_UNKNOWN if not built
+    uint32_t *pool;
+    size_t pool_len;
+    size_t pool_capacity;
+    uint32_t *table;          // hash of states, DFA_UNKNOWN for a free slot
+    uint32_t starts[4];       // by anchored and line start flags
+    uint32_t *work;           // scratch sets and closure stack
+    uint32_t *stack;
+    uint32_t *mark;
+    uint32_t generation;
+};
+
+// Literals one of which is in every match
+struct dfa_literals {
+    char strings[DFA_MAX_LITERALS][DFA_LITERAL_SIZE + 1];
+    size_t count;
+};
+
+bool dfa_compile(struct dfa *d, const char *pattern, int cflags);
+bool dfa_compile_set(struct dfa *d, const char *const *patterns, size_t count, int cflags);
+bool dfa_literals(const char *const *patterns, size_t count, int cflags,
+                  struct dfa_literals *literals);
+bool dfa_clone(const struct dfa *d, struct dfa *clone);
+void dfa_free(struct dfa *d);
+int dfa_lead_byte(const struct dfa *d);
+
+bool dfa_first_end(struct dfa *d, const char *text, size_t start, size_t len, size_t *end);
+bool dfa_exec(struct dfa *d, const char *text, size_t start, size_t len, size_t *so, size_t *eo);
+
+#endif  // DFA
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixed_search.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define BLOCK 16
+#endif
+
+#define SAME(ch) (ch)
+#define FOLD(ch) ((ch) >= 'A' && (ch) <= 'Z' ? (ch) + 32 : (ch))
+#define TABLE_ROW(f, b) f(b), f(b + 1), f(b + 2), f(b + 3), f(b + 4), f(b + 5), f(b + 6), f(b + 7), \
+                        f(b + 8), f(b + 9), f(b + 10), f(b + 11), f(b + 12), f(b + 13), f(b + 14), f(b + 15)
+#define TABLE(f) TABLE_ROW(f, 0), TABLE_ROW(f, 16), TABLE_ROW(f, 32), TABLE_ROW(f, 48), \
+                 TABLE_ROW(f, 64), TABLE_ROW(f, 80), TABLE_ROW(f, 96), TABLE_ROW(f, 112), \
+                 TABLE_ROW(f, 128), TABLE_ROW(f, 144), TABLE_ROW(f, 160), TABLE_ROW(f, 176), \
+                 TABLE_ROW(f, 192), TABLE_ROW(f, 208), TABLE_ROW(f, 224), TABLE_ROW(f, 240)
+
+const unsigned char same_table[256] = { TABLE(SAME) };
+const unsigned char fold_table[256] = { TABLE(FOLD) };
+
+#ifdef __SSE2__
+static const char* find_scalar(const struct fixed_pattern *fp, const char *hay, size_t len);
+#else
+static const char* find_horspool(const struct fixed_pattern *fp, const char *hay, size_t len);
+#endif
+
+bool fixed_init(struct fixed_pattern *fp, const char *needle, bool icase) {
+    fp->len = strlen(needle);
+    fp->icase = icase;
+    fp->needle = malloc(fp->len + 1);
+    if (fp->needle != NULL) {
+        for (size_t i = 0; i <= fp->len; i++)
+            fp->needle[i] = (icase ? fold_table : same_table)[(unsigned char) needle[i]];
+        unsigned char first = fp->needle[0];
+        unsigned char last = fp->len ? fp->needle[fp->len - 1] : 0;
+        fp->first[0] = first;
+        fp->last[0] = last;
+        fp->first[1] = icase && first >= 'a' && first <= 'z' ? first - 32 : first;
+        fp->last[1] = icase && last >= 'a' && last <= 'z' ? last - 32 : last;
+        #ifndef __SSE2__
+        for (size_t i = 0; i < 256; i++)
+            fp->shift[i] = fp->len;
+        for (size_t i = 0; i + 1 < fp->len; i++) {
+            unsigned char ch = fp->needle[i];
+            fp->shift[ch] = fp->len - 1 - i;
+            if (icase && ch >= 'a' && ch <= 'z') fp->shift[ch - 32] = fp->len - 1 - i;
+        }
+        #endif
+    }
+    return fp->needle != NULL;
+}
+
+void fixed_free(struct fixed_pattern *fp) {
+    free(fp->needle);
+    fp->needle = NULL;
+}
+
+// Compares needle with str; the first and the last bytes are already known to match
+bool fixed_equal(const struct fixed_pattern *fp, const char *str) {
+    bool equal = true;
+    if (!fp->icase) {
+        equal = fp->len < 3 || !memcmp(fp->needle + 1, str + 1, fp->len - 2);
+    } else {
+        const unsigned char *s = (const unsigned char*) str;
+        for (size_t i = 1; i + 1 < fp->len && equal; i++)
+            equal = (unsigned char) fp->needle[i] == fold_table[s[i]];
+    }
+    return equal;
+}
+
+// Returns the first occurrence of the needle in hay or NULL.
+// With SSE2 candidates are filtered by comparing the first and the last byte
+// of the needle against 16 positions at once, only survivors are verified.
+const char* fixed_find(const struct fixed_pattern *fp, const char *hay, size_t len) {
+    if (fp->len == 0) return hay;
+    if (fp->len > len) return NULL;
+    const char *result = NULL;
+    size_t i = 0;
+    #ifdef __SSE2__
+    const __m128i first0 = _mm_set1_epi8(fp->first[0]);
+    const __m128i first1 = _mm_set1_epi8(fp->first[1]);
+    const __m128i last0 = _mm_set1_epi8(fp->last[0]);
+    const __m128i last1 = _mm_set1_epi8(fp->last[1]);
+    for (; result == NULL && i + fp->len - 1 + BLOCK <= len; i += BLOCK) {
+        __m128i block_first = _mm_loadu_si128((const __m128i*) (hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*) (hay + i + fp->len - 1));
+        __m128i eq_first = _mm_or_si128(_mm_cmpeq_epi8(block_first, first0),
+                                        _mm_cmpeq_epi8(block_first, first1));
+        __m128i eq_last = _mm_or_si128(_mm_cmpeq_epi8(block_last, last0),
+                                       _mm_cmpeq_epi8(block_last, last1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(eq_first, eq_last));
+        while (mask != 0 && result == NULL) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (fixed_equal(fp, hay + pos)) result = hay + pos;
+            mask &= mask - 1;
+        }
+    }
+    if (result == NULL) result = find_scalar(fp, hay + i, len - i);
+    #else
+    result = find_horspool(fp, hay, len);
+    #endif
+    return result;
+}
+
+#ifdef __SSE2__
+// Tail of the buffer that is too short for a vector load
+static const char* find_scalar(const struct fixed_pattern *fp, const char *hay, size_t len) {
+    const char *result = NULL;
+    for (size_t i = 0; result == NULL && i + fp->len <= len; i++) {
+        unsigned char first = hay[i];
+        unsigned char last = hay[i + fp->len - 1];
+        if ((first == fp->first[0] || first == fp->first[1]) &&
+            (last == fp->last[0] || last == fp->last[1]) && fixed_equal(fp, hay + i))
+            result = hay + i;
+    }
+    return result;
+}
+#else
+static const char* find_horspool(const struct fixed_pattern *fp, const char *hay, size_t len) {
+    const char *result = NULL;
+    size_t i = 0;
+    while (result == NULL && i + fp->len <= len) {
+        unsigned char first = hay[i];
+        unsigned char last = hay[i + fp->len - 1];
+        if ((first == fp->first[0] || first == fp->first[1]) &&
+            (last == fp->last[0] || last == fp->last[1]) && fixed_equal(fp, hay + i))
+            result = hay + i;
+        i += fp->shift[last];
+    }
+    return result;
+}
+#endif
@@ -0,0 +1,30 @@
+#ifndef FIXED_SEARCH
+#define FIXED_SEARCH
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Literal needle prepared for repeated searches (-F and metachar-free patterns)
+struct fixed_pattern {
+    char *needle;        // folded to lowercase when icase is set
+    size_t len;
+    bool icase;
+    unsigned char first[2];  // both cases of the first byte
+    unsigned char last[2];   // both cases of the last byte
+#ifndef __SSE2__
+    size_t shift[256];       // Horspool bad character shifts
+#endif
+};
+
+bool fixed_init(struct fixed_pattern *fp, const char *needle, bool icase);
+void fixed_free(struct fixed_pattern *fp);
+const char* fixed_find(const struct fixed_pattern *fp, const char *hay, size_t len);
+bool fixed_equal(const struct fixed_pattern *fp, const char *str);
+
+// Byte tables of the C locale grep runs in: every byte maps to itself, and
+// under -i uppercase ASCII letters fold to lowercase, the same folding
+// regcomp() applies for REG_ICASE. A lookup replaces the compares per byte.
+extern const unsigned char same_table[256];
+extern const unsigned char fold_table[256];
+
+#endif  // FIXED_SEARCH
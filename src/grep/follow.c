@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <regex.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "fixed_search.h"
+#include "aho_corasick.h"
+#include "input_buffer.h"
+#include "match_arena.h"
+#include "line_ring.h"
+#include "dfa.h"
+#include "prefilter.h"
+#include "../common/output.h"
+#include "s21_grep.h"
+#include "follow.h"
+#include "../common/utils.h"
+#include "../common/stats.h"
+
+static bool follow_init(struct follow *f, const struct string_array *files);
+static void follow_free(struct follow *f);
+static void watch_directories(struct follow *f);
+static void wait_for_change(struct follow *f);
+static bool following(const struct follow *f);
+static void open_file(struct follow *f, struct followed_file *file);
+static void check_file(struct follow *f, struct followed_file *file);
+static void read_lines(struct follow *f, struct followed_file *file);
+static void drop_file(struct follow *f, struct followed_file *file, int error);
+
+// --follow: the files are searched like the others, then kept open and
+// searched again from the last complete line whenever they grow, until -q or
+// -m for every file has its answer. A truncated file is read again from its
+// start, a file replaced under its path, as log rotation does, is read to
+// its end and the new one opened. The lines of every look are written out
+// right away.
+void follow_files(struct pattern_table *patterns, const struct string_array *files,
+                  struct grep_state *st) {
+    struct follow f = { st, { 0 }, NULL, 0, NULL, -1, false };
+    st->fatal_error |= !init_worker(&f.w, st, patterns, false) || !follow_init(&f, files);
+    // watched before the first read, so no write after it goes unseen
+    if (!st->fatal_error) watch_directories(&f);
+    for (size_t i = 0; i < f.count && !st->fatal_error && !(st->options.q && f.w.matched); i++) {
+        open_file(&f, f.files + i);
+        if (f.files[i].fd != -1) read_lines(&f, f.files + i);
+    }
+    while (!st->fatal_error && !(st->options.q && f.w.matched) && following(&f)) {
+        wait_for_change(&f);
+        for (size_t i = 0; i < f.count && !st->fatal_error && !(st->options.q && f.w.matched); i++) {
+            if (!f.files[i].dropped) check_file(&f, f.files + i);
+        }
+    }
+    st->matched |= f.w.matched;
+    st->fatal_error |= f.w.fatal_error;
+    follow_free(&f);
+    free_worker(&f.w);
+}
+
+static bool follow_init(struct follow *f, const struct string_array *files) {
+    f->files = calloc(files->count + 1, sizeof(struct followed_file));
+    f->count = f->files != NULL ? files->count : 0;
+    bool ok = f->files != NULL;
+    for (size_t i = 0; i < f->count; i++) {
+        struct followed_file *file = f->files + i;
+        file->path = files->data[i];
+        file->fd = -1;
+        ok &= input_init(&file->input);
+        file->input.find_nul = f->w.input.find_nul;
+        file->input.zap_nul = f->w.input.zap_nul;
+        file->input.follow = true;
+    }
+    return ok;
+}
+
+static void follow_free(struct follow *f) {
+    for (size_t i = 0; i < f->count; i++) {
+        if (f->files[i].fd != -1) close(f->files[i].fd);
+        input_free(&f->files[i].input);
+    }
+    free(f->files);
+    if (f->notify != -1) close(f->notify);
+}
+
+// The directories are watched rather than the files, so a file created or
+// moved in under a followed path is seen as well as writes to it. Where
+// inotify is missing or a directory cannot be watched, the files are looked
+// at every FOLLOW_POLL_MS.
+static void watch_directories(struct follow *f) {
+    #ifdef __linux__
+    f->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    f->watched = f->notify != -1;
+    for (size_t i = 0; i < f->count && f->watched; i++) {
+        const char *path = f->files[i].path;
+        const char *slash = find_last(path, '/', strlen(path));
+        size_t len = slash == NULL ? 1 : slash == path ? 1 : (size_t) (slash - path);
+        char *dir = malloc(len + 1);
+        if (dir != NULL) {
+            memcpy(dir, slash != NULL ? path : ".", len);
+            dir[len] = '\0';
+        }
+        uint32_t mask = IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+        f->watched = dir != NULL && inotify_add_watch(f->notify, dir, mask) != -1;
+        free(dir);
+    }
+    #endif
+}
+
+// Blocks until some watched directory changes. Only the events that take a
+// watch away matter here, the files are all looked at afterwards anyway.
+static void wait_for_change(struct follow *f) {
+    struct pollfd notify = { f->notify, POLLIN, 0 };
+    uint64_t since = STAT_CLOCK();
+    if (poll(&notify, f->notify != -1, f->watched ? -1 : FOLLOW_POLL_MS) == -1 && errno != EINTR)
+        f->watched = false;
+    #ifdef __linux__
+    char events[FOLLOW_EVENT_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n = 1;
+    while (f->notify != -1 && n > 0) {
+        n = read(f->notify, events, sizeof(events));
+        for (char *pos = events; n > 0 && pos < events + n;) {
+            const struct inotify_event *event = (const struct inotify_event*) pos;
+            if (event->mask & IN_IGNORED) f->watched = false;
+            pos += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    #endif
+    STAT_PHASE(PHASE_READ, since);
+}
+
+static bool following(const struct follow *f) {
+    bool found = false;
+    for (size_t i = 0; i < f->count && !found; i++)
+        found = !f->files[i].dropped;
+    return found;
+}
+
+// Errors are reported once, a missing file is looked for again later
+static void open_file(struct follow *f, struct followed_file *file) {
+    struct stat info;
+    int fd = open(file->path, O_RDONLY);
+    STAT_ADD(fd != -1 ? STAT_FILES_OPENED : STAT_FILES_FAILED, 1);
+    int error = fd == -1 || fstat(fd, &info) != 0 ? errno : 0;
+    if (error != 0 && !file->missing && !f->st->options.s) {
+        errno = error;
+        print_error("grep", file->path);
+    }
+    f->st->file_error |= error != 0;
+    file->missing = error != 0;
+    if (error != 0 && fd != -1) close(fd);
+    if (error != 0) return;
+    file->fd = fd;
+    file->dev = info.st_dev;
+    file->ino = info.st_ino;
+    input_reset(&file->input, fd);
+    struct file_search fs = { file->path, 1, 0, false, false, 0, 0, NULL, false };
+    file->fs = fs;
+}
+
+// The new lines, then a look at the path
+static void check_file(struct follow *f, struct followed_file *file) {
+    struct stat info;
+    if (file->fd != -1 && fstat(file->fd, &info) == 0 && info.st_size < lseek(file->fd, 0, SEEK_CUR)) {
+        // truncated: what it holds now is new
+        lseek(file->fd, 0, SEEK_SET);
+        input_reset(&file->input, file->fd);
+        file->fs.line_number = 1;
+    }
+    if (file->fd != -1) read_lines(f, file);
+    bool replaced = !file->dropped && stat(file->path, &info) == 0 &&
+                    (file->fd == -1 || info.st_dev != file->dev || info.st_ino != file->ino);
+    if (replaced && file->fd != -1) {
+        // the last line of the old file is not waited for
+        file->input.follow = false;
+        read_lines(f, file);
+        file->input.follow = true;
+        close(file->fd);
+        file->fd = -1;
+    }
+    if (replaced && !file->dropped) open_file(f, file);
+    if (replaced && file->fd != -1) read_lines(f, file);
+}
+
+// Complete lines up to the end of the file, the unterminated one after them
+// stays in the buffer until its newline is written
+static void read_lines(struct follow *f, struct followed_file *file) {
+    struct grep_worker *w = &f->w;
+    struct file_search *fs = &file->fs;
+    if (f->last != file) ring_clear(&w->context);
+    f->last = file;
+    while (!(fs->done && fs->after_left == 0) && !w->fatal_error) {
+        size_t len = input_next_lines(&file->input);
+        if (file->input.nul && !fs->binary) start_binary(fs, w->st);
+        if (len == 0 || (fs->done && fs->after_left == 0)) break;
+        uint64_t since = STAT_CLOCK();
+        search_region(file->input.data + file->input.start, len, fs, w);
+        STAT_PHASE(PHASE_MATCH, since);
+        input_consume(&file->input, len);
+    }
+    w->fatal_error |= file->input.error == ENOMEM;
+    if ((fs->done && fs->after_left == 0) || file->input.error != 0) drop_file(f, file, file->input.error);
+    uint64_t since = STAT_CLOCK();
+    output_flush(w->out);
+    STAT_PHASE(PHASE_OUTPUT, since);
+}
+
+static void drop_file(struct follow *f, struct followed_file *file, int error) {
+    end_file(&file->fs, &f->w);
+    if (error != 0 && error != ENOMEM && !f->st->options.s) {
+        errno = error;
+        print_error("grep", file->path);
+    }
+    if (f->w.binary_match) print_binary_match(file->path, f->st);
+    f->st->file_error |= error != 0 && error != ENOMEM;
+    file->dropped = true;
+}
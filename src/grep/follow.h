@@ -0,0 +1,39 @@
+#ifndef FOLLOW
+#define FOLLOW
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Wait between looks at the files when they cannot all be watched
+#define FOLLOW_POLL_MS 1000
+
+// Bytes of inotify events taken by one read
+#define FOLLOW_EVENT_BUFFER 4096
+
+// A file of --follow, kept open by descriptor and looked up again by path
+struct followed_file {
+    char *path;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    bool missing;   // the path could not be opened, reported once
+    bool dropped;   // -m has its lines or the file failed, it is no longer read
+    struct input_buffer input;  // holds an unterminated last line until it is done
+    struct file_search fs;
+};
+
+struct follow {
+    struct grep_state *st;
+    struct grep_worker w;
+    struct followed_file *files;
+    size_t count;
+    struct followed_file *last;  // searched last, the before-context is its
+    int notify;     // inotify descriptor, -1 when the files are polled
+    bool watched;   // every directory of the files has a watch
+};
+
+void follow_files(struct pattern_table *patterns, const struct string_array *files,
+                  struct grep_state *st);
+
+#endif  // FOLLOW
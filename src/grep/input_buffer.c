@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "input_buffer.h"
+#include "../common/utils.h"
+#include "../common/stats.h"
+
+static bool read_more(struct input_buffer *in);
+static void scan_nul(struct input_buffer *in, size_t from);
+
+bool input_init(struct input_buffer *in) {
+    in->data = malloc(INPUT_BUFFER_SIZE);
+    in->capacity = in->data != NULL ? INPUT_BUFFER_SIZE : 0;
+    in->find_nul = false;
+    in->zap_nul = false;
+    in->follow = false;
+    input_reset(in, -1);
+    return in->data != NULL;
+}
+
+void input_free(struct input_buffer *in) {
+    free(in->data);
+    in->data = NULL;
+    in->capacity = 0;
+}
+
+void input_reset(struct input_buffer *in, int fd) {
+    in->fd = fd;
+    in->start = 0;
+    in->end = 0;
+    in->limit = INPUT_BUFFER_SIZE;
+    in->eof = false;
+    in->error = 0;
+    in->nul = false;
+}
+
+// Starts on bytes already read from fd, as if read() had returned them. They
+// fit when len is at most INPUT_BUFFER_SIZE, the buffer never shrinks.
+void input_preload(struct input_buffer *in, int fd, const char *data, size_t len, bool eof) {
+    input_reset(in, fd);
+    memcpy(in->data, data, len);
+    in->end = len;
+    in->eof = eof;
+    if (len > 0 && in->find_nul) scan_nul(in, 0);
+}
+
+// Returns the length of the complete lines at data + start, reading more
+// input when needed. At the end of input the unterminated tail is returned
+// too, 0 means there is nothing left. A followed input keeps the tail and
+// reads again on the next call.
+size_t input_next_lines(struct input_buffer *in) {
+    size_t len = 0;
+    size_t checked = 0;  // bytes known to hold no newline
+    bool found = false;
+    while (!found) {
+        const char *from = in->data + in->start + checked;
+        const char *last = find_last(from, '\n', in->end - in->start - checked);
+        checked = in->end - in->start;
+        bool nul = in->nul;
+        if (last != NULL) {
+            len = last + 1 - (in->data + in->start);
+            found = true;
+        } else if (in->eof || !read_more(in)) {
+            len = in->follow ? 0 : in->end - in->start;
+            in->eof &= !in->follow;
+            found = true;
+        }
+        // NUL bytes of the carried over line may have just become newlines
+        if (nul != in->nul && in->zap_nul) checked = 0;
+    }
+    return len;
+}
+
+void input_consume(struct input_buffer *in, size_t len) {
+    in->start += len;
+}
+
+// Moves the unfinished line to the front and appends the next read to it.
+// The reads of a file do not depend on the files before it: a line longer
+// than the limit doubles it until the reset, not for good.
+static bool read_more(struct input_buffer *in) {
+    size_t tail = in->end - in->start;
+    if (in->start > 0) {
+        memmove(in->data, in->data + in->start, tail);
+        in->start = 0;
+        in->end = tail;
+    }
+    if (in->end == in->limit && in->limit == in->capacity) {
+        char *data = realloc(in->data, in->capacity * 2);
+        if (data != NULL) {
+            in->data = data;
+            in->capacity *= 2;
+        } else {
+            in->error = ENOMEM;
+        }
+    }
+    if (in->end == in->limit && in->limit < in->capacity) in->limit *= 2;
+    ssize_t n = -1;
+    uint64_t since = STAT_CLOCK();
+    while (in->error == 0 && n < 0) {
+        n = read(in->fd, in->data + in->end, in->limit - in->end);
+        if (n < 0 && errno != EINTR) in->error = errno;
+    }
+    STAT_PHASE(PHASE_READ, since);
+    if (n > 0) in->end += n;
+    if (n > 0) STAT_ADD(STAT_BYTES_READ, n);
+    if (n > 0 && in->find_nul) scan_nul(in, in->end - n);
+    in->eof = n <= 0;
+    return n > 0;
+}
+
+// Every read is looked at with memchr(), which costs next to nothing next to
+// the search. Like GNU grep, the lines of a binary file are split at NUL bytes
+// from the first buffer that has one, so a file without newlines does not
+// have to be buffered whole.
+static void scan_nul(struct input_buffer *in, size_t from) {
+    if (!in->nul && memchr(in->data + from, '\0', in->end - from) != NULL) {
+        in->nul = true;
+        from = in->start;
+    }
+    if (in->nul && in->zap_nul) zap_nul(in->data + from, in->end - from);
+}
+
+// NUL bytes become newlines
+void zap_nul(char *data, size_t len) {
+    char *end = data + len;
+    char *nul = memchr(data, '\0', len);
+    while (nul != NULL) {
+        *nul = '\n';
+        nul = memchr(nul + 1, '\0', end - nul - 1);
+    }
+}
+
+// The first read, of first bytes: INPUT_BUFFER_SIZE, or what was preloaded
+void walk_init(struct read_walk *walk, size_t first, off_t size) {
+    walk->start = 0;
+    walk->read_from = 0;
+    walk->end = (off_t) first < size ? (off_t) first : size;
+    walk->limit = INPUT_BUFFER_SIZE;
+}
+
+// The read after the lines up to the last newline in [start, end) are handed
+// out, -1 when there is none. Without one the line is carried over whole.
+void walk_step(struct read_walk *walk, off_t newline, off_t size) {
+    if (newline != -1) {
+        walk->start = newline + 1;
+    } else if (walk->end - walk->start == (off_t) walk->limit) {
+        walk->limit *= 2;
+    }
+    walk->read_from = walk->end;
+    walk->end = walk->start + (off_t) walk->limit < size ? walk->start + (off_t) walk->limit : size;
+}
@@ -0,0 +1,47 @@
+#ifndef INPUT_BUFFER
+#define INPUT_BUFFER
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define INPUT_BUFFER_SIZE (256 * 1024)
+
+// Reusable read buffer, hands out runs of complete lines. A line that does
+// not fit is carried over to the front of the buffer on the next read.
+struct input_buffer {
+    char *data;
+    size_t capacity;
+    size_t start;  // first byte not handed out yet
+    size_t end;    // end of the data read so far
+    size_t limit;  // reads fill the buffer up to here, doubled for a line that does not fit
+    int fd;
+    bool eof;
+    int error;     // errno of the failed read
+    bool find_nul; // reads are scanned for NUL bytes
+    bool zap_nul;  // once one is found, NUL bytes not handed out yet end lines
+    bool nul;      // a NUL byte was read since the reset
+    bool follow;   // more may be written: an unterminated tail waits for its newline
+};
+
+// The reads of a regular file searched from its start, as read_more() does
+// them. A NUL byte makes the file binary from the buffer start of the read
+// that found it, so where the reads fall decides which lines are text.
+struct read_walk {
+    off_t start;      // buffer start when the read was done, a line start
+    off_t read_from;  // the read was [read_from, end)
+    off_t end;
+    size_t limit;
+};
+
+bool input_init(struct input_buffer *in);
+void input_free(struct input_buffer *in);
+void input_reset(struct input_buffer *in, int fd);
+void input_preload(struct input_buffer *in, int fd, const char *data, size_t len, bool eof);
+size_t input_next_lines(struct input_buffer *in);
+void input_consume(struct input_buffer *in, size_t len);
+void zap_nul(char *data, size_t len);
+void walk_init(struct read_walk *walk, size_t first, off_t size);
+void walk_step(struct read_walk *walk, off_t newline, off_t size);
+
+#endif  // INPUT_BUFFER
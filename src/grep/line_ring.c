@@ -0,0 +1,52 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "line_ring.h"
+
+bool ring_init(struct line_ring *ring, size_t size) {
+    ring->lines = size > 0 ? calloc(size, sizeof(struct ring_line)) : NULL;
+    ring->size = ring->lines != NULL ? size : 0;
+    ring_clear(ring);
+    return size == 0 || ring->lines != NULL;
+}
+
+void ring_free(struct line_ring *ring) {
+    for (size_t i = 0; i < ring->size; i++)
+        free(ring->lines[i].data);
+    free(ring->lines);
+    ring->lines = NULL;
+    ring->size = 0;
+    ring_clear(ring);
+}
+
+void ring_clear(struct line_ring *ring) {
+    ring->head = 0;
+    ring->count = 0;
+    ring->dropped = false;
+}
+
+// A full ring makes room by dropping its oldest line
+bool ring_push(struct line_ring *ring, const char *line, size_t len) {
+    if (ring->size == 0) return true;
+    if (ring->count == ring->size) {
+        ring->head = (ring->head + 1) % ring->size;
+        ring->count--;
+        ring->dropped = true;
+    }
+    struct ring_line *slot = ring->lines + (ring->head + ring->count) % ring->size;
+    if (slot->capacity < len) {
+        char *data = realloc(slot->data, len);
+        if (data == NULL) return false;
+        slot->data = data;
+        slot->capacity = len;
+    }
+    if (len > 0) memcpy(slot->data, line, len);
+    slot->len = len;
+    ring->count++;
+    return true;
+}
+
+// The i-th oldest line
+const struct ring_line* ring_get(const struct line_ring *ring, size_t i) {
+    return ring->lines + (ring->head + i) % ring->size;
+}
@@ -0,0 +1,32 @@
+#ifndef LINE_RING
+#define LINE_RING
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// A line kept for before-context. The copy only grows, so a slot that is
+// reused for lines no longer than before does not allocate.
+struct ring_line {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+// The last lines passed over without being printed, oldest first from head.
+// Lines of the current read buffer are found again in it, only the ones left
+// when the buffer is refilled are copied in here.
+struct line_ring {
+    struct ring_line *lines;
+    size_t size;
+    size_t head;
+    size_t count;
+    bool dropped;  // lines before the oldest one were passed over too
+};
+
+bool ring_init(struct line_ring *ring, size_t size);
+void ring_free(struct line_ring *ring);
+void ring_clear(struct line_ring *ring);
+bool ring_push(struct line_ring *ring, const char *line, size_t len);
+const struct ring_line* ring_get(const struct line_ring *ring, size_t i);
+
+#endif  // LINE_RING
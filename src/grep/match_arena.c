@@ -0,0 +1,146 @@
+#include <stdlib.h>
+
+#include "match_arena.h"
+
+static bool grow(void **data, size_t *capacity, size_t need, size_t size);
+static bool before(const regmatch_t *m1, const regmatch_t *m2);
+static void sift_down(struct match_arena *a, size_t i, size_t count);
+
+bool arena_init(struct match_arena *a) {
+    a->data = malloc(MATCH_ARENA_SIZE * sizeof(regmatch_t));
+    a->merged = malloc(MATCH_ARENA_SIZE * sizeof(regmatch_t));
+    a->runs = malloc(MATCH_ARENA_SIZE * sizeof(size_t));
+    a->ends = malloc(MATCH_ARENA_SIZE * sizeof(size_t));
+    a->ids = malloc(MATCH_ARENA_SIZE * sizeof(size_t));
+    a->heap = malloc(MATCH_ARENA_SIZE * sizeof(size_t));
+    bool ok = a->data != NULL && a->merged != NULL && a->runs != NULL &&
+              a->ends != NULL && a->ids != NULL && a->heap != NULL;
+    a->capacity = a->merged_capacity = a->run_capacity = ok ? MATCH_ARENA_SIZE : 0;
+    arena_reset(a);
+    return ok;
+}
+
+void arena_free(struct match_arena *a) {
+    free(a->data);
+    free(a->merged);
+    free(a->runs);
+    free(a->ends);
+    free(a->ids);
+    free(a->heap);
+    a->data = a->merged = NULL;
+    a->runs = a->ends = a->ids = a->heap = NULL;
+    a->capacity = a->merged_capacity = a->run_capacity = 0;
+    arena_reset(a);
+}
+
+void arena_reset(struct match_arena *a) {
+    a->len = 0;
+    a->run_count = 0;
+    a->merged_len = 0;
+}
+
+// A run that is still empty is taken over by the next matcher. A lazy run,
+// with an id other than ARENA_EAGER, is given at most one match.
+bool arena_begin_run(struct match_arena *a, size_t id) {
+    bool ok = true;
+    if (a->run_count == 0 || a->runs[a->run_count - 1] != a->len) {
+        if (a->run_count == a->run_capacity) {
+            size_t runs = a->run_capacity, ends = a->run_capacity, ids = a->run_capacity;
+            ok = grow((void**) &a->runs, &runs, a->run_count + 1, sizeof(size_t)) &&
+                 grow((void**) &a->ends, &ends, a->run_count + 1, sizeof(size_t)) &&
+                 grow((void**) &a->ids, &ids, a->run_count + 1, sizeof(size_t)) &&
+                 grow((void**) &a->heap, &a->run_capacity, a->run_count + 1, sizeof(size_t));
+        }
+        if (ok) a->runs[a->run_count++] = a->len;
+    }
+    if (ok) a->ids[a->run_count - 1] = id;
+    return ok;
+}
+
+bool arena_add(struct match_arena *a, regoff_t so, regoff_t eo) {
+    bool ok = a->len < a->capacity ||
+              grow((void**) &a->data, &a->capacity, a->len + 1, sizeof(regmatch_t));
+    if (ok) {
+        a->data[a->len].rm_so = so;
+        a->data[a->len].rm_eo = eo;
+        a->len++;
+    }
+    return ok;
+}
+
+// Sorts the last run by start. Meant for runs that come out almost sorted,
+// like automaton matches that are reported by their end.
+void arena_sort_run(struct match_arena *a) {
+    size_t first = a->run_count > 0 ? a->runs[a->run_count - 1] : a->len;
+    for (size_t i = first + 1; i < a->len; i++) {
+        regmatch_t m = a->data[i];
+        size_t j = i;
+        for (; j > first && before(&m, a->data + j - 1); j--)
+            a->data[j] = a->data[j - 1];
+        a->data[j] = m;
+    }
+}
+
+// k-way merge of the runs. At the same start the longest match comes first,
+// and a match that starts inside the one taken before it is dropped. A lazy
+// run then asks find for its next match from the end of the one taken.
+bool arena_merge(struct match_arena *a, arena_find find, void *ctx) {
+    a->merged_len = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < a->run_count; i++) {
+        a->ends[i] = i + 1 < a->run_count ? a->runs[i + 1] : a->len;
+        if (a->runs[i] < a->ends[i]) a->heap[count++] = i;
+    }
+    for (size_t i = count / 2; i-- > 0;)
+        sift_down(a, i, count);
+    regoff_t end = 0;
+    while (count > 0) {
+        size_t run = a->heap[0];
+        regmatch_t *next = a->data + a->runs[run];
+        if (next->rm_so >= end && next->rm_eo > end) {
+            if (a->merged_len == a->merged_capacity &&
+                !grow((void**) &a->merged, &a->merged_capacity, a->merged_len + 1, sizeof(regmatch_t)))
+                return false;
+            a->merged[a->merged_len++] = *next;
+            end = next->rm_eo;
+        }
+        bool more = a->ids[run] != ARENA_EAGER ? find(ctx, a->ids[run], end, next)
+                                               : ++a->runs[run] < a->ends[run];
+        if (!more) a->heap[0] = a->heap[--count];
+        sift_down(a, 0, count);
+    }
+    return true;
+}
+
+static bool grow(void **data, size_t *capacity, size_t need, size_t size) {
+    size_t new_capacity = *capacity > 0 ? *capacity : MATCH_ARENA_SIZE;
+    while (new_capacity < need)
+        new_capacity *= 2;
+    void *new_data = new_capacity != *capacity ? realloc(*data, new_capacity * size) : *data;
+    if (new_data != NULL) {
+        *data = new_data;
+        *capacity = new_capacity;
+    }
+    return new_data != NULL;
+}
+
+static bool before(const regmatch_t *m1, const regmatch_t *m2) {
+    return m1->rm_so < m2->rm_so || (m1->rm_so == m2->rm_so && m1->rm_eo > m2->rm_eo);
+}
+
+static void sift_down(struct match_arena *a, size_t i, size_t count) {
+    size_t run = a->heap[i];
+    bool placed = false;
+    while (!placed && 2 * i + 1 < count) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < count && before(a->data + a->runs[a->heap[child + 1]],
+                                        a->data + a->runs[a->heap[child]]))
+            child++;
+        placed = !before(a->data + a->runs[a->heap[child]], a->data + a->runs[run]);
+        if (!placed) {
+            a->heap[i] = a->heap[child];
+            i = child;
+        }
+    }
+    a->heap[i] = run;
+}
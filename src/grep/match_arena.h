@@ -0,0 +1,46 @@
+#ifndef MATCH_ARENA
+#define MATCH_ARENA
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <regex.h>
+
+#define MATCH_ARENA_SIZE 64
+
+// Id of a run that holds all its matches
+#define ARENA_EAGER ((size_t) -1)
+
+// Finds the first match of the lazy run id that starts at from or later,
+// false when there is none
+typedef bool (*arena_find)(void *ctx, size_t id, regoff_t from, regmatch_t *m);
+
+// Offsets of the matches in one line, reused from line to line. Every matcher
+// adds its matches as one run sorted by start; merging the runs gives the
+// non-overlapping matches in line order. A lazy run holds only its next
+// match, the one after it is searched for from the end of the last match
+// taken, so a match that starts inside the match of another run is found
+// again. The arrays only grow, by doubling.
+struct match_arena {
+    regmatch_t *data;     // the runs one after another
+    size_t len;
+    size_t capacity;
+    size_t *runs;         // start of every run, the next match while merging
+    size_t *ends;
+    size_t *ids;          // matcher of every lazy run, ARENA_EAGER for the others
+    size_t run_count;
+    size_t run_capacity;
+    size_t *heap;         // merge: runs ordered by their next match
+    regmatch_t *merged;
+    size_t merged_len;
+    size_t merged_capacity;
+};
+
+bool arena_init(struct match_arena *a);
+void arena_free(struct match_arena *a);
+void arena_reset(struct match_arena *a);
+bool arena_begin_run(struct match_arena *a, size_t id);
+bool arena_add(struct match_arena *a, regoff_t so, regoff_t eo);
+void arena_sort_run(struct match_arena *a);
+bool arena_merge(struct match_arena *a, arena_find find, void *ctx);
+
+#endif  // MATCH_ARENA
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <regex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fixed_search.h"
+#include "aho_corasick.h"
+#include "input_buffer.h"
+#include "match_arena.h"
+#include "line_ring.h"
+#include "dfa.h"
+#include "prefilter.h"
+#include "../common/output.h"
+#include "s21_grep.h"
+#include "parallel_search.h"
+#include "../common/utils.h"
+#include "../common/stats.h"
+#include "../common/prefetch.h"
+
+static bool add_file_jobs(struct parallel_search *ps, char *filename);
+static struct search_job* add_job(struct parallel_search *ps, char *filename);
+static off_t last_newline(int fd, off_t from, off_t to);
+static void* search_thread(void *arg);
+static bool take_job(struct parallel_search *ps, size_t *index);
+static void search_to_memory(struct parallel_search *ps, struct search_job *job,
+                             struct grep_worker *w, char **chunk, size_t *capacity);
+static void search_chunk(struct parallel_search *ps, struct search_job *job, int fd,
+                         struct grep_worker *w, char **chunk, size_t *capacity);
+static size_t binary_cut(const struct search_job *job, const char *chunk, size_t len, size_t size);
+static size_t read_chunk(int fd, struct search_job *job, char **chunk, size_t *capacity);
+static void publish_lines(struct parallel_search *ps, struct search_job *job, size_t newlines);
+static void print_results(struct parallel_search *ps);
+
+// Files are searched by a pool of threads, each job into a buffer of its own.
+// Buffers are printed in command line order, so the output does not depend on -j.
+void process_files_parallel(struct pattern_table *patterns, const struct string_array *files,
+                            struct grep_state *st) {
+    // with a file after it, one thread would start a file on what prefetch read
+    struct parallel_search ps = { st, patterns, NULL, 0, 0, 0, files->count > 1, 0, 0, 0, false, false,
+                                  false, false, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                                  PTHREAD_COND_INITIALIZER };
+    bool ok = true;
+    for (size_t i = 0; i < files->count && ok; i++)
+        ok = add_file_jobs(&ps, files->data[i]);
+    size_t jobs = st->jobs < ps.count ? st->jobs : ps.count;
+    ps.window = jobs * PARALLEL_WINDOW_PER_JOB;
+    pthread_t *threads = malloc(sizeof(pthread_t) * (jobs ? jobs : 1));
+    size_t started = 0;
+    ps.fatal_error = !ok;
+    while (ok && threads != NULL && started < jobs &&
+           pthread_create(threads + started, NULL, &search_thread, &ps) == 0)
+        started++;
+    // the threads read it under the lock, it is only set here when there are none
+    if (ps.count > 0 && started == 0) ps.fatal_error = true;
+    print_results(&ps);
+    for (size_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    for (size_t i = 0; i < ps.count; i++)
+        free(ps.jobs[i].output);
+    st->matched |= ps.matched;
+    st->file_error |= ps.file_error;
+    st->fatal_error |= ps.fatal_error;
+    free(ps.jobs);
+    free(threads);
+    pthread_mutex_destroy(&ps.lock);
+    pthread_cond_destroy(&ps.finished);
+    pthread_cond_destroy(&ps.moved);
+}
+
+// One job per file. Large regular files are cut at the first buffer start
+// of the search on one thread after every PARALLEL_CHUNK_SIZE bytes, a line
+// start where a NUL byte read after it cannot make the lines before binary.
+// -m counts lines in file order and context reaches across lines, so they
+// keep files whole.
+static bool add_file_jobs(struct parallel_search *ps, char *filename) {
+    size_t first = ps->count;
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    bool split = fd != -1 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+                 info.st_size >= 2 * PARALLEL_CHUNK_SIZE && ps->st->max_count < 0 &&
+                 !context_needed(ps->st);
+    // line numbers are only printed with the selected lines
+    bool numbered = ps->st->options.n && !ps->st->options.c && !ps->st->options.l;
+    struct read_walk walk;
+    if (split) walk_init(&walk, ps->preloaded ? PREFETCH_SIZE : INPUT_BUFFER_SIZE, info.st_size);
+    bool last = true;
+    bool ok = true;
+    do {
+        struct search_job *job = add_job(ps, filename);
+        ok = job != NULL;
+        if (ok) {
+            job->first = first;
+            job->chunk = split;
+            job->counted = !split || !numbered;
+            job->last = true;
+        }
+        if (ok && split) {
+            job->offset = walk.start;
+            job->walk = walk;
+            while (walk.end < info.st_size && walk.start < job->offset + PARALLEL_CHUNK_SIZE)
+                walk_step(&walk, last_newline(fd, walk.start, walk.end), info.st_size);
+            last = walk.start < job->offset + PARALLEL_CHUNK_SIZE || walk.start >= info.st_size;
+            job->last = last;
+            job->length = (last ? info.st_size : walk.start) - job->offset;
+            job->scan_end = last ? info.st_size : walk.read_from;
+        }
+    } while (ok && !last);
+    if (fd != -1) close(fd);
+    return ok;
+}
+
+static struct search_job* add_job(struct parallel_search *ps, char *filename) {
+    if (ps->count == ps->capacity) {
+        size_t capacity = ps->capacity ? ps->capacity * 2 : 16;
+        struct search_job *jobs = realloc(ps->jobs, sizeof(struct search_job) * capacity);
+        if (jobs == NULL) return NULL;
+        ps->jobs = jobs;
+        ps->capacity = capacity;
+    }
+    struct search_job *job = ps->jobs + ps->count++;
+    memset(job, 0, sizeof(*job));
+    job->filename = filename;
+    return job;
+}
+
+// Offset of the last newline in [from, to), -1 if there is none
+static off_t last_newline(int fd, off_t from, off_t to) {
+    char block[4096];
+    while (to > from) {
+        size_t want = to - from < (off_t) sizeof(block) ? (size_t) (to - from) : sizeof(block);
+        ssize_t n = pread(fd, block, want, to - want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        const char *nl = find_last(block, '\n', n);
+        if (nl != NULL) return to - want + (nl - block);
+        to -= want;
+    }
+    return -1;
+}
+
+static void* search_thread(void *arg) {
+    struct parallel_search *ps = arg;
+    struct grep_worker w;
+    bool ok = init_worker(&w, ps->st, ps->patterns, true);
+    char *chunk = NULL;
+    size_t capacity = 0;
+    size_t index = 0;
+    while (ok && take_job(ps, &index)) {
+        struct search_job *job = ps->jobs + index;
+        search_to_memory(ps, job, &w, &chunk, &capacity);
+        pthread_mutex_lock(&ps->lock);
+        job->done = true;
+        if (job->chunk && ps->st->options.l && job->match_count > 0)
+            ps->jobs[job->first].cancelled = true;
+        ps->matched |= w.matched;
+        ps->quit |= ps->st->options.q && w.matched;
+        ps->fatal_error |= w.fatal_error;
+        pthread_cond_broadcast(&ps->finished);
+        pthread_mutex_unlock(&ps->lock);
+        ok = !w.fatal_error;
+    }
+    pthread_mutex_lock(&ps->lock);
+    ps->fatal_error |= !ok;
+    stats_merge_thread();
+    pthread_cond_broadcast(&ps->finished);
+    pthread_mutex_unlock(&ps->lock);
+    free(chunk);
+    free_worker(&w);
+    return NULL;
+}
+
+// Waits while the thread would run too far ahead of the printed output.
+// Chunks of a file -l has already matched are skipped, and everything once
+// -q has matched.
+static bool take_job(struct parallel_search *ps, size_t *index) {
+    pthread_mutex_lock(&ps->lock);
+    bool taken = false;
+    while (!taken && !ps->fatal_error && !ps->quit && ps->next < ps->count) {
+        if (ps->next >= ps->printed + ps->window) {
+            pthread_cond_wait(&ps->moved, &ps->lock);
+        } else if (ps->jobs[ps->jobs[ps->next].first].cancelled) {
+            struct search_job *job = ps->jobs + ps->next++;
+            job->counted = job->done = true;
+            pthread_cond_broadcast(&ps->finished);
+        } else {
+            *index = ps->next++;
+            taken = true;
+        }
+    }
+    pthread_mutex_unlock(&ps->lock);
+    return taken;
+}
+
+static void search_to_memory(struct parallel_search *ps, struct search_job *job,
+                             struct grep_worker *w, char **chunk, size_t *capacity) {
+    w->out = &w->buffer;
+    w->grouped = false;
+    int fd = open(job->filename, O_RDONLY);
+    if (fd == -1) job->error = errno;
+    STAT_ADD(fd != -1 ? STAT_FILES_OPENED : STAT_FILES_FAILED, 1);
+    if (fd != -1 && job->chunk) {
+        search_chunk(ps, job, fd, w, chunk, capacity);
+    } else if (fd != -1) {
+        job->error = search_file(fd, job->filename, w);
+        job->binary_match = w->binary_match;
+    }
+    if (fd != -1) close(fd);
+    if (job->chunk && !job->counted) publish_lines(ps, job, 0);
+    job->output = output_release(&w->buffer, &job->size);
+    w->fatal_error |= w->buffer.error != 0;
+    w->buffer.error = 0;
+    w->out = ps->st->out;
+}
+
+// The chunk is read whole, with the bytes of the next one its last read
+// reaches: with -n its lines are counted first, and the search waits for the
+// line numbers of the chunks before it. The lines before the buffer start of
+// the read that found a NUL byte are searched as text, the rest as binary.
+// What that means for the chunks after it is left to print_results().
+static void search_chunk(struct parallel_search *ps, struct search_job *job, int fd,
+                         struct grep_worker *w, char **chunk, size_t *capacity) {
+    size_t len = read_chunk(fd, job, chunk, capacity);
+    w->fatal_error |= job->error == ENOMEM;
+    if (job->error != 0) return;
+    size_t size = job->last || len < (size_t) job->length ? len : (size_t) job->length;
+    if (!job->counted) publish_lines(ps, job, count_lines(*chunk, size));
+    struct file_search fs = { job->filename, job->line_base + 1, 0, false, false, 0, 0, NULL, false };
+    size_t text = ps->st->binary_files != BINARY_FILES_TEXT ? binary_cut(job, *chunk, len, size) : size;
+    uint64_t since = STAT_CLOCK();
+    if (text > 0) search_region(*chunk, text, &fs, w);
+    if (text < size && !fs.done) start_binary(&fs, ps->st);
+    if (fs.binary && !fs.done) zap_nul(*chunk + text, size - text);
+    if (fs.binary && !fs.done) search_region(*chunk + text, size - text, &fs, w);
+    STAT_PHASE(PHASE_MATCH, since);
+    job->binary = fs.binary;
+    job->binary_matches = fs.binary && fs.match_count > fs.binary_from ? fs.match_count - fs.binary_from : 0;
+    job->match_count = fs.match_count;
+    // with -I a NUL byte in a later chunk can still take the matches back
+    w->matched |= fs.match_count > 0 && ps->st->binary_files != BINARY_FILES_WITHOUT_MATCH;
+}
+
+// Where in the chunk it turns binary, size when it does not. The reads are
+// followed from the one the chunk starts at to the one that found the first
+// NUL byte, a NUL byte read before the chunk makes all of it binary.
+static size_t binary_cut(const struct search_job *job, const char *chunk, size_t len, size_t size) {
+    const char *nul = memchr(chunk, '\0', len);
+    if (nul == NULL) return size;
+    off_t at = job->offset + (nul - chunk);
+    struct read_walk walk = job->walk;
+    if (at < walk.read_from) return 0;
+    while (at >= walk.end) {
+        const char *nl = find_last(chunk + (walk.start - job->offset), '\n', walk.end - walk.start);
+        walk_step(&walk, nl != NULL ? job->offset + (nl - chunk) : -1, job->offset + len);
+    }
+    return walk.start - job->offset;
+}
+
+static size_t read_chunk(int fd, struct search_job *job, char **chunk, size_t *capacity) {
+    size_t len = 0;
+    bool eof = false;
+    size_t want_len = job->scan_end - job->offset;
+    while (!eof && job->error == 0 && (job->last || len < want_len)) {
+        if (len == *capacity) {
+            size_t size = *capacity ? *capacity * 2 : want_len + 1;
+            char *data = realloc(*chunk, size);
+            if (data == NULL) {
+                job->error = ENOMEM;
+                break;
+            }
+            *chunk = data;
+            *capacity = size;
+        }
+        size_t want = *capacity - len;
+        if (!job->last && want > want_len - len) want = want_len - len;
+        uint64_t since = STAT_CLOCK();
+        ssize_t n = pread(fd, *chunk + len, want, job->offset + len);
+        STAT_PHASE(PHASE_READ, since);
+        if (n < 0 && errno != EINTR) job->error = errno;
+        if (n > 0) len += n;
+        if (n > 0) STAT_ADD(STAT_BYTES_READ, n);
+        eof = n == 0;
+    }
+    return len;
+}
+
+// Line bases are a running sum of the chunk line counts, in file order
+static void publish_lines(struct parallel_search *ps, struct search_job *job, size_t newlines) {
+    pthread_mutex_lock(&ps->lock);
+    job->newlines = newlines;
+    job->counted = true;
+    while (ps->based < ps->count && ps->jobs[ps->based].counted) {
+        struct search_job *based = ps->jobs + ps->based++;
+        if (based->chunk && based != ps->jobs + based->first)
+            based->line_base = based[-1].line_base + based[-1].newlines;
+    }
+    pthread_cond_broadcast(&ps->finished);
+    while (!ps->fatal_error && ps->jobs + ps->based <= job)
+        pthread_cond_wait(&ps->finished, &ps->lock);
+    pthread_mutex_unlock(&ps->lock);
+}
+
+// Runs on the calling thread: prints each job once it and all before it are
+// done. Counts of a chunked file are summed up and printed after its last chunk.
+// From the chunk that turned binary on the file is binary, as if read in one
+// go: the output of the chunks after it is dropped, and -I drops the count, so
+// with -I whether a chunked file matched is only known here. Context groups
+// of different files are set off by "--".
+static void print_results(struct parallel_search *ps) {
+    const struct grep_state *st = ps->st;
+    struct grep_worker printer;
+    printer.st = st;
+    printer.out = st->out;
+    size_t match_count = 0;
+    bool reported = false;
+    bool binary = false;
+    size_t binary_matches = 0;
+    bool grouped = false;
+    bool done = true;
+    for (size_t i = 0; i < ps->count && done; i++) {
+        struct search_job *job = ps->jobs + i;
+        pthread_mutex_lock(&ps->lock);
+        while (!job->done && !((ps->fatal_error || ps->quit) && i >= ps->next))
+            pthread_cond_wait(&ps->finished, &ps->lock);
+        done = job->done;
+        pthread_mutex_unlock(&ps->lock);
+        if (!done) break;
+        if (job->first == i) {
+            match_count = 0;
+            reported = false;
+            binary = false;
+            binary_matches = 0;
+        }
+        // -l and -q are done with a file at its first match, NUL bytes after it are not read
+        bool text = !binary;
+        binary |= job->binary && !((st->options.l || st->options.q) && match_count > 0);
+        if (job->error != 0 && !reported && !ps->st->options.s) {
+            errno = job->error;
+            print_error("grep", job->filename);
+        }
+        reported |= job->error != 0;
+        ps->file_error |= job->error != 0;
+        uint64_t since = STAT_CLOCK();
+        if (grouped && job->size > 0 && text && context_needed(st)) print_group_separator(st->out, st);
+        grouped |= (job->size > 0 && text) || job->binary_match;
+        if (text) output_write(st->out, job->output, job->size);
+        if (st->out->terminal) output_flush(st->out);
+        STAT_PHASE(PHASE_OUTPUT, since);
+        free(job->output);
+        job->output = NULL;
+        match_count += job->match_count;
+        if (binary) binary_matches += text ? job->binary_matches : job->match_count;
+        if (binary && st->binary_files == BINARY_FILES_WITHOUT_MATCH) match_count = binary_matches = 0;
+        if (job->chunk && job->last && !offsets_needed(st))
+            output_filename_and_count(job->filename, match_count, match_count > 0, &printer);
+        if ((job->chunk && job->last && binary_matches > 0 && !st->options.c && !st->options.l &&
+             !st->options.q) || job->binary_match)
+            print_binary_match(job->filename, st);
+        // -q is answered by a match before the first NUL byte
+        bool kept = job->chunk && st->binary_files == BINARY_FILES_WITHOUT_MATCH &&
+                    ((job->last && match_count > 0) || (st->options.q && match_count > 0));
+        pthread_mutex_lock(&ps->lock);
+        ps->matched |= kept;
+        ps->quit |= kept && st->options.q;
+        ps->printed++;
+        pthread_cond_broadcast(&ps->moved);
+        pthread_mutex_unlock(&ps->lock);
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef PARALLEL_SEARCH
+#define PARALLEL_SEARCH
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "input_buffer.h"
+
+// Jobs searched ahead of the one being printed, per thread
+#define PARALLEL_WINDOW_PER_JOB 4
+
+// Regular files from twice this size are split into chunks searched in parallel
+#define PARALLEL_CHUNK_SIZE (4 * 1024 * 1024)
+
+// A whole file, or a newline-aligned chunk of a large one. The output is kept
+// until all jobs before it are printed.
+struct search_job {
+    char *filename;
+    bool chunk;
+    size_t first;      // first job of the same file
+    bool last;         // last job of the same file
+    off_t offset;
+    off_t length;      // a last chunk is read up to the end of file
+    struct read_walk walk;  // chunks: the read of the search on one thread the chunk starts at
+    off_t scan_end;    // chunks: NUL bytes before it were read by the reads of the chunk
+    size_t newlines;   // chunks with -n: lines in the chunk
+    bool counted;      // newlines is known
+    size_t line_base;  // lines in the file before the chunk
+    bool cancelled;    // first job of a file: -l already has its answer
+    size_t match_count;
+    char *output;
+    size_t size;
+    int error;         // errno of a failed open or read
+    bool binary;       // chunks: a NUL byte made the chunk binary
+    size_t binary_matches;  // chunks: matches from there on
+    bool binary_match; // whole files: binary and matched
+    bool done;
+};
+
+// Shared by the threads of one -j run, guarded by lock
+struct parallel_search {
+    const struct grep_state *st;
+    const struct pattern_table *patterns;
+    struct search_job *jobs;
+    size_t count;
+    size_t capacity;
+    size_t window;
+    bool preloaded;  // the search on one thread starts files on bytes read ahead
+    size_t next;     // next job handed out to a thread
+    size_t based;    // jobs with a known line_base
+    size_t printed;  // jobs already written to stdout
+    bool matched;
+    bool quit;       // -q has its answer
+    bool file_error;
+    bool fatal_error;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;  // a job is done or its lines are counted
+    pthread_cond_t moved;     // the window has moved on
+};
+
+void process_files_parallel(struct pattern_table *patterns, const struct string_array *files,
+                            struct grep_state *st);
+
+#endif  // PARALLEL_SEARCH
@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <string.h>
+#include <regex.h>
+
+#include "prefilter.h"
+#include "dfa.h"
+
+static const char* find_literal(const struct prefilter *pf, const char *pos, size_t len);
+
+// False only when out of memory. Patterns the analysis finds nothing in get
+// an empty prefilter, and so do those whose literals all start with lead, the
+// byte the engine itself jumps to with memchr (-1 if none).
+bool prefilter_init(struct prefilter *pf, const char *const *patterns, size_t count,
+                    int cflags, int lead) {
+    struct dfa_literals found;
+    pf->literals = NULL;
+    pf->count = 0;
+    if (!dfa_literals(patterns, count, cflags, &found)) return true;
+    bool redundant = lead >= 0;
+    for (size_t i = 0; i < found.count; i++)
+        redundant &= (unsigned char) found.strings[i][0] == lead;
+    if (redundant) return true;
+    pf->literals = malloc(sizeof(struct fixed_pattern) * found.count);
+    bool ok = pf->literals != NULL;
+    for (size_t i = 0; ok && i < found.count; i++) {
+        ok = fixed_init(pf->literals + i, found.strings[i], cflags & REG_ICASE);
+        pf->count += ok;
+    }
+    if (!ok) prefilter_free(pf);
+    return ok;
+}
+
+void prefilter_free(struct prefilter *pf) {
+    for (size_t i = 0; i < pf->count; i++)
+        fixed_free(pf->literals + i);
+    free(pf->literals);
+    pf->literals = NULL;
+    pf->count = 0;
+}
+
+// The first line at or after the line start pos with one of the literals,
+// NULL if there is none. line_end is set past its newline.
+char* prefilter_next_line(const struct prefilter *pf, char *pos, char *end, char **line_end) {
+    const char *found = find_literal(pf, pos, end - pos);
+    char *line = NULL;
+    if (found != NULL) {
+        // memchr forward is cheaper than a byte loop back from the literal
+        char *newline = memchr(pos, '\n', end - pos);
+        line = pos;
+        while (newline != NULL && newline < found) {
+            line = newline + 1;
+            newline = memchr(line, '\n', end - line);
+        }
+        *line_end = newline != NULL ? newline + 1 : end;
+    }
+    return line;
+}
+
+bool prefilter_in_line(const struct prefilter *pf, const char *line, size_t len) {
+    return pf->count == 0 || find_literal(pf, line, len) != NULL;
+}
+
+// Earliest occurrence of any literal
+static const char* find_literal(const struct prefilter *pf, const char *pos, size_t len) {
+    const char *first = NULL;
+    for (size_t i = 0; i < pf->count; i++) {
+        size_t limit = first != NULL ? (size_t) (first - pos) + pf->literals[i].len : len;
+        const char *found = fixed_find(pf->literals + i, pos, limit < len ? limit : len);
+        if (found != NULL && (first == NULL || found < first)) first = found;
+    }
+    return first;
+}
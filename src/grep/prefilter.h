@@ -0,0 +1,22 @@
+#ifndef PREFILTER
+#define PREFILTER
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "fixed_search.h"
+
+// Literals one of which is in every match of a regex, searched for before the
+// regex engine runs. Lines without any of them are never given to it.
+struct prefilter {
+    struct fixed_pattern *literals;
+    size_t count;       // 0: nothing is known, every line is searched
+};
+
+bool prefilter_init(struct prefilter *pf, const char *const *patterns, size_t count,
+                    int cflags, int lead);
+void prefilter_free(struct prefilter *pf);
+char* prefilter_next_line(const struct prefilter *pf, char *pos, char *end, char **line_end);
+bool prefilter_in_line(const struct prefilter *pf, const char *line, size_t len);
+
+#endif  // PREFILTER
@@ -1,101 +1,200 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <regex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
+#include "fixed_search.h"
+#include "aho_corasick.h"
+#include "input_buffer.h"
+#include "match_arena.h"
+#include "line_ring.h"
+#include "dfa.h"
+#include "prefilter.h"
+#include "../common/output.h"
+#include "../common/prefetch.h"
 #include "s21_grep.h"
+#include "parallel_search.h"
+#include "tree_walk.h"
+#include "trigram_index.h"
+#include "follow.h"
 #include "../common/utils.h"
+#include "../common/stats.h"
 
 int main(int argc, char *argv[]) {
     struct grep_state state = GREP_DEFAULT;
-    llist_t *patterns = initialize_llist();
-    llist_t *files = initialize_llist();
+    struct pattern_table table = { NULL, 0, false, NULL, NULL, false, NULL, NULL, false, { NULL, 0 } };
+    struct string_array patterns = { NULL, 0, 0, NULL, 0 };
+    struct string_array files = { NULL, 0, 0, NULL, 0 };
+    struct output out;
 
-    parse_cmd_args(argc - 1, argv + 1, &state, patterns, files);
-    if (!state.fatal_error && patterns->next != NULL) {
-        if (files->next != NULL)
-            process_files(patterns->next, files->next, &state);
-        else
-            process_stdio(patterns->next, &state);
+    uint64_t since = STAT_NOW();
+    parse_cmd_args(argc - 1, argv + 1, &state, &patterns, &files);
+    STAT_PHASE(PHASE_PARSE, since);
+    state.fatal_error |= !output_init(&out, STDOUT_FILENO, OUTPUT_BUFFER_SIZE);
+    state.out = &out;
+    since = STAT_CLOCK();
+    bool compiled = state.index_dir == NULL && !state.fatal_error && !state.usage_error &&
+                    !state.file_error && patterns.count > 0 && compile_patterns(&patterns, &table, &state);
+    STAT_PHASE(PHASE_COMPILE, since);
+    if (compiled && state.max_count != 0) {
+        if (state.options.r || state.options.R) {
+            process_tree(&table, &files, &state);
+        } else if (state.files_to_search > 0) {
+            exclude_operands(&files, &state);
+            process_files(&table, &files, &state);
+        } else {
+            process_stdio(&table, &state);
+        }
     }
+    if (state.index_dir != NULL && !state.fatal_error && !state.usage_error)
+        build_index(state.index_dir, &state);
 
-    free_llist(patterns);
-    free_llist(files);
+    free_patterns(&table);
+    free_strings(&patterns);
+    free_strings(&files);
+    free_strings(&state.includes);
+    free_strings(&state.excludes);
+    free_strings(&state.exclude_dirs);
+    since = STAT_CLOCK();
+    output_flush(&out);
+    STAT_PHASE(PHASE_OUTPUT, since);
+    output_free(&out);
     if (state.fatal_error) print_error("grep", "");
-    return state.fatal_error ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (out.error != 0) {
+        errno = out.error;
+        print_error("grep", "write error");
+    }
+    stats_report("grep");
+    return out.error == 0 ? exit_status(&state) : EXIT_TROUBLE;
+}
+
+// Like GNU grep: -q ignores errors of other inputs once a line is selected.
+// A built index counts as success.
+int exit_status(const struct grep_state *st) {
+    int status = st->matched || st->index_dir != NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (st->fatal_error || st->regex_error || st->usage_error ||
+        (st->file_error && !(st->options.q && st->matched)))
+        status = EXIT_TROUBLE;
+    return status;
 }
 
 void parse_cmd_args(int argc, char *argv[], struct grep_state *st,
-                   llist_t *patterns, llist_t *files) {
+                   struct string_array *patterns, struct string_array *files) {
     parse_regexes(argc, argv, patterns, st);
     parse_filenames(argc, argv, files, st);
     parse_options(argc, argv, st);
 }
 
-void parse_regexes(int argc, char *argv[], llist_t *patterns, struct grep_state *st) {
+void parse_regexes(int argc, char *argv[], struct string_array *patterns, struct grep_state *st) {
     // Search for patterns after -e and -f flags
-    for (int i = 0; i < argc - 1 && patterns != NULL; i++) {
+    for (int i = 0; i < argc - 1 && !st->fatal_error; i++) {
         bool is_opt = get_dash_index(argv[i]) == 1;
         if (is_opt && strchr(argv[i], 'e')) {
             i++;
             st->options.e = true;
-            patterns = add_to_llist(patterns, argv[i], false);
+            st->fatal_error = !add_pattern(patterns, argv[i]);
         } else if (is_opt && strchr(argv[i], 'f')) {
             i++;
             st->options.f = true;
-            patterns = read_regex_from_file(argv[i], patterns);
+            read_regex_from_file(argv[i], patterns, st);
         }
     }
     // Search for first pattern if no -e and -f flag were detected
     if (!st->options.e && !st->options.f) {
         bool match = false;
         int i = 0;
-        while (!match && i < argc)
-            match = get_dash_index(argv[i++]) != 1;
-        if (match && patterns != NULL) {
+        while (!match && i < argc) {
+            bool is_opt = get_dash_index(argv[i]) == 1 || is_long_option(argv[i]);
+            match = !is_opt;
+            i += is_opt && takes_argument(argv[i]) ? 2 : 1;
+        }
+        if (match) {
             st->first_regex_index = i--;
-            patterns = add_to_llist(patterns, argv[i], false);
+            st->fatal_error = !add_pattern(patterns, argv[i]);
         }
     }
-    st->fatal_error |= patterns == NULL;
 }
 
-llist_t* read_regex_from_file(char *filename, llist_t *patterns) {
-    FILE *f = fopen(filename, "r");
-    if (f != NULL) {
-        while (true) {
-            char *str = NULL;
-            size_t s = 0;
-            ssize_t len = 0;
-            len = getline(&str, &s, f);
-            if (len == -1 || patterns == NULL) {
-                free(str);
-                break;
-            }
-            if (str[len - 1] == '\n') str[len - 1] = '\0';
-            patterns = add_to_llist(patterns, str, true);
+// Every line of a pattern is a pattern of its own, as with -f. The lines are
+// split in a copy kept by the array.
+bool add_pattern(struct string_array *patterns, char *str) {
+    if (strchr(str, '\n') == NULL) return add_string(patterns, str);
+    size_t len = strlen(str);
+    char *slab = malloc(len + 1);
+    bool ok = slab != NULL && add_slab(patterns, memcpy(slab, str, len + 1));
+    for (char *line = slab; ok && line != NULL;) {
+        char *end = strchr(line, '\n');
+        if (end != NULL) *end = '\0';
+        ok = add_string(patterns, line);
+        line = end != NULL ? end + 1 : NULL;
+    }
+    return ok;
+}
+
+// The file is read whole into one slab kept by the array, its lines are
+// split in place. Like GNU grep nothing is searched when it cannot be read.
+void read_regex_from_file(char *filename, struct string_array *patterns, struct grep_state *st) {
+    int fd = open(filename, O_RDONLY);
+    size_t len = 0;
+    char *slab = fd != -1 ? read_whole_file(fd, &len) : NULL;
+    bool ok = slab != NULL || fd == -1 || errno != ENOMEM;
+    if (slab == NULL && ok) print_error("grep", filename);
+    if (fd != -1) close(fd);
+    st->file_error |= slab == NULL && ok;
+    if (slab != NULL) ok = add_slab(patterns, slab);
+    for (char *line = slab; ok && line < slab + len;) {
+        char *end = memchr(line, '\n', slab + len - line);
+        if (end == NULL) end = slab + len;
+        *end = '\0';
+        ok = add_string(patterns, line);
+        line = end + 1;
+    }
+    st->fatal_error = !ok;
+}
+
+// The data is followed by a terminating zero byte, errno is set on failure.
+// A regular file gets one spare byte, so its end is seen without growing.
+char* read_whole_file(int fd, size_t *len) {
+    struct stat info;
+    size_t capacity = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) ? info.st_size + 2 : 4096;
+    char *data = malloc(capacity);
+    ssize_t n = 1;
+    *len = 0;
+    while (data != NULL && n != 0) {
+        if (*len + 1 == capacity) {
+            char *grown = realloc(data, capacity * 2);
+            if (grown == NULL) free(data);
+            data = grown;
+            capacity *= 2;
         }
-        fclose(f);
-    } else {
-        print_error("grep", filename);
+        n = data != NULL ? read(fd, data + *len, capacity - *len - 1) : 0;
+        if (n < 0 && errno != EINTR) {
+            free(data);
+            data = NULL;
+        }
+        if (n > 0) *len += n;
     }
-    return patterns;
+    if (data != NULL) data[*len] = '\0';
+    return data;
 }
 
-void parse_filenames(int argc, char *argv[], llist_t *files, struct grep_state *st) {
+void parse_filenames(int argc, char *argv[], struct string_array *files, struct grep_state *st) {
     int start = st->first_regex_index;
     if (st->options.e || st->options.f) start = 0;
-    for (int i = start; i < argc && files != NULL; i++) {
-        bool is_opt = get_dash_index(argv[i]) == 1;
-        if (is_opt && strpbrk(argv[i], "ef")) {
+    for (int i = start; i < argc && !st->fatal_error; i++) {
+        bool is_opt = get_dash_index(argv[i]) == 1 || is_long_option(argv[i]);
+        if (is_opt && takes_argument(argv[i])) {
             i++;
         } else if (!is_opt) {
-            files = add_to_llist(files, argv[i], false);
+            st->fatal_error = !add_string(files, argv[i]);
             st->files_to_search++;
         }
     }
-    st->fatal_error |= files == NULL;
 }
 
 void parse_options(int argc, char *argv[], struct grep_state *st) {
@@ -110,256 +209,944 @@ void parse_options(int argc, char *argv[], struct grep_state *st) {
                 st->options.h |= *opt_str == 'h';
                 st->options.s |= *opt_str == 's';
                 st->options.o |= *opt_str == 'o';
+                st->options.F |= *opt_str == 'F';
+                st->options.q |= *opt_str == 'q';
+                st->options.r |= *opt_str == 'r';
+                st->options.R |= *opt_str == 'R';
+                if (*opt_str == 'a') st->binary_files = BINARY_FILES_TEXT;
+                if (*opt_str == 'I') st->binary_files = BINARY_FILES_WITHOUT_MATCH;
                 if (*opt_str == 'i') st->cflags |= REG_ICASE;
                 if (*opt_str == 'E') st->cflags |= REG_EXTENDED;
-                if (*opt_str == 'e' || *opt_str == 'f') i++;
+                if (*opt_str == 'j') parse_jobs(i + 1 < argc ? argv[i + 1] : "", st);
+                if (*opt_str == 'm') parse_max_count(i + 1 < argc ? argv[i + 1] : "", st);
+                if (*opt_str == 'A') parse_context(i + 1 < argc ? argv[i + 1] : "", &st->after_context, st);
+                if (*opt_str == 'B') parse_context(i + 1 < argc ? argv[i + 1] : "", &st->before_context, st);
+                if (*opt_str == 'C') parse_context(i + 1 < argc ? argv[i + 1] : "", &st->context, st);
+                if (strchr(ARG_OPTIONS, *opt_str)) i++;
                 opt_str++;
             }
+        } else if (is_long_option(argv[i]) && takes_argument(argv[i])) {
+            st->index_dir = i + 1 < argc ? argv[++i] : NULL;
+            if (st->index_dir == NULL) {
+                fprintf(stderr, "grep: option '%s' requires an argument\n", argv[i]);
+                st->usage_error = true;
+            }
+        } else if (is_long_option(argv[i])) {
+            parse_long_option(argv[i] + 2, st);
         }
     }
+    if (st->after_context < 0) st->after_context = st->context;
+    if (st->before_context < 0) st->before_context = st->context;
 }
 
-void process_stdio(llist_t *patterns, struct grep_state *st) {
-    if (st->options.v || st->options.c || st->options.l)
-        search_matches_in_file(stdin, "(standard input)", patterns, st);
-    else
-         search_substrings_in_file(stdin, "(standard input)", patterns, st);
-}
-
-void process_files(llist_t *patterns, llist_t *files, struct grep_state *st) {
-    while (files != NULL && !st->regex_error) {
-        FILE *f = fopen(files->data, "r");
-        if (f != NULL) {
-            if (st->options.v || st->options.c || st->options.l)
-                search_matches_in_file(f, files->data, patterns, st);
-            else
-                search_substrings_in_file(f, files->data, patterns, st);
-            fclose(f);
-        } else if (!st->options.s) {
-            print_error("grep", files->data);
+void parse_max_count(const char *arg, struct grep_state *st) {
+    char *end = NULL;
+    st->max_count = strtol(arg, &end, 10);
+    if (end == arg || *end) {
+        fprintf(stderr, "grep: invalid max count\n");
+        st->usage_error = true;
+    }
+}
+
+// A positive decimal, strtoul() alone would take signs and spaces
+void parse_jobs(const char *arg, struct grep_state *st) {
+    char *end = NULL;
+    errno = 0;
+    st->jobs = *arg >= '0' && *arg <= '9' ? strtoul(arg, &end, 10) : 0;
+    if (end == NULL || *end || errno == ERANGE || st->jobs == 0) {
+        fprintf(stderr, "grep: invalid number of jobs\n");
+        st->usage_error = true;
+    }
+}
+
+void parse_context(const char *arg, long *length, struct grep_state *st) {
+    char *end = NULL;
+    *length = strtol(arg, &end, 10);
+    if (end == arg || *end || *length < 0) {
+        fprintf(stderr, "grep: %s: invalid context length argument\n", arg);
+        st->usage_error = true;
+    }
+}
+
+// Long options are only recognized by name, other words with two dashes stay
+// filenames. A name ending in '=' is followed by its value in the same word.
+bool is_long_option(const char *arg) {
+    static const char *names[] = LONG_OPTIONS;
+    bool found = false;
+    for (size_t i = 0; get_dash_index(arg) == 2 && names[i] != NULL && !found; i++) {
+        size_t len = strlen(names[i]);
+        found = names[i][len - 1] == '=' ? !strncmp(arg + 2, names[i], len) : !strcmp(arg + 2, names[i]);
+    }
+    return found;
+}
+
+void parse_long_option(char *name, struct grep_state *st) {
+    char *value = strchr(name, '=');
+    if (!strcmp(name, "stats")) stats_enable();
+    st->options.r |= !strcmp(name, "recursive");
+    st->options.R |= !strcmp(name, "dereference-recursive");
+    st->sort_files |= !strcmp(name, "sort-files");
+    if (!strncmp(name, "include=", 8)) st->fatal_error |= !add_string(&st->includes, value + 1);
+    if (!strncmp(name, "exclude=", 8)) st->fatal_error |= !add_string(&st->excludes, value + 1);
+    if (!strncmp(name, "exclude-dir=", 12)) st->fatal_error |= !add_string(&st->exclude_dirs, value + 1);
+    if (!strncmp(name, "binary-files=", 13)) parse_binary_files(value + 1, st);
+    if (!strncmp(name, "after-context=", 14)) parse_context(value + 1, &st->after_context, st);
+    if (!strncmp(name, "before-context=", 15)) parse_context(value + 1, &st->before_context, st);
+    if (!strncmp(name, "context=", 8)) parse_context(value + 1, &st->context, st);
+    if (!strcmp(name, "color") || !strcmp(name, "colour")) parse_color("auto", st);
+    if (!strncmp(name, "color=", 6) || !strncmp(name, "colour=", 7)) parse_color(value + 1, st);
+    if (!strncmp(name, "build-index=", 12)) st->index_dir = value + 1;
+    st->use_index |= !strcmp(name, "use-index");
+    st->follow |= !strcmp(name, "follow");
+}
+
+// A bare --color is auto, which colors only a terminal that can show it
+void parse_color(const char *arg, struct grep_state *st) {
+    const char *term = getenv("TERM");
+    if (!strcmp(arg, "always") || !strcmp(arg, "yes") || !strcmp(arg, "force")) {
+        st->color = true;
+    } else if (!strcmp(arg, "never") || !strcmp(arg, "no") || !strcmp(arg, "none")) {
+        st->color = false;
+    } else if (!strcmp(arg, "auto") || !strcmp(arg, "tty") || !strcmp(arg, "if-tty")) {
+        st->color = isatty(STDOUT_FILENO) && term != NULL && strcmp(term, "dumb");
+    } else {
+        fprintf(stderr, "grep: invalid argument '%s' for '--color'\n", arg);
+        st->usage_error = true;
+    }
+}
+
+void parse_binary_files(const char *arg, struct grep_state *st) {
+    if (!strcmp(arg, "binary")) {
+        st->binary_files = BINARY_FILES_BINARY;
+    } else if (!strcmp(arg, "text")) {
+        st->binary_files = BINARY_FILES_TEXT;
+    } else if (!strcmp(arg, "without-match")) {
+        st->binary_files = BINARY_FILES_WITHOUT_MATCH;
+    } else {
+        fprintf(stderr, "grep: unknown binary-files type\n");
+        st->usage_error = true;
+    }
+}
+
+// Short options take the next word, long ones carry their value. Only
+// --build-index takes the next word too, as in "--build-index DIR".
+bool takes_argument(const char *arg) {
+    return (get_dash_index(arg) == 1 && strpbrk(arg, ARG_OPTIONS) != NULL) || !strcmp(arg, "--build-index");
+}
+
+// Compiles every pattern once before any input is read, so errors are reported up front
+bool compile_patterns(const struct string_array *patterns, struct pattern_table *table,
+                      struct grep_state *st) {
+    table->data = calloc(patterns->count, sizeof(struct pattern));
+    st->fatal_error |= table->data == NULL;
+    size_t literals = 0;
+    for (size_t i = 0; i < patterns->count && !st->fatal_error; i++) {
+        struct pattern *p = table->data + table->count++;
+        p->source = patterns->data[i];
+        p->empty = !*p->source;
+        p->fixed = st->options.F || pattern_is_literal(p->source, st->cflags);
+        st->empty_pattern |= p->empty;
+        literals += p->fixed && !p->empty;
+    }
+    if (literals >= AC_MIN_PATTERNS && !st->fatal_error)
+        st->fatal_error = !build_automaton(table, st);
+    size_t natives = 0;
+    for (size_t i = 0; i < table->count && !st->fatal_error && !st->regex_error; i++)
+        natives += compile_pattern(table->data + i, st) && table->data[i].native;
+    if (natives >= DFA_MIN_PATTERNS && !st->fatal_error && !st->regex_error)
+        build_combined(table, st);
+    return !st->fatal_error && !st->regex_error;
+}
+
+// Regexes are compiled with REG_NEWLINE, so they can run over a whole buffer of lines
+bool compile_pattern(struct pattern *p, struct grep_state *st) {
+    int status = 0;
+    if (p->empty || p->in_automaton) {
+        p->compiled = false;
+    } else if (p->fixed) {
+        p->compiled = fixed_init(&p->literal, p->source, st->cflags & REG_ICASE);
+        st->fatal_error |= !p->compiled;
+    } else if (dfa_compile(&p->dfa, p->source, st->cflags)) {
+        p->compiled = p->native = true;
+    } else {
+        status = regcomp(&p->re, p->source, st->cflags | REG_NEWLINE);
+        STAT_ADD(STAT_REGCOMP_CALLS, 1);
+        p->compiled = status == 0;
+    }
+    if (p->compiled && !p->fixed) {
+        int lead = p->native ? dfa_lead_byte(&p->dfa) : -1;
+        st->fatal_error |= !prefilter_init(&p->prefilter, (const char**) &p->source, 1, st->cflags, lead);
+    }
+    if (status != 0) {
+        print_regex_error(status, &p->re);
+        regfree(&p->re);
+    }
+    st->regex_error = status != 0;
+    return status == 0;
+}
+
+// Patterns without metacharacters do not need the regex engine
+bool pattern_is_literal(const char *pattern, int cflags) {
+    const char *meta = cflags & REG_EXTENDED ? "\\.[]*^$+?(){}|\n" : "\\.[]*^$\n";
+    return pattern[strcspn(pattern, meta)] == '\0';
+}
+
+// Moves all literal patterns into one automaton that scans a line once
+bool build_automaton(struct pattern_table *table, struct grep_state *st) {
+    table->automaton = malloc(sizeof(struct aho_corasick));
+    bool ok = table->automaton != NULL && ac_init(table->automaton, st->cflags & REG_ICASE);
+    for (size_t i = 0; ok && i < table->count; i++) {
+        struct pattern *p = table->data + i;
+        p->in_automaton = p->fixed && !p->empty;
+        if (p->in_automaton) ok = ac_add(table->automaton, p->source, i);
+    }
+    return ok && ac_compile(table->automaton);
+}
+
+// Joins the regexes the DFA takes into one, a line is then scanned once for
+// all of them. Leftmost-longest over the alternation is what -o prints for
+// several patterns. If the joined program is too large they stay apart.
+bool build_combined(struct pattern_table *table, struct grep_state *st) {
+    const char **sources = malloc(sizeof(char*) * table->count);
+    size_t count = 0;
+    for (size_t i = 0; sources != NULL && i < table->count; i++)
+        if (table->data[i].native) sources[count++] = table->data[i].source;
+    table->combined = sources != NULL ? malloc(sizeof(struct dfa)) : NULL;
+    bool ok = table->combined != NULL && dfa_compile_set(table->combined, sources, count, st->cflags);
+    if (ok && !prefilter_init(&table->combined_prefilter, sources, count, st->cflags,
+                                 dfa_lead_byte(table->combined))) {
+        dfa_free(table->combined);
+        st->fatal_error = true;
+        ok = false;
+    }
+    for (size_t i = 0; ok && i < table->count; i++) {
+        struct pattern *p = table->data + i;
+        p->in_combined = p->native;
+        if (p->in_combined) {
+            dfa_free(&p->dfa);
+            prefilter_free(&p->prefilter);
+            p->compiled = p->native = false;
         }
-        files = files->next;
     }
+    if (!ok) {
+        free(table->combined);
+        table->combined = NULL;
+    }
+    free(sources);
+    return ok;
 }
 
-// Searches only for match in file content and does not care about its offsets
-void search_matches_in_file(FILE *f, char *filename, llist_t *patterns, struct grep_state *st) {
-    size_t lines_count = 1;
-    size_t match_count = 0;
-    bool match = false;
-    while (true) {
-        char *buffer = NULL;
-        ssize_t len = 0;
-        size_t s = 0;
-        if ((!match || !st->options.l) && !st->regex_error) {
-            len = getline(&buffer, &s, f);
-            st->fatal_error = buffer == NULL;
+void free_patterns(struct pattern_table *table) {
+    for (size_t i = 0; i < table->count; i++) {
+        struct pattern *p = table->data + i;
+        if (p->compiled && p->fixed && !table->shared)  fixed_free(&p->literal);
+        else if (p->compiled && p->native)            dfa_free(&p->dfa);
+        else if (p->compiled && !p->fixed)            regfree(&p->re);
+        if (!table->shared) prefilter_free(&p->prefilter);
+    }
+    if (!table->shared) prefilter_free(&table->combined_prefilter);
+    if (table->automaton != NULL && !table->shared) {
+        ac_free(table->automaton);
+        free(table->automaton);
+    }
+    if (table->combined != NULL) {
+        dfa_free(table->combined);
+        free(table->combined);
+    }
+    free(table->data);
+    table->automaton = NULL;
+    table->combined = NULL;
+    table->data = NULL;
+    table->count = 0;
+}
+
+// A worker of its own for every thread: regexes are compiled again per clone,
+// because regexec() serializes callers sharing one regex_t. A DFA clone shares
+// the program and builds its own states.
+bool clone_patterns(const struct pattern_table *table, struct pattern_table *clone, const struct grep_state *st) {
+    *clone = *table;
+    clone->shared = true;
+    clone->data = malloc(sizeof(struct pattern) * (table->count ? table->count : 1));
+    bool ok = clone->data != NULL;
+    clone->count = 0;
+    clone->combined = NULL;
+    if (ok && table->combined != NULL) {
+        clone->combined = malloc(sizeof(struct dfa));
+        ok = clone->combined != NULL && dfa_clone(table->combined, clone->combined);
+        if (!ok) {
+            free(clone->combined);
+            clone->combined = NULL;
         }
-        if (len == -1 || (match && st->options.l) || st->regex_error || st->fatal_error) {
-            free(buffer);
-            break;
+    }
+    for (size_t i = 0; ok && i < table->count; i++) {
+        struct pattern *p = clone->data + clone->count;
+        *p = table->data[i];
+        if (p->compiled && p->native) {
+            p->compiled = ok = dfa_clone(&table->data[i].dfa, &p->dfa);
+        } else if (p->compiled && !p->fixed) {
+            p->compiled = ok = regcomp(&p->re, p->source, st->cflags | REG_NEWLINE) == 0;
+            STAT_ADD(STAT_REGCOMP_CALLS, 1);
         }
-        match = find_match_in_line(buffer, patterns, st);
-        if (buffer[len - 1] == '\n') buffer[len - 1] = '\0';
-        if (match && !st->options.l && !st->options.c && !st->regex_error)
-            output_line(buffer, filename, lines_count, st);
-        free(buffer);
-        lines_count++;
-        match_count += match;
+        clone->count++;
     }
-    output_filename_and_count(filename, match_count, match, st);
+    return ok;
 }
 
-bool find_match_in_line(char *line, llist_t *patterns, struct grep_state *st) {
-    bool match = false;
-    while (patterns != NULL && (!match || st->options.v) && !st->regex_error) {
-        char *pattern = (char*) patterns->data;
-        match |= !*pattern || find_match(line, pattern, st);
-        patterns = patterns->next;
+// -v, -c, -l and -q only need to know whether a line matches
+bool offsets_needed(const struct grep_state *st) {
+    return !(st->options.v || st->options.c || st->options.l || st->options.q);
+}
+
+// Like the selected lines, context is not printed with -c, -l and -q
+bool context_needed(const struct grep_state *st) {
+    return (st->after_context >= 0 || st->before_context >= 0) &&
+           !(st->options.c || st->options.l || st->options.q);
+}
+
+bool init_worker(struct grep_worker *w, const struct grep_state *st,
+                 const struct pattern_table *patterns, bool clone) {
+    w->st = st;
+    w->owns_patterns = clone;
+    w->out = st->out;
+    output_init(&w->buffer, -1, 0);
+    w->matched = false;
+    w->fatal_error = false;
+    w->binary_match = false;
+    w->grouped = false;
+    w->patterns = *patterns;
+    bool ok = input_init(&w->input) & arena_init(&w->matches) &
+              ring_init(&w->context, st->before_context > 0 ? st->before_context : 0);
+    w->input.find_nul = st->binary_files != BINARY_FILES_TEXT;
+    w->input.zap_nul = st->binary_files == BINARY_FILES_BINARY;
+    if (ok && clone) ok = clone_patterns(patterns, &w->patterns, st);
+    return ok;
+}
+
+void free_worker(struct grep_worker *w) {
+    if (w->owns_patterns) free_patterns(&w->patterns);
+    input_free(&w->input);
+    arena_free(&w->matches);
+    ring_free(&w->context);
+    output_free(&w->buffer);
+}
+
+void process_stdio(struct pattern_table *patterns, struct grep_state *st) {
+    struct grep_worker w;
+    if (init_worker(&w, st, patterns, false)) {
+        int error = search_file(STDIN_FILENO, "(standard input)", &w);
+        if (error != 0 && !st->options.s) {
+            errno = error;
+            print_error("grep", "(standard input)");
+        }
+        if (w.binary_match) print_binary_match("(standard input)", st);
+        st->file_error |= error != 0;
     }
-    return (match ^ st->options.v) ^ st->regex_error;
+    st->matched |= w.matched;
+    st->fatal_error |= w.fatal_error;
+    free_worker(&w);
 }
 
-bool find_match(char *line, char *pattern, struct grep_state *st) {
-    regex_t re;
-    int status = regcomp(&re, pattern, st->cflags | REG_NOSUB);
-    if (status == 0) status = regexec(&re, line, 0, NULL, 0);
-    else             print_regex_error(status, &re);
-    regfree(&re);
-    st->regex_error = status != 0 && status != REG_NOMATCH;
-    return status == 0;
+void process_files(struct pattern_table *patterns, const struct string_array *files,
+                   struct grep_state *st) {
+    // -c and -l answer for the files as they are
+    if (st->follow && !st->options.c && !st->options.l) {
+        follow_files(patterns, files, st);
+        return;
+    }
+    struct index_search index;
+    // the few blocks an index leaves are searched on this thread
+    bool indexed = st->use_index && index_search_init(&index, patterns, st);
+    if (st->jobs > 1 && !indexed) {
+        process_files_parallel(patterns, files, st);
+        return;
+    }
+    struct grep_worker w;
+    struct prefetch prefetch;
+    st->fatal_error |= !init_worker(&w, st, patterns, false);
+    // the files after the one searched are opened and read meanwhile
+    bool ahead = !st->fatal_error && !indexed && prefetch_init(&prefetch, files->data, files->count);
+    // -q is answered by the first selected line
+    for (size_t i = 0; i < files->count && !st->fatal_error && !(st->options.q && w.matched); i++) {
+        struct prefetched_file *file = ahead ? prefetch_next(&prefetch) : NULL;
+        // files that are not regular are left to be opened here
+        bool opened = file != NULL && (file->fd != -1 || file->error != 0);
+        int fd = opened ? file->fd : open(files->data[i], O_RDONLY);
+        if (!opened) STAT_ADD(fd != -1 ? STAT_FILES_OPENED : STAT_FILES_FAILED, 1);
+        // a failed read is left to the search, which counts the file as before
+        int error = fd != -1 ? 0 : opened ? file->error : errno;
+        bool searched = fd != -1;
+        if (searched && indexed) {
+            error = index_search_file(&index, fd, files->data[i], &w);
+        } else if (searched && opened) {
+            input_preload(&w.input, fd, file->data, file->len, file->eof);
+            error = search_input(files->data[i], &w);
+        } else if (searched) {
+            error = search_file(fd, files->data[i], &w);
+        }
+        if (fd != -1 && !opened) close(fd);
+        if (ahead) prefetch_done(&prefetch);
+        if (error != 0 && !st->options.s) {
+            errno = error;
+            print_error("grep", files->data[i]);
+        }
+        if (searched && w.binary_match) print_binary_match(files->data[i], st);
+        st->file_error |= error != 0;
+        st->fatal_error |= w.fatal_error;
+    }
+    st->matched |= w.matched;
+    if (ahead) prefetch_free(&prefetch);
+    free_worker(&w);
+    if (indexed) index_search_free(&index);
+}
+
+// Feeds the file to search_region() by runs of complete lines. Only lines
+// that contain a match are looked at one by one. Nothing more is read once
+// -l, -q or -m have their answer, and the after-context of the last
+// selected line is printed. A terminal gets the lines of every read as they
+// are found. Returns errno of a failed read.
+int search_file(int fd, char *filename, struct grep_worker *w) {
+    input_reset(&w->input, fd);
+    return search_input(filename, w);
 }
 
-// Searches not only for match, but for its offsets too
-void search_substrings_in_file(FILE *f, char *filename, llist_t *patterns, struct grep_state *st) {
-    size_t lines_count = 1;
-    while (true) {
-        char *buffer = NULL;
-        ssize_t len = 0;
-        size_t s = 0;
-        if (!st->fatal_error && !st->regex_error) len = getline(&buffer, &s, f);
-        struct offset_array pmatch_arr = { malloc(sizeof(regmatch_t)), 0 };
-
-        st->fatal_error = pmatch_arr.data == NULL || buffer == NULL;
-        if (len == -1 || st->fatal_error || st->regex_error) {
-            free(pmatch_arr.data);
-            free(buffer);
-            break;
+// search_file() of an input that is set up already, it may hold bytes read ahead
+int search_input(char *filename, struct grep_worker *w) {
+    struct file_search fs = { filename, 1, 0, false, false, 0, 0, NULL, false };
+    ring_clear(&w->context);
+    while (!(fs.done && fs.after_left == 0) && !w->fatal_error) {
+        size_t len = input_next_lines(&w->input);
+        if (w->input.nul && !fs.binary) start_binary(&fs, w->st);
+        if (len == 0 || (fs.done && fs.after_left == 0)) break;
+        uint64_t since = STAT_CLOCK();
+        search_region(w->input.data + w->input.start, len, &fs, w);
+        STAT_PHASE(PHASE_MATCH, since);
+        since = STAT_CLOCK();
+        if (w->out->terminal) output_flush(w->out);
+        STAT_PHASE(PHASE_OUTPUT, since);
+        input_consume(&w->input, len);
+    }
+    w->fatal_error |= w->input.error == ENOMEM;
+    end_file(&fs, w);
+    return w->input.error != ENOMEM ? w->input.error : 0;
+}
+
+// What is left once the lines of a file are searched: -c and -l print here
+void end_file(struct file_search *fs, struct grep_worker *w) {
+    w->matched |= fs->match_count > 0;
+    w->binary_match = fs->binary && fs->match_count > fs->binary_from &&
+                      !w->st->options.c && !w->st->options.l && !w->st->options.q;
+    // GNU grep sets the context group after the note off with "--" too
+    w->grouped |= w->binary_match;
+    if (!offsets_needed(w->st)) {
+        uint64_t since = STAT_CLOCK();
+        output_filename_and_count(fs->filename, fs->match_count, fs->match_count > 0, w);
+        STAT_PHASE(PHASE_OUTPUT, since);
+    }
+}
+
+// The file is binary from the run of lines its first NUL byte was read with.
+// -I takes it as not matching, otherwise its lines are only counted, and
+// without -c the first match ends the search.
+void start_binary(struct file_search *fs, const struct grep_state *st) {
+    fs->binary = true;
+    fs->binary_from = fs->match_count;
+    fs->after_left = 0;
+    if (st->binary_files == BINARY_FILES_WITHOUT_MATCH) {
+        fs->match_count = 0;
+        fs->done = true;
+    }
+}
+
+// Like GNU grep the note goes to stderr, -s does not silence it. The lines
+// before it are written first.
+void print_binary_match(const char *filename, const struct grep_state *st) {
+    output_flush(st->out);
+    fprintf(stderr, "grep: %s: binary file matches\n", filename);
+}
+
+// With context the lines that are not selected go through skip_lines(), the
+// after-context is printed there and the before-context is looked up when a
+// line is selected
+void search_region(char *region, size_t len, struct file_search *fs, struct grep_worker *w) {
+    const struct grep_state *st = w->st;
+    bool context = context_needed(st);
+    char *pos = region;
+    char *end = region + len;
+    if (STAT_ENABLED) STAT_ADD(STAT_LINES_SCANNED, count_lines(region, len));
+    reset_hits(&w->patterns);
+    fs->unprinted = region;
+    while (pos < end && !fs->done && !w->fatal_error) {
+        char *hit = find_next_match(pos, end, &w->patterns);
+        char *line = hit != NULL ? line_start(pos, hit) : end;
+        if (st->options.v)      select_lines(pos, line, fs, w);
+        else if (context)       skip_lines(pos, line, fs, w);
+        else if (st->options.n) fs->line_number += count_lines(pos, line - pos);
+        pos = line;
+        if (hit != NULL && !fs->done) {
+            char *next = memchr(hit, '\n', end - hit);
+            if (next == NULL) next = end;
+            if (!st->options.v) select_line(line, next - line, fs, w);
+            else if (context)   skip_line(line, next - line, fs, w);
+            fs->line_number++;
+            pos = next < end ? next + 1 : end;
         }
+    }
+    // once -m is done only the after-context of its last line is left
+    if (context && fs->done) skip_lines(fs->unprinted, end, fs, w);
+    else if (context)        keep_context(fs->unprinted, end, w);
+}
+
+// Every line of [from, to) is selected, used by -v for the lines before a match
+void select_lines(char *from, char *to, struct file_search *fs, struct grep_worker *w) {
+    while (from < to && !fs->done) {
+        char *next = memchr(from, '\n', to - from);
+        if (next == NULL) next = to;
+        select_line(from, next - from, fs, w);
+        fs->line_number++;
+        from = next + 1;
+    }
+}
+
+void select_line(char *line, size_t len, struct file_search *fs, struct grep_worker *w) {
+    const struct grep_state *st = w->st;
+    // the line is known to match, the offsets are only looked for to print them
+    bool extract = offsets_needed(st) && (st->options.o || st->color);
+    bool match = !extract || find_substrings_in_line(line, len, w);
+    if (match && !w->fatal_error) {
+        fs->match_count++;
+        STAT_ADD(STAT_MATCHES, 1);
+        fs->done = st->options.l || st->options.q || (long) fs->match_count == st->max_count ||
+                   (fs->binary && !st->options.c);
+        uint64_t since = STAT_CLOCK();
+        bool print = !fs->binary && !st->options.l && !st->options.c && !st->options.q;
+        bool context = print && context_needed(st);
+        if (context) print_before_context(line, fs, w);
+        if (extract && !fs->binary)
+            output_substrings(line, len, fs->filename, fs->line_number, ':', w);
+        else if (print)
+            output_line(line, len, fs->filename, fs->line_number, ':', w);
+        if (context) mark_printed(line, len, fs, w);
+        if (context) fs->after_left = st->after_context > 0 ? st->after_context : 0;
+        STAT_NESTED_PHASE(PHASE_OUTPUT, PHASE_MATCH, since);
+    }
+}
+
+// Lines of [from, to) that are not selected: the first ones may still be
+// after-context, the others are only counted
+void skip_lines(char *from, char *to, struct file_search *fs, struct grep_worker *w) {
+    while (from < to && fs->after_left > 0) {
+        char *next = memchr(from, '\n', to - from);
+        if (next == NULL) next = to;
+        skip_line(from, next - from, fs, w);
+        fs->line_number++;
+        from = next + 1;
+    }
+    if (w->st->options.n && from < to) fs->line_number += count_lines(from, to - from);
+}
+
+void skip_line(char *line, size_t len, struct file_search *fs, struct grep_worker *w) {
+    if (fs->after_left > 0 && !fs->binary) {
+        fs->after_left--;
+        if (!w->st->options.o) output_context_line(line, len, fs->filename, fs->line_number, w);
+        mark_printed(line, len, fs, w);
+    }
+}
+
+// Up to -B lines before the selected one: first the unprinted ones of the
+// region, found from the back, then the ones the ring kept from the reads
+// before. A gap to the last printed line, or a new file, is marked with "--".
+void print_before_context(char *line, struct file_search *fs, struct grep_worker *w) {
+    const struct grep_state *st = w->st;
+    const struct line_ring *ring = &w->context;
+    size_t before = st->before_context > 0 ? st->before_context : 0;
+    char *first = line;
+    size_t count = 0;
+    for (; count < before && first > fs->unprinted; count++)
+        first = line_start(fs->unprinted, first - 1);
+    size_t kept = 0;
+    if (first == fs->unprinted) kept = before - count < ring->count ? before - count : ring->count;
+    bool gap = !fs->printed || first > fs->unprinted || kept < ring->count || ring->dropped;
+    if (gap && w->grouped) print_group_separator(w->out, st);
+    size_t line_number = fs->line_number - count - kept;
+    for (size_t i = ring->count - kept; i < ring->count && !st->options.o; i++)
+        output_context_line(ring_get(ring, i)->data, ring_get(ring, i)->len, fs->filename, line_number++, w);
+    while (first < line && !st->options.o) {
+        char *next = memchr(first, '\n', line - first);
+        output_context_line(first, next - first, fs->filename, line_number++, w);
+        first = next + 1;
+    }
+}
+
+// The read buffer is refilled after the region, so its last lines that are
+// not printed yet are copied into the ring. Only the last region of a file
+// can end without a newline, nothing is searched after it.
+void keep_context(char *from, char *end, struct grep_worker *w) {
+    struct line_ring *ring = &w->context;
+    if (from >= end || end[-1] != '\n') return;
+    char *first = end;
+    for (size_t count = 0; count < ring->size && first > from; count++)
+        first = line_start(from, first - 1);
+    ring->dropped |= first > from;
+    while (first < end && !w->fatal_error) {
+        char *next = memchr(first, '\n', end - first);
+        w->fatal_error |= !ring_push(ring, first, next - first);
+        first = next + 1;
+    }
+}
+
+// The line is printed, the before-context of the next group starts after it
+void mark_printed(char *line, size_t len, struct file_search *fs, struct grep_worker *w) {
+    fs->unprinted = line + len + 1;
+    fs->printed = true;
+    w->grouped = true;
+    ring_clear(&w->context);
+}
 
-        if (len == 0) len = 1;
-        if (buffer[len - 1] == '\n') buffer[len - 1] = '\0';
-        bool match = find_substrings_in_line(buffer, patterns, st, &pmatch_arr);
-        if (match && !st->fatal_error && !st->regex_error) {
-            qsort(pmatch_arr.data, pmatch_arr.last_index, sizeof(regmatch_t), &regmatch_cmp);
-            if (st->empty_pattern && !st->options.o)
-                output_line(buffer, filename, lines_count, st);
-            else
-                output_substrings(buffer, filename, lines_count, &pmatch_arr, st);
+// Earliest match of any pattern at or after pos. Every matcher remembers its
+// own next hit within the region, so it is searched again only once passed.
+char* find_next_match(char *pos, char *end, struct pattern_table *patterns) {
+    char *first = NULL;
+    if (patterns->automaton != NULL) {
+        if (!patterns->hit_valid || (patterns->hit != NULL && patterns->hit < pos)) {
+            size_t hit_end = 0;
+            bool found = ac_find(patterns->automaton, pos, end - pos, &hit_end);
+            patterns->hit = found ? pos + hit_end - 1 : NULL;
+            patterns->hit_valid = true;
         }
-        free(pmatch_arr.data);
-        free(buffer);
-        lines_count++;
-        st->empty_pattern = false;
+        first = patterns->hit;
+    }
+    if (patterns->combined != NULL && first != pos) {
+        if (!patterns->combined_hit_valid ||
+            (patterns->combined_hit != NULL && patterns->combined_hit < pos)) {
+            patterns->combined_hit = find_combined_match(pos, end, patterns);
+            patterns->combined_hit_valid = true;
+        }
+        char *hit = patterns->combined_hit;
+        if (hit != NULL && (first == NULL || hit < first)) first = hit;
+    }
+    for (size_t i = 0; i < patterns->count && first != pos; i++) {
+        struct pattern *p = patterns->data + i;
+        if (p->in_automaton || p->in_combined) continue;
+        if (!p->hit_valid || (p->hit != NULL && p->hit < pos)) {
+            p->hit = find_match(pos, end, p);
+            p->hit_valid = true;
+        }
+        if (p->hit != NULL && (first == NULL || p->hit < first)) first = p->hit;
+    }
+    return first;
+}
+
+char* find_match(char *pos, char *end, struct pattern *pattern) {
+    char *hit = NULL;
+    if (pattern->empty) {
+        hit = pos;
+    } else if (pattern->fixed) {
+        hit = (char*) fixed_find(&pattern->literal, pos, end - pos);
+    } else if (pattern->prefilter.count == 0) {
+        hit = find_regex_match(pos, end, pattern);
+    } else {
+        // the regex only runs on the lines with one of its literals
+        char *line_end = pos;
+        while (hit == NULL &&
+               (pos = prefilter_next_line(&pattern->prefilter, line_end, end, &line_end)) != NULL)
+            hit = find_regex_match(pos, line_end, pattern);
+    }
+    return hit;
+}
+
+char* find_regex_match(char *pos, char *end, struct pattern *pattern) {
+    char *hit = NULL;
+    if (pattern->native) {
+        hit = find_dfa_match(pos, end, &pattern->dfa);
+    } else {
+        regmatch_t match = { 0, end - pos };
+        STAT_ADD(STAT_REGEXEC_CALLS, 1);
+        if (regexec(&pattern->re, pos, 1, &match, REG_STARTEND) == 0)
+            hit = pos + match.rm_so;
+        // An empty match after the last newline of the region is not a line
+        if (hit == end && end[-1] == '\n') hit = NULL;
+    }
+    return hit;
+}
+
+char* find_combined_match(char *pos, char *end, struct pattern_table *patterns) {
+    const struct prefilter *prefilter = &patterns->combined_prefilter;
+    char *hit = NULL;
+    if (prefilter->count == 0) {
+        hit = find_dfa_match(pos, end, patterns->combined);
+    } else {
+        char *line_end = pos;
+        while (hit == NULL && (pos = prefilter_next_line(prefilter, line_end, end, &line_end)) != NULL)
+            hit = find_dfa_match(pos, line_end, patterns->combined);
     }
+    return hit;
 }
 
-bool find_substrings_in_line(char *line, llist_t *patterns,
-                             struct grep_state *st, struct offset_array *pmatch_arr) {
+// pos is a line start and a match ends in the line it starts in, so the end
+// of the earliest one finds the line just as well
+char* find_dfa_match(char *pos, char *end, struct dfa *dfa) {
+    char *hit = NULL;
+    size_t match_end = 0;
+    if (dfa_first_end(dfa, pos, 0, end - pos, &match_end))
+        hit = pos + match_end;
+    // An empty match after the last newline of the region is not a line
+    if (hit == end && end[-1] == '\n') hit = NULL;
+    return hit;
+}
+
+void reset_hits(struct pattern_table *patterns) {
+    patterns->hit_valid = false;
+    patterns->combined_hit_valid = false;
+    for (size_t i = 0; i < patterns->count; i++)
+        patterns->data[i].hit_valid = false;
+}
+
+char* line_start(char *from, char *hit) {
+    const char *last = find_last(from, '\n', hit - from);
+    return last != NULL ? (char*) last + 1 : from;
+}
+
+size_t count_lines(const char *str, size_t len) {
+    size_t count = 0;
+    const char *end = str + len;
+    while ((str = memchr(str, '\n', end - str)) != NULL) {
+        count++;
+        str++;
+    }
+    return count;
+}
+
+// Every matcher adds one sorted run to the arena, the runs are merged into
+// the non-overlapping matches in line order. Literal runs hold every
+// occurrence, regexes are searched again from where the merge has got to.
+bool find_substrings_in_line(char *line, size_t len, struct grep_worker *w) {
     bool match = false;
-    while (patterns != NULL && !st->fatal_error && !st->regex_error) {
-        char *pattern = (char*) patterns->data;
-        st->empty_pattern |= !*pattern;
-        match |= !*pattern || find_substrings(line, pattern, pmatch_arr, st);
-        patterns = patterns->next;
+    arena_reset(&w->matches);
+    if (w->patterns.automaton != NULL)
+        match = find_automaton_substrings(line, len, w);
+    if (w->patterns.combined != NULL && !w->fatal_error &&
+        prefilter_in_line(&w->patterns.combined_prefilter, line, len))
+        match |= find_substrings(line, len, w->patterns.count, w);
+    for (size_t i = 0; i < w->patterns.count && !w->fatal_error; i++) {
+        struct pattern *p = w->patterns.data + i;
+        if (p->in_automaton || p->in_combined || !prefilter_in_line(&p->prefilter, line, len))
+            continue;
+        else if (p->empty)
+            match = true;
+        else if (p->fixed)
+            match |= find_fixed_substrings(line, len, p, w);
+        else
+            match |= find_substrings(line, len, i, w);
+    }
+    if (match && !w->fatal_error) {
+        struct line_matches lm = { &w->patterns, line, len };
+        w->fatal_error = !arena_merge(&w->matches, &find_next_substring, &lm);
+        STAT_ADD(STAT_OFFSET_MERGES, 1);
     }
     return match;
 }
 
-bool find_substrings(char *line, char *pattern, struct offset_array *pmatch_arr, struct grep_state *st) {
-    regex_t re;
-    bool match = false;
-    int status = regcomp(&re, pattern, st->cflags);
-    if (status == 0) {
-        int i = 0;
-        while (true) {
-            int index = pmatch_arr->last_index;
-            status = regexec(&re, line + i, 1, pmatch_arr->data + index, 0) || !line[i];
-            match |= !status;
-            regmatch_t *new_array = realloc(pmatch_arr->data, sizeof(regmatch_t) * (index + 2));
-            st->fatal_error = new_array == NULL;
-            if (new_array != NULL)                pmatch_arr->data = new_array;
-            if (new_array == NULL || status != 0) break;
-            if (pmatch_arr->data[index].rm_so == pmatch_arr->data[index].rm_eo && line[i]) {
-                i++;
-            } else {
-                pmatch_arr->data[index].rm_so += i;
-                pmatch_arr->data[index].rm_eo += i;
-                i = pmatch_arr->data[index].rm_eo;
-                pmatch_arr->last_index++;
-            }
+// Adds a lazy run with the first match of pattern id, or of the combined DFA
+// when id is the pattern count. Empty matches select the line but are not
+// printed.
+bool find_substrings(char *line, size_t len, size_t id, struct grep_worker *w) {
+    regmatch_t m;
+    bool empty = false;
+    w->fatal_error = !arena_begin_run(&w->matches, id);
+    bool found = !w->fatal_error && next_substring(&w->patterns, id, line, len, 0, &m, &empty);
+    if (found) w->fatal_error = !arena_add(&w->matches, m.rm_so, m.rm_eo);
+    return found || empty;
+}
+
+bool find_next_substring(void *ctx, size_t id, regoff_t from, regmatch_t *m) {
+    struct line_matches *lm = ctx;
+    bool empty = false;
+    return next_substring(lm->patterns, id, lm->line, lm->len, from, m, &empty);
+}
+
+// First non-empty match at from or later. The whole line is passed on every
+// search, so ^ and \< only match where they would in the line.
+bool next_substring(struct pattern_table *patterns, size_t id, char *line, size_t len,
+                    size_t from, regmatch_t *m, bool *empty) {
+    struct pattern *p = id < patterns->count ? patterns->data + id : NULL;
+    struct dfa *dfa = p == NULL ? patterns->combined : p->native ? &p->dfa : NULL;
+    bool found = false, searched = true;
+    for (size_t i = from; !found && searched && i <= len;) {
+        size_t so = 0, eo = 0;
+        if (dfa != NULL) {
+            searched = dfa_exec(dfa, line, i, len, &so, &eo);
+        } else {
+            regmatch_t re_match = { i, len };
+            STAT_ADD(STAT_REGEXEC_CALLS, 1);
+            searched = regexec(&p->re, line, 1, &re_match, REG_STARTEND) == 0;
+            so = re_match.rm_so;
+            eo = re_match.rm_eo;
         }
-    } else {
-        print_regex_error(status, &re);
+        found = searched && so != eo;
+        *empty |= searched && so == eo;
+        m->rm_so = so;
+        m->rm_eo = eo;
+        i = eo + 1;
+    }
+    return found;
+}
+
+// One pass of the automaton over the line, every occurrence of every literal
+// pattern is kept. Matches are reported by their end, their run is sorted by
+// start afterwards.
+bool find_automaton_substrings(char *line, size_t len, struct grep_worker *w) {
+    struct automaton_matches ctx = { &w->matches, false };
+    w->fatal_error = !arena_begin_run(&w->matches, ARENA_EAGER) ||
+                     !ac_find_all(w->patterns.automaton, line, len, &collect_automaton_match, &ctx);
+    arena_sort_run(&w->matches);
+    return ctx.match;
+}
+
+bool collect_automaton_match(void *ctx, size_t id, size_t start, size_t end) {
+    struct automaton_matches *matches = ctx;
+    (void) id;  // which literal it is does not matter
+    matches->match = true;
+    return arena_add(matches->arena, start, end);
+}
+
+// Literal counterpart of find_substrings(). Overlapping occurrences are all
+// added, the merge picks the ones that do not overlap a match taken before.
+bool find_fixed_substrings(char *line, size_t len, struct pattern *pattern, struct grep_worker *w) {
+    bool match = false;
+    size_t i = 0;
+    w->fatal_error = !arena_begin_run(&w->matches, ARENA_EAGER);
+    while (i < len && !w->fatal_error) {
+        const char *found = fixed_find(&pattern->literal, line + i, len - i);
+        if (found == NULL) break;
+        regoff_t so = found - line;
+        i = so + 1;
+        w->fatal_error = !arena_add(&w->matches, so, so + pattern->literal.len);
+        match = true;
     }
-    regfree(&re);
-    st->regex_error = status != 0 && status != REG_NOMATCH;
     return match;
 }
 
 // Outputs just line with no higlight
-void output_line(char *line, char *filename, size_t line_number, struct grep_state *st) {
-    print_line_credentials(filename, line_number, st);
-    puts(line);
-}
-
-// Outputs matching line with highlited matching substrings (only substrings if -o given)
-void output_substrings(char *line, char *filename, size_t line_number,
-                       struct offset_array *pmatch_arr, struct grep_state *st) {
-    if (!st->options.o) print_line_credentials(filename, line_number, st);
-    int end = 0;
-    for (size_t i = 0; i < pmatch_arr->last_index; i++) {
-        if (pmatch_arr->data[i].rm_eo > end && pmatch_arr->data[i].rm_so >= end) {
-            if (st->options.o) print_line_credentials(filename, line_number, st);
-            while (end < pmatch_arr->data[i].rm_so && !st->options.o)
-                putchar(line[end++]);
-            int start = pmatch_arr->data[i].rm_so;
-            end = pmatch_arr->data[i].rm_eo;
-            // MATCH_HIGHLIGHT
-            for (int j = start; j < end; j++)
-                putchar(line[j]);
-            // RESET
-            if (st->options.o) putchar('\n');
-        }
+void output_line(char *line, size_t len, char *filename, size_t line_number, char sep,
+                 struct grep_worker *w) {
+    print_line_credentials(filename, line_number, sep, w);
+    output_write(w->out, line, len);
+    output_char(w->out, '\n');
+}
+
+// Outputs matching line with highlited matching substrings (only substrings if -o given).
+// The text between matches is copied a span at a time.
+void output_substrings(char *line, size_t len, char *filename, size_t line_number, char sep,
+                       struct grep_worker *w) {
+    const struct grep_state *st = w->st;
+    const struct match_arena *matches = &w->matches;
+    if (!st->options.o) print_line_credentials(filename, line_number, sep, w);
+    regoff_t end = 0;
+    for (size_t i = 0; i < matches->merged_len; i++) {
+        regoff_t start = matches->merged[i].rm_so;
+        if (st->options.o) print_line_credentials(filename, line_number, sep, w);
+        else output_write(w->out, line + end, start - end);
+        end = matches->merged[i].rm_eo;
+        print_colored(w->out, COLOR_MATCH, line + start, end - start, st->color);
+        if (st->options.o) output_char(w->out, '\n');
+    }
+    if (!st->options.o) {
+        output_write(w->out, line + end, len - end);
+        output_char(w->out, '\n');
     }
-    int len = strlen(line);
-    while (end < len && !st->options.o)
-        putchar(line[end++]);
-    if ((len == 0 || line[len - 1] != '\n') && !st->options.o)
-        putchar('\n');
 }
 
-// Outputs filename and/or line number if corresponding flags and conditions are present
-void print_line_credentials(char *filename, size_t line_number, struct grep_state *st) {
-    if (!st->options.h && st->files_to_search > 1)
-        printf("%s:", filename);
-    if (st->options.n)
-        printf("%zu:", line_number);
+// Like GNU grep, with -v the context lines are the matching ones, so they are
+// the ones highlighted
+void output_context_line(char *line, size_t len, char *filename, size_t line_number,
+                         struct grep_worker *w) {
+    if (w->st->color && w->st->options.v && find_substrings_in_line(line, len, w))
+        output_substrings(line, len, filename, line_number, '-', w);
+    else
+        output_line(line, len, filename, line_number, '-', w);
 }
 
-// Output for -l and -c flags
-void output_filename_and_count(char *filename, size_t match_count, bool match,  struct grep_state *st) {
-    if (match && st->options.l) {
-        puts(filename);
-    } else if ((match || !st->options.l) && st->options.c) {
-        if (!st->options.h && st->files_to_search > 1) printf("%s:", filename);
-        printf("%zu\n", match_count);
+// Outputs filename and/or line number if corresponding flags and conditions are present,
+// each followed by sep: ':' on selected lines, '-' on context lines
+void print_line_credentials(char *filename, size_t line_number, char sep, struct grep_worker *w) {
+    const struct grep_state *st = w->st;
+    if (!st->options.h && st->files_to_search > 1) {
+        print_colored(w->out, COLOR_FILENAME, filename, strlen(filename), st->color);
+        print_separator(sep, w);
+    }
+    if (st->options.n) {
+        if (st->color) output_string(w->out, COLOR_LINE_NUMBER);
+        output_number(w->out, line_number, 0);
+        if (st->color) output_string(w->out, COLOR_END);
+        print_separator(sep, w);
     }
 }
 
-// Comparator for regmatch offsets
-int regmatch_cmp(const void *offset1, const void *offset2) {
-    const regmatch_t *pmatch1 = offset1;
-    const regmatch_t *pmatch2 = offset2;
-    int result = (pmatch2->rm_so < pmatch1->rm_so) ||
-                 (pmatch2->rm_so == pmatch1->rm_so && pmatch2->rm_eo > pmatch1->rm_eo);
-    return result ? result : -1;
+void print_separator(char sep, struct grep_worker *w) {
+    print_colored(w->out, COLOR_SEPARATOR, &sep, 1, w->st->color);
 }
 
-llist_t* initialize_llist() {
-    llist_t *ll = malloc(sizeof(llist_t));
-    if (ll != NULL) {
-        ll->next = NULL;
-        ll->data = NULL;
-        ll->heap_used = false;
-    }
-    return ll;
+// An empty match is not colored
+void print_colored(struct output *out, const char *color, const char *text, size_t len, bool on) {
+    if (on && len > 0) output_string(out, color);
+    output_write(out, text, len);
+    if (on && len > 0) output_string(out, COLOR_END);
 }
 
+// "--" between context groups
+void print_group_separator(struct output *out, const struct grep_state *st) {
+    print_colored(out, COLOR_SEPARATOR, "--", 2, st->color);
+    output_char(out, '\n');
+}
 
-// Returns the last element
-llist_t* add_to_llist(llist_t *ll, void *value, bool heap_used) {
-    llist_t *cursor = ll;
-    while (cursor->next != NULL)
-        cursor = cursor->next;
-    llist_t *new = malloc(sizeof(llist_t));
-    if (new != NULL) {
-        new->data = value;
-        new->heap_used = heap_used;
-        new->next = NULL;
+// Output for -l and -c flags
+void output_filename_and_count(char *filename, size_t match_count, bool match, struct grep_worker *w) {
+    const struct grep_state *st = w->st;
+    if (match && st->options.l && !st->options.q) {
+        print_colored(w->out, COLOR_FILENAME, filename, strlen(filename), st->color);
+        output_char(w->out, '\n');
+    } else if ((match || !st->options.l) && st->options.c && !st->options.q) {
+        if (!st->options.h && st->files_to_search > 1) {
+            print_colored(w->out, COLOR_FILENAME, filename, strlen(filename), st->color);
+            print_separator(':', w);
+        }
+        output_number(w->out, match_count, 0);
+        output_char(w->out, '\n');
     }
-    cursor->next = new;
-    return cursor->next;
 }
 
-void free_llist(llist_t *ll) {
-    while (ll != NULL) {
-        llist_t *tmp = ll;
-        ll = ll->next;
-        if (tmp->heap_used)
-            free(tmp->data);
-        free(tmp);
+// Grows by doubling, the string itself is not copied
+bool add_string(struct string_array *strings, char *str) {
+    if (strings->count == strings->capacity) {
+        size_t capacity = strings->capacity ? strings->capacity * 2 : STRING_ARRAY_SIZE;
+        char **data = realloc(strings->data, capacity * sizeof(char*));
+        if (data == NULL) return false;
+        strings->data = data;
+        strings->capacity = capacity;
     }
+    strings->data[strings->count++] = str;
+    return true;
+}
+
+bool add_slab(struct string_array *strings, char *slab) {
+    char **slabs = realloc(strings->slabs, (strings->slab_count + 1) * sizeof(char*));
+    if (slabs != NULL) {
+        strings->slabs = slabs;
+        strings->slabs[strings->slab_count++] = slab;
+    } else {
+        free(slab);
+    }
+    return slabs != NULL;
+}
+
+void free_strings(struct string_array *strings) {
+    for (size_t i = 0; i < strings->slab_count; i++)
+        free(strings->slabs[i]);
+    free(strings->slabs);
+    free(strings->data);
+    strings->slabs = NULL;
+    strings->data = NULL;
+    strings->count = strings->capacity = strings->slab_count = 0;
 }
 
 void print_regex_error(int err_code, regex_t *re) {
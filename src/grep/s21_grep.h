@@ -4,65 +4,247 @@
 
 #define GREP_DEFAULT { \
     { false,  }, \
-    0, false, false, false, 0, 0, 0 \
+    0, false, false, false, 0, 0, 1, -1, -1, -1, -1, false, false, false, false, \
+    { NULL, 0, 0, NULL, 0 }, { NULL, 0, 0, NULL, 0 }, { NULL, 0, 0, NULL, 0 }, \
+    BINARY_FILES_BINARY, NULL, false, false, NULL, false \
 };
 
-#define MATCH_HIGHLIGHT printf("\x1b[31m");
-#define RESET           printf("\x1b[0m");
+// Options followed by an argument
+#define ARG_OPTIONS "efjmABC"
 
+// Names of the options given with two dashes, a trailing '=' takes a value
+#define LONG_OPTIONS { "stats", "recursive", "dereference-recursive", "sort-files", \
+                       "include=", "exclude=", "exclude-dir=", "binary-files=", \
+                       "after-context=", "before-context=", "context=", \
+                       "color", "color=", "colour", "colour=", \
+                       "build-index", "build-index=", "use-index", "follow", NULL }
 
+// Exit status of an error, 0 and 1 tell whether a line was selected
+#define EXIT_TROUBLE 2
+
+#define STRING_ARRAY_SIZE 16
+
+// Literal patterns are moved into one Aho-Corasick automaton from this count
+#define AC_MIN_PATTERNS 2
+
+// Regexes the DFA takes are joined into one from this count
+#define DFA_MIN_PATTERNS 2
+
+// --color escapes, the defaults of GNU grep's GREP_COLORS. Each one also
+// clears to the end of the line, so a colored line that wraps looks right.
+#define COLOR_MATCH       "\33[01;31m\33[K"
+#define COLOR_FILENAME    "\33[35m\33[K"
+#define COLOR_LINE_NUMBER "\33[32m\33[K"
+#define COLOR_SEPARATOR   "\33[36m\33[K"
+#define COLOR_END         "\33[m\33[K"
+
+
+// What is done with a file once a NUL byte is read from it
+enum binary_files {
+    BINARY_FILES_BINARY,         // only told whether it matches
+    BINARY_FILES_TEXT,           // -a: searched like any other
+    BINARY_FILES_WITHOUT_MATCH   // -I: taken as not matching
+};
+
+// Patterns or filenames in command line order. Strings point into argv or
+// into the slabs that -f files are read into, the array frees the slabs.
+struct string_array {
+    char **data;
+    size_t count;
+    size_t capacity;
+    char **slabs;
+    size_t slab_count;
+};
+
+// Configuration, read-only once the patterns are compiled, and the results
+// of all inputs collected by the main thread
 struct grep_state {
     struct {
-        bool e, v, c, l, n, h, s, f, o;
+        bool e, v, c, l, n, h, s, f, o, F, q, r, R;
     } options;
     int cflags;
     bool empty_pattern;
     bool fatal_error;
     bool regex_error;
     size_t files_to_search;
-    size_t match_count;
     size_t first_regex_index;
+    size_t jobs;
+    long max_count;    // -m, negative without a limit
+    // -A, -B and -C, negative when not given. -C only stands in for the other two.
+    long after_context;
+    long before_context;
+    long context;
+    bool usage_error;
+    bool matched;      // a line was selected in some input
+    bool file_error;   // an input could not be opened or read
+    bool sort_files;   // -r output in path order instead of as files are done
+    // --include, --exclude and --exclude-dir globs, matched against base names
+    struct string_array includes;
+    struct string_array excludes;
+    struct string_array exclude_dirs;
+    enum binary_files binary_files;
+    struct output *out;  // stdout, written by one thread at a time
+    bool color;          // --color: matches, names and separators are highlighted
+    bool use_index;      // --use-index: files are searched where their index allows
+    char *index_dir;     // --build-index: the directory indexed instead of a search
+    bool follow;         // --follow: files are searched again as they grow
 };
 
-typedef struct llist_t {
-    struct llist_t *next;
-    void *data;
-    bool heap_used;
-} llist_t;
-
-struct offset_array {
-    regmatch_t *data;
-    size_t last_index;
+// Pattern compiled once per run; only the variant needed by the search path is built
+struct pattern {
+    char *source;
+    bool empty;
+    bool fixed;         // -F or no metacharacters: no regex is compiled
+    bool in_automaton;  // fixed and searched by the shared automaton
+    bool in_combined;   // native and searched by the combined DFA
+    bool compiled;
+    bool native;        // run by the DFA, regex_t is only built for what it cannot take
+    struct fixed_pattern literal;
+    struct dfa dfa;
+    regex_t re;
+    struct prefilter prefilter;  // shared by the clones
+    char *hit;          // next match in the current region, NULL if none
+    bool hit_valid;
 };
 
-void parse_cmd_args(int argc, char *argv[], struct grep_state *st, llist_t *regexes, llist_t *files);
-void parse_regexes(int argc, char *argv[], llist_t *regexes, struct grep_state *st);
-llist_t* read_regex_from_file(char *filename, llist_t *regexes);
-void parse_filenames(int argc, char *argv[], llist_t *files, struct grep_state *st);
-void parse_options(int argc, char *argv[], struct grep_state *st);
+struct pattern_table {
+    struct pattern *data;
+    size_t count;
+    bool shared;        // a clone: literals and the automaton belong to the original
+    struct aho_corasick *automaton;
+    char *hit;          // next automaton match in the current region
+    bool hit_valid;
+    struct dfa *combined;  // every native regex, one per thread
+    char *combined_hit;
+    bool combined_hit_valid;
+    struct prefilter combined_prefilter;
+};
 
-void process_files(llist_t *patterns, llist_t *files, struct grep_state *st);
-void process_stdio(llist_t *patterns, struct grep_state *st);
+// Mutable state of one searching thread
+struct grep_worker {
+    const struct grep_state *st;
+    struct pattern_table patterns;
+    bool owns_patterns;
+    struct input_buffer input;
+    struct match_arena matches;
+    struct output *out;     // stdout, or buffer while a job of -j or -r is searched
+    struct output buffer;   // kept in memory, printed later in order
+    bool matched;
+    bool fatal_error;
+    bool binary_match;  // the last file was binary and matched, GNU grep notes that
+    struct line_ring context;  // before-context kept from the previous read
+    bool grouped;       // a context group was printed, the next one is set off by "--"
+};
 
-void search_matches_in_file(FILE *f, char *filename, llist_t *patterns, struct grep_state *st);
-bool find_match_in_line(char *line, llist_t *patterns, struct grep_state *st);
-bool find_match(char *line, char *pattern, struct grep_state *st);
+// Progress of the search through one input
+struct file_search {
+    char *filename;
+    size_t line_number;  // line at the current position, counted only with -n and -v
+    size_t match_count;
+    bool done;
+    bool binary;         // a NUL byte was read, lines are no longer printed
+    size_t binary_from;  // match_count when that happened
+    size_t after_left;   // lines of after-context still to print
+    char *unprinted;     // context: first line of the region not printed yet
+    bool printed;        // context: a line of the file was printed
+};
 
-void search_substrings_in_file(FILE *f, char *filename, llist_t *patterns, struct grep_state *st);
-bool find_substrings_in_line(char *line, llist_t *patterns, struct grep_state *st, struct offset_array *pmatch_arr);
-bool find_substrings(char *line, char *pattern, struct offset_array *pmatch_arr, struct grep_state *st);
+struct automaton_matches {
+    struct match_arena *arena;
+    bool match;
+};
 
-void output_line(char *line, char *filename, size_t line_number, struct grep_state *st);
-void output_substrings(char *line, char *filename, size_t linse_number, struct offset_array *pmatch_arr, struct grep_state *st);
-void output_filename_and_count(char *filename, size_t match_count, bool match, struct grep_state *st);
-void print_line_credentials(char *filename, size_t line_number, struct grep_state *st);
+// The line whose regex matches are searched again while merging
+struct line_matches {
+    struct pattern_table *patterns;
+    char *line;
+    size_t len;
+};
 
-int regmatch_cmp(const void *offset1, const void *offset2);
+void parse_cmd_args(int argc, char *argv[], struct grep_state *st,
+                    struct string_array *regexes, struct string_array *files);
+void parse_regexes(int argc, char *argv[], struct string_array *regexes, struct grep_state *st);
+bool add_pattern(struct string_array *patterns, char *str);
+void read_regex_from_file(char *filename, struct string_array *regexes, struct grep_state *st);
+char* read_whole_file(int fd, size_t *len);
+void parse_filenames(int argc, char *argv[], struct string_array *files, struct grep_state *st);
+void parse_options(int argc, char *argv[], struct grep_state *st);
+void parse_max_count(const char *arg, struct grep_state *st);
+void parse_jobs(const char *arg, struct grep_state *st);
+void parse_binary_files(const char *arg, struct grep_state *st);
+void parse_context(const char *arg, long *length, struct grep_state *st);
+void parse_color(const char *arg, struct grep_state *st);
+bool is_long_option(const char *arg);
+void parse_long_option(char *name, struct grep_state *st);
+bool takes_argument(const char *arg);
+int exit_status(const struct grep_state *st);
+
+bool compile_patterns(const struct string_array *patterns, struct pattern_table *table,
+                      struct grep_state *st);
+bool compile_pattern(struct pattern *p, struct grep_state *st);
+bool pattern_is_literal(const char *pattern, int cflags);
+bool build_automaton(struct pattern_table *table, struct grep_state *st);
+bool build_combined(struct pattern_table *table, struct grep_state *st);
+bool clone_patterns(const struct pattern_table *table, struct pattern_table *clone, const struct grep_state *st);
+void free_patterns(struct pattern_table *table);
+bool offsets_needed(const struct grep_state *st);
+bool context_needed(const struct grep_state *st);
+
+bool init_worker(struct grep_worker *w, const struct grep_state *st,
+                 const struct pattern_table *patterns, bool clone);
+void free_worker(struct grep_worker *w);
+
+void process_files(struct pattern_table *patterns, const struct string_array *files,
+                   struct grep_state *st);
+void process_stdio(struct pattern_table *patterns, struct grep_state *st);
+
+int search_file(int fd, char *filename, struct grep_worker *w);
+int search_input(char *filename, struct grep_worker *w);
+void end_file(struct file_search *fs, struct grep_worker *w);
+void start_binary(struct file_search *fs, const struct grep_state *st);
+void print_binary_match(const char *filename, const struct grep_state *st);
+void search_region(char *region, size_t len, struct file_search *fs, struct grep_worker *w);
+void select_lines(char *from, char *to, struct file_search *fs, struct grep_worker *w);
+void select_line(char *line, size_t len, struct file_search *fs, struct grep_worker *w);
+void skip_lines(char *from, char *to, struct file_search *fs, struct grep_worker *w);
+void skip_line(char *line, size_t len, struct file_search *fs, struct grep_worker *w);
+void print_before_context(char *line, struct file_search *fs, struct grep_worker *w);
+void keep_context(char *from, char *end, struct grep_worker *w);
+void mark_printed(char *line, size_t len, struct file_search *fs, struct grep_worker *w);
+char* find_next_match(char *pos, char *end, struct pattern_table *patterns);
+char* find_match(char *pos, char *end, struct pattern *pattern);
+char* find_regex_match(char *pos, char *end, struct pattern *pattern);
+char* find_combined_match(char *pos, char *end, struct pattern_table *patterns);
+char* find_dfa_match(char *pos, char *end, struct dfa *dfa);
+void reset_hits(struct pattern_table *patterns);
+char* line_start(char *from, char *hit);
+size_t count_lines(const char *str, size_t len);
+
+bool find_substrings_in_line(char *line, size_t len, struct grep_worker *w);
+bool find_substrings(char *line, size_t len, size_t id, struct grep_worker *w);
+bool find_next_substring(void *ctx, size_t id, regoff_t from, regmatch_t *m);
+bool next_substring(struct pattern_table *patterns, size_t id, char *line, size_t len,
+                    size_t from, regmatch_t *m, bool *empty);
+bool find_automaton_substrings(char *line, size_t len, struct grep_worker *w);
+bool collect_automaton_match(void *ctx, size_t id, size_t start, size_t end);
+bool find_fixed_substrings(char *line, size_t len, struct pattern *pattern, struct grep_worker *w);
+
+void output_line(char *line, size_t len, char *filename, size_t line_number, char sep,
+                 struct grep_worker *w);
+void output_substrings(char *line, size_t len, char *filename, size_t line_number, char sep,
+                       struct grep_worker *w);
+void output_context_line(char *line, size_t len, char *filename, size_t line_number,
+                         struct grep_worker *w);
+void output_filename_and_count(char *filename, size_t match_count, bool match, struct grep_worker *w);
+void print_line_credentials(char *filename, size_t line_number, char sep, struct grep_worker *w);
+void print_separator(char sep, struct grep_worker *w);
+void print_colored(struct output *out, const char *color, const char *text, size_t len, bool on);
+void print_group_separator(struct output *out, const struct grep_state *st);
 
 void print_regex_error(int err_code, regex_t *re);
 
-llist_t* initialize_llist();
-llist_t* add_to_llist(llist_t *ll, void *value, bool heap_used);
-void free_llist(llist_t *ll);
+bool add_string(struct string_array *strings, char *str);
+bool add_slab(struct string_array *strings, char *slab);
+void free_strings(struct string_array *strings);
 
 #endif  // GREP
@@ -5,6 +5,8 @@ import unittest
 import os
 import sys
 import difflib
+import json
+import shutil
 
 
 GREP_FILE = "grep.txt"
@@ -148,6 +150,66 @@ class GrepSingleOptionTestCase(unittest.TestCase):
                         diff = get_diff()
                         self.assertFalse(diff, diff)
     
+    @skip_if_not_gnu
+    def test_o_option_anchors_and_empty_matches(self):
+        for opts in ((), ("-o",), ("-o", "-n")):
+            with self.subTest(options=opts):
+                execute_grep(*opts, "-e", "'^$'", "-e", "'^L'", "-e", "'x*'", "-e", "Lorem", "-e", "ipsum", *self.t_files)
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+
+    @skip_if_not_gnu
+    def test_regex_engines(self):
+        # the DFA takes most patterns, backreferences and \< stay with regexec()
+        regexes = ("'[[:digit:]]\\{2,3\\}'", "'^[A-Z][a-z]*'", "'\\(or\\|um\\)[^ ]*$'", "'a.\\?e'",
+                   "'\\(e\\).*\\1'", "'\\<d[a-z]*'", "'[]x-]'", "'*'", "'m\\{0,1\\}e\\+'")
+        for regex in regexes:
+            for opts in ((), ("-o",), ("-i", "-o"), ("-c",)):
+                with self.subTest(regex=regex, options=opts):
+                    execute_grep(*opts, "-e", regex, *self.t_files)
+                    diff = get_diff()
+                    self.assertFalse(diff, diff)
+        for regex in ("'(Lorem|ipsum)+ ?'", "'[a-f0-9]{4,}|x$'", "'^(.)?s'"):
+            with self.subTest(regex=regex):
+                execute_grep("-E", "-o", "-n", "-e", regex, *self.t_files)
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+
+    @skip_if_not_gnu
+    def test_combined_regexes(self):
+        # regexes are searched as one alternation, a match of one pattern may
+        # start inside the match another one had there on its own
+        regexes = ("'Lo[a-z]*'", "'re[a-z]\\+'", "'[a-z]*em'", "'^$'", "'s.\\{2,4\\}s'")
+        for opts in ((), ("-o",), ("-o", "-n", "-i"), ("-c",), ("-v",)):
+            with self.subTest(options=opts):
+                execute_grep(*opts, "-e", " -e ".join(regexes), *self.t_files)
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+
+    @skip_if_not_gnu
+    def test_overlapping_literals(self):
+        # the next match is looked for after the last one printed, whichever pattern it came from
+        lines_file = "overlap.txt"
+        with open(lines_file, "w") as f:
+            f.write("xaaa\nbbAaAaxxx\nxaaaaaa\n")
+        for regexes in (("xa", "aa"), ("BA", "aA"), ("xa", "aa", "a", "aaa", "q", "z"),
+                        ("xa", "'\\(a\\)\\1'"), ("'x[a]'", "aa")):
+            for opts in (("-o",), ("-o", "-i"), ("-o", "-F")):
+                with self.subTest(regexes=regexes, options=opts):
+                    execute_grep(*opts, "-e", " -e ".join(regexes), lines_file)
+                    diff = get_diff()
+                    self.assertFalse(diff, diff)
+        os.remove(lines_file)
+
+    def test_literal_prefilter(self):
+        # only lines with a literal every match needs reach the regex engine
+        for regex in ("'a.*b.*em'", "'\\(or\\).*\\1'", "'\\(Lor\\|ips\\)um'", "'[0-9]\\+x\\|qu[a-z]*'"):
+            for opts in ((), ("-i",), ("-o",), ("-v", "-c")):
+                with self.subTest(regex=regex, options=opts):
+                    execute_grep(*opts, regex, *self.t_files)
+                    diff = get_diff()
+                    self.assertFalse(diff, diff)
+
     def test_f_option(self):
         for file in self.t_files:
             with self.subTest(file=file):
@@ -157,6 +219,54 @@ class GrepSingleOptionTestCase(unittest.TestCase):
                         diff = get_diff()
                         self.assertFalse(diff, diff)
 
+    def test_F_option(self):
+        for file in self.t_files:
+            for opts in ((), ("-i",), ("-o",), ("-c",)):
+                with self.subTest(file=file, options=opts):
+                    execute_grep("-F", *opts, "-e", "Lorem", "-e", "'[0-9]'", "-e", "com", file)
+                    diff = get_diff()
+                    self.assertFalse(diff, diff)
+
+    def test_patterns_with_newlines(self):
+        # Every line of a pattern is a pattern of its own
+        for opts in (("-F",), ("-F", "-o"), ("-c",), ("-n",)):
+            with self.subTest(options=opts):
+                execute_grep(*opts, "-e", "'Lorem\ncom'", "'[0-9]\nprotec'", *self.t_files)
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+
+    def test_m_option(self):
+        for opts in (("-m", "0"), ("-m", "1"), ("-m", "3", "-n"), ("-m", "2", "-c"),
+                     ("-m", "2", "-o"), ("-m", "4", "-v"), ("-m", "1", "-l")):
+            with self.subTest(options=opts):
+                execute_grep(*opts, "-e", self.regexes, *self.t_files)
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+
+    def test_q_option(self):
+        for regex in ("Lorem", "nwah"):
+            for files in (self.t_files, ("nwah",) + self.t_files):
+                with self.subTest(regex=regex, files=files):
+                    s21_status = os.system(f"./s21_grep -q {regex} {' '.join(files)} > {S21_GREP_FILE} 2> {S21_ERR}")
+                    status = os.system(f"grep -q {regex} {' '.join(files)} > {GREP_FILE} 2> {ERR}")
+                    self.assertEqual(s21_status, status)
+                    diff = get_diff()
+                    self.assertFalse(diff, diff)
+                    err_diff = get_diff(S21_ERR, ERR)
+                    self.assertFalse(err_diff, err_diff)
+
+    def test_stats_option(self):
+        # --stats only adds one JSON line on stderr
+        os.system(f"./s21_grep --stats -n Lorem {' '.join(self.t_files)} > {S21_GREP_FILE} 2> {S21_ERR}")
+        os.system(f"grep -n Lorem {' '.join(self.t_files)} > {GREP_FILE} 2> {ERR}")
+        diff = get_diff()
+        self.assertFalse(diff, diff)
+        with open(S21_ERR) as f:
+            stats = json.loads(f.read())
+        self.assertEqual(stats["program"], "grep")
+        self.assertEqual(stats["files_opened"], len(self.t_files))
+        self.assertEqual(stats["bytes_written"], os.path.getsize(GREP_FILE))
+
     def test_f_option_multiple_files(self):
         execute_grep("-f", " -f ".join(self.regex_files), *self.t_files)
         diff = get_diff()
@@ -216,6 +326,191 @@ class GrepMultipleOptionsAndFilesTestCase(unittest.TestCase):
                 err_diff = get_diff(S21_ERR, ERR)
                 self.assertFalse(err_diff, err_diff)
 
+    def test_j_option(self):
+        # GNU grep has no -j: the output must be the one of a single-threaded run
+        files = ' '.join(self.t_files * 3)
+        for opts in ((), ("-n",), ("-c",), ("-l",), ("-o",), ("-v", "-h")):
+            with self.subTest(options=opts):
+                os.system(f"./s21_grep -j 4 -e {self.regexes} {' '.join(opts)} {files} nwah > {S21_GREP_FILE} 2> {S21_ERR}")
+                os.system(f"grep -e {self.regexes} {' '.join(opts)} {files} nwah > {GREP_FILE} 2> {ERR}")
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+                err_diff = get_diff(S21_ERR, ERR)
+                self.assertFalse(err_diff, err_diff)
+        for jobs in ("abc", "-3", "0", "commit"):
+            with self.subTest(jobs=jobs):
+                status = os.system(f"./s21_grep -r -j {jobs} commit {FILES_DIR} > {S21_GREP_FILE} 2> {S21_ERR}")
+                self.assertEqual(os.waitstatus_to_exitcode(status), 2)
+
+    def test_r_option(self):
+        # GNU grep prints files in directory order, --sort-files in path order
+        for opts in ((), ("-n",), ("-c",), ("-l",), ("-o", "-i"), ("--include='*.txt'", "--exclude='e*'"),
+                     ("--exclude-dir=regex",)):
+            with self.subTest(options=opts):
+                os.system(f"./s21_grep -r -j 3 --sort-files -e commit -e {REGEXES['decimal']} {' '.join(opts)} "
+                          f"{FILES_DIR} nwah > {S21_GREP_FILE} 2> {S21_ERR}")
+                os.system(f"grep -r -e commit -e {REGEXES['decimal']} {' '.join(opts)} {FILES_DIR} nwah "
+                          f"2> {ERR} | LC_ALL=C sort -s -t: -k1,1 > {GREP_FILE}")
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+                err_diff = get_diff(S21_ERR, ERR)
+                self.assertFalse(err_diff, err_diff)
+
+    def test_R_option_links(self):
+        # -R reports links it can not follow, -r skips every link
+        shutil.copytree(FILES_DIR, "links", ignore=shutil.ignore_patterns("regex"))
+        os.symlink("nowhere", "links/dangling")
+        os.symlink("loop", "links/loop")
+        for opts in (("-R",), ("-r",), ("-R", "-s"), ("-R", "--exclude=loop")):
+            with self.subTest(options=opts):
+                status = os.system(f"./s21_grep --sort-files {' '.join(opts)} commit links "
+                                   f"> {S21_GREP_FILE} 2> {S21_ERR}")
+                os.system(f"grep {' '.join(opts)} commit links 2> {ERR} | LC_ALL=C sort -s -t: -k1,1 > {GREP_FILE}")
+                gnu_status = os.system(f"grep {' '.join(opts)} commit links > /dev/null 2>&1")
+                self.assertEqual(os.waitstatus_to_exitcode(status), os.waitstatus_to_exitcode(gnu_status))
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+                os.system(f"LC_ALL=C sort {ERR} -o {ERR}")
+                err_diff = get_diff(S21_ERR, ERR)
+                self.assertFalse(err_diff, err_diff)
+        shutil.rmtree("links")
+
+    def test_j_option_large_file(self):
+        # Large enough to be split into chunks searched by different threads
+        big_file = "big.txt"
+        with open(big_file, "w") as f:
+            for i in range(12):
+                for file in self.t_files:
+                    with open(file) as t:
+                        f.write(t.read() * 200)
+        for opts in (("-n",), ("-c",), ("-l",), ("-v", "-n"), ("-o", "-n")):
+            with self.subTest(options=opts):
+                os.system(f"./s21_grep -j 4 {' '.join(opts)} -e commit -e {REGEXES['decimal']} {big_file} > {S21_GREP_FILE} 2> {S21_ERR}")
+                os.system(f"grep {' '.join(opts)} -e commit -e {REGEXES['decimal']} {big_file} > {GREP_FILE} 2> {ERR}")
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+        # NUL bytes inside lines of different chunks: chunked output is held to the search on one thread
+        with open(big_file, "rb") as f:
+            data = bytearray(f.read())
+        for at in (len(data) // 3, len(data) // 2, len(data) * 5 // 6):
+            data[data.index(b"\n", at) - 3] = 0
+        with open(big_file, "wb") as f:
+            f.write(data)
+        for opts in ((), ("-n",), ("-c",), ("-l",), ("-v", "-n"), ("-o", "-n"), ("-I", "-c"), ("-a", "-n")):
+            with self.subTest(options=opts, nul=True):
+                status = os.system(f"./s21_grep -j 4 {' '.join(opts)} -e commit -e {REGEXES['decimal']} {big_file} "
+                                   f"> {S21_GREP_FILE} 2> {S21_ERR}")
+                serial = os.system(f"./s21_grep -j 1 {' '.join(opts)} -e commit -e {REGEXES['decimal']} {big_file} "
+                                   f"> {GREP_FILE} 2> {ERR}")
+                self.assertEqual(status, serial)
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+        os.remove(big_file)
+
+    def test_j_option_binary_chunk(self):
+        # A NUL byte past the first chunk: the lines read before it are still text, as on one thread
+        big_file = "big.txt"
+        data = b"".join(open(file, "rb").read() * 200 for file in self.t_files) * 12
+        nul = data.index(b"\n", len(data) * 3 // 4) + 1
+        with open(big_file, "wb") as f:
+            f.write(data[:nul] + b"\0" + data[nul:])
+        for files in (big_file, f"{big_file} {self.t_files[0]}"):
+            for opts in ((), ("-n",), ("-o",), ("-I",), ("-c",), ("-l",)):
+                with self.subTest(files=files, options=opts):
+                    status = os.system(f"./s21_grep -j 4 {' '.join(opts)} -e commit -e {REGEXES['decimal']} {files} "
+                                       f"> {S21_GREP_FILE} 2> {S21_ERR}")
+                    serial = os.system(f"./s21_grep -j 1 {' '.join(opts)} -e commit -e {REGEXES['decimal']} {files} "
+                                       f"> {GREP_FILE} 2> {ERR}")
+                    self.assertEqual(status, serial)
+                    diff = get_diff()
+                    self.assertFalse(diff, diff)
+                    err_diff = get_diff(S21_ERR, ERR)
+                    self.assertFalse(err_diff, err_diff)
+        os.remove(big_file)
+
+    def test_binary_files(self):
+        # One NUL byte makes a file binary: its lines are no longer printed
+        bin_file = "bin.dat"
+        with open(bin_file, "wb") as f:
+            f.write(b"commit 1\nmore\0commit 2\n2024\n")
+        files = ' '.join(self.t_files)
+        for opts in ((), ("-c",), ("-l",), ("-n", "-v"), ("-I",), ("-c", "-I"), ("-a",), ("-s",),
+                     ("--binary-files=text", "-o"), ("-r",)):
+            with self.subTest(options=opts):
+                execute_grep(*opts, '-e commit', bin_file, files)
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+                err_diff = get_diff(S21_ERR, ERR)
+                self.assertFalse(err_diff, err_diff)
+        os.remove(bin_file)
+
+    def test_context_options(self):
+        files = ' '.join(self.t_files)
+        for opts in (("-A 2",), ("-B 1", "-n"), ("-C 1", "-v"), ("-A 0",), ("-C 2", "-o"),
+                     ("--context=1", "-m 2"), ("-B 3", "-A 1", "-h")):
+            with self.subTest(options=opts):
+                execute_grep(*opts, '-e commit -e Lorem', files)
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+
+    def test_color(self):
+        files = ' '.join(self.t_files)
+        for opts in (("--color=always",), ("--color=always", "-n", "-o"), ("--color=always", "-c"),
+                     ("--color=always", "-v", "-C 1"), ("--colour=never", "-n"), ("--color", "-l")):
+            with self.subTest(options=opts):
+                execute_grep(*opts, '-e commit -e Lorem', files)
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+
+    def test_index(self):
+        # Files of many blocks, one of them changed after the index is built
+        index_dir = "indexed"
+        os.mkdir(index_dir)
+        files = []
+        for i, file in enumerate(self.t_files):
+            files.append(os.path.join(index_dir, f"{i}.txt"))
+            with open(file) as t, open(files[-1], "w") as f:
+                f.write(t.read() * 300)
+        os.system(f"./s21_grep --build-index {index_dir}")
+        with open(files[0], "a") as f:
+            f.write("commit 12345\n")
+        for opts in (("-n",), ("-c",), ("-l",), ("-o", "-i"), ("-n", "-F", "-e amet")):
+            with self.subTest(options=opts):
+                os.system(f"./s21_grep --use-index {' '.join(opts)} -e commit -e Lorem {' '.join(files)} "
+                          f"> {S21_GREP_FILE} 2> {S21_ERR}")
+                os.system(f"grep {' '.join(opts)} -e commit -e Lorem {' '.join(files)} > {GREP_FILE} 2> {ERR}")
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+        shutil.rmtree(index_dir)
+
+    def test_follow(self):
+        # Lines appended while following, an unfinished one only once its newline is written
+        log = "follow.log"
+        with open(self.t_files[0]) as t, open(log, "w") as f:
+            f.write(t.read())
+        os.system(f"(sleep 0.3; printf 'commit 1\\ncommit' >> {log}; sleep 0.2; printf ' 2\\n' >> {log}) & "
+                  f"timeout 1 ./s21_grep --follow -n commit {log} > {S21_GREP_FILE} 2> {S21_ERR}")
+        os.system(f"grep -n commit {log} > {GREP_FILE} 2> {ERR}")
+        diff = get_diff()
+        self.assertFalse(diff, diff)
+        os.remove(log)
+
+    def test_many_files(self):
+        # More operands than are read ahead, with a file larger than the data read ahead of it
+        big_file = "big.txt"
+        with open(self.t_files[0]) as t, open(big_file, "w") as f:
+            f.write(t.read() * 200)
+        files = ' '.join(self.t_files * 6 + (big_file, FILES_DIR, "nwah") + self.t_files)
+        for opts in ((), ("-n",), ("-c",), ("-l",), ("-m", "1")):
+            with self.subTest(options=opts):
+                os.system(f"./s21_grep -e commit {' '.join(opts)} {files} > {S21_GREP_FILE} 2> {S21_ERR}")
+                os.system(f"grep -e commit {' '.join(opts)} {files} > {GREP_FILE} 2> {ERR}")
+                diff = get_diff()
+                self.assertFalse(diff, diff)
+                err_diff = get_diff(S21_ERR, ERR)
+                self.assertFalse(err_diff, err_diff)
+        os.remove(big_file)
+
     def tearDown(self):
         os.remove(S21_GREP_FILE)
         os.remove(GREP_FILE)
@@ -0,0 +1,596 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <regex.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "fixed_search.h"
+#include "aho_corasick.h"
+#include "input_buffer.h"
+#include "match_arena.h"
+#include "line_ring.h"
+#include "dfa.h"
+#include "prefilter.h"
+#include "../common/output.h"
+#include "s21_grep.h"
+#include "tree_walk.h"
+#include "../common/utils.h"
+#include "../common/stats.h"
+
+// Entries of one open directory, read with getdents64() where there is one
+struct dir_reader {
+    int fd;
+    int error;
+#ifdef SYS_getdents64
+    uint64_t buffer[WALK_DIRENT_BUFFER / sizeof(uint64_t)];
+    size_t pos;
+    size_t len;
+#else
+    DIR *dir;
+#endif
+};
+
+#ifdef SYS_getdents64
+// Layout of the records getdents64() fills the buffer with
+struct dirent64_record {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+struct walk_thread {
+    struct tree_walk *walk;
+    size_t index;
+    pthread_t thread;
+};
+
+static bool add_roots(struct tree_walk *walk, const struct string_array *files, size_t *directories);
+static bool add_root(struct tree_walk *walk, char *operand, size_t root,
+                     struct walk_task *roots, size_t *added, size_t *directories);
+static void* walk_thread(void *arg);
+static bool take_task(struct tree_walk *walk, size_t self, struct walk_task *task);
+static bool pop_task(struct walk_deque *deque, struct walk_task *task);
+static bool steal_task(struct walk_deque *deque, struct walk_task *task);
+static bool push_tasks(struct tree_walk *walk, size_t self, struct walk_task *tasks, size_t count);
+static void finish_task(struct tree_walk *walk, struct walk_task *task, const struct grep_worker *w);
+static void free_task(struct walk_task *task);
+static void read_directory(struct tree_walk *walk, size_t self, struct walk_task *task);
+static bool add_entry(struct walk_task **batch, size_t *count, size_t *capacity,
+                      const struct walk_task *parent, const char *name, bool directory,
+                      const struct walk_id *id);
+static unsigned char entry_type(int dir_fd, const char *name, bool follow, int *error);
+static void add_link_error(struct tree_walk *walk, const struct walk_task *parent, const char *name,
+                           int error);
+static bool open_directory(struct dir_reader *reader, const char *path);
+static bool next_entry(struct dir_reader *reader, const char **name, unsigned char *type);
+static void close_directory(struct dir_reader *reader);
+static void search_task(struct tree_walk *walk, struct walk_task *task, struct grep_worker *w);
+static void add_result(struct tree_walk *walk, struct walk_task *task, struct walk_result *result);
+static void report(struct tree_walk *walk, const struct walk_result *result);
+static int compare_results(const void *a, const void *b);
+static int compare_paths(const char *a, const char *b);
+static bool name_excluded(const struct grep_state *st, const char *name, bool directory);
+static const char* base_name(const char *path);
+static char* join_path(const char *dir, const char *name);
+
+// -r and -R: directories are read and their files searched by one pool of
+// threads. Without operands the working directory is searched and its files
+// are named without "./". Output is written file by file as the files are
+// done, or with --sort-files once the walk ends, in operand and path order.
+void process_tree(struct pattern_table *patterns, const struct string_array *files,
+                  struct grep_state *st) {
+    struct tree_walk walk = { st, patterns, NULL, st->jobs, 0, 0, false, false, false, false,
+                              NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                              PTHREAD_MUTEX_INITIALIZER, false };
+    walk.deques = calloc(walk.thread_count, sizeof(struct walk_deque));
+    struct walk_thread *threads = calloc(walk.thread_count, sizeof(struct walk_thread));
+    for (size_t i = 0; walk.deques != NULL && i < walk.thread_count; i++)
+        pthread_mutex_init(&walk.deques[i].lock, NULL);
+    bool ok = walk.deques != NULL && threads != NULL;
+    size_t directories = 0;
+    if (ok) ok = add_roots(&walk, files, &directories);
+    // as with several operands, lines are prefixed once a directory is searched
+    if (directories > 0 && st->files_to_search < 2) st->files_to_search = 2;
+    walk.fatal_error = !ok;
+    size_t started = 1;
+    for (size_t i = 0; ok && i < walk.thread_count; i++) {
+        threads[i].walk = &walk;
+        threads[i].index = i;
+    }
+    // the calling thread is the first worker, with other threads it searches a clone too
+    while (ok && started < walk.thread_count &&
+           pthread_create(&threads[started].thread, NULL, &walk_thread, threads + started) == 0)
+        started++;
+    if (ok) walk_thread(threads);
+    for (size_t i = 1; ok && i < started; i++)
+        pthread_join(threads[i].thread, NULL);
+    // tasks left behind by -q or an error
+    struct walk_task task;
+    for (size_t i = 0; walk.deques != NULL && i < walk.thread_count; i++) {
+        while (pop_task(walk.deques + i, &task))
+            free_task(&task);
+        free(walk.deques[i].tasks);
+        pthread_mutex_destroy(&walk.deques[i].lock);
+    }
+    if (walk.result_count > 0)
+        qsort(walk.results, walk.result_count, sizeof(struct walk_result), &compare_results);
+    for (size_t i = 0; i < walk.result_count; i++) {
+        report(&walk, walk.results + i);
+        free(walk.results[i].path);
+        free(walk.results[i].output);
+    }
+    st->matched |= walk.matched;
+    st->file_error |= walk.file_error;
+    st->fatal_error |= walk.fatal_error;
+    free(walk.results);
+    free(walk.deques);
+    free(threads);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.wake);
+    pthread_mutex_destroy(&walk.output_lock);
+}
+
+// Without -r the file filters only leave out operands, directories and names
+// that cannot be opened stay to be reported. The number of operands still
+// decides whether names are printed.
+void exclude_operands(struct string_array *files, const struct grep_state *st) {
+    size_t kept = 0;
+    for (size_t i = 0; i < files->count; i++) {
+        struct stat info;
+        bool file = stat(files->data[i], &info) == 0 && !S_ISDIR(info.st_mode);
+        if (!file || !name_excluded(st, base_name(files->data[i]), false))
+            files->data[kept++] = files->data[i];
+    }
+    files->count = kept;
+}
+
+// Operands go round robin to the deques, each deque gets its share in command
+// line order. No operand stands for the working directory.
+static bool add_roots(struct tree_walk *walk, const struct string_array *files, size_t *directories) {
+    char here[] = "";
+    size_t count = files->count > 0 ? files->count : 1;
+    struct walk_task *roots = malloc(sizeof(struct walk_task) * count);
+    struct walk_task *share = malloc(sizeof(struct walk_task) * count);
+    bool ok = roots != NULL && share != NULL;
+    size_t added = 0;
+    for (size_t i = 0; ok && i < count; i++)
+        ok = add_root(walk, files->count > 0 ? files->data[i] : here, i, roots, &added, directories);
+    size_t self = 0;
+    for (; ok && self < walk->thread_count; self++) {
+        size_t shared = 0;
+        for (size_t i = self; i < added; i += walk->thread_count)
+            share[shared++] = roots[i];
+        ok = shared == 0 || push_tasks(walk, self, share, shared);
+    }
+    // a failed push frees its share, the deques after it get nothing
+    for (size_t i = 0; !ok && roots != NULL && i < added; i++)
+        if (i % walk->thread_count >= self) free_task(roots + i);
+    free(roots);
+    free(share);
+    return ok;
+}
+
+// Command line links are followed with -r too. A directory has its trailing
+// slashes taken off, a name that does not exist is left to fail when opened.
+static bool add_root(struct tree_walk *walk, char *operand, size_t root,
+                     struct walk_task *roots, size_t *added, size_t *directories) {
+    struct stat info;
+    bool exists = stat(*operand ? operand : ".", &info) == 0;
+    bool directory = exists && S_ISDIR(info.st_mode);
+    struct walk_task task = { strdup(operand), root, directory, NULL, 0 };
+    bool ok = task.path != NULL;
+    size_t len = ok ? strlen(task.path) : 0;
+    while (directory && len > 1 && task.path[len - 1] == '/')
+        task.path[--len] = '\0';
+    if (ok && exists && name_excluded(walk->st, base_name(task.path), directory)) {
+        free(task.path);
+    } else if (ok) {
+        *directories += directory;
+        roots[(*added)++] = task;
+    }
+    return ok;
+}
+
+static void* walk_thread(void *arg) {
+    struct walk_thread *thread = arg;
+    struct tree_walk *walk = thread->walk;
+    struct grep_worker w;
+    bool ok = init_worker(&w, walk->st, walk->patterns, walk->thread_count > 1);
+    struct walk_task task;
+    while (ok && take_task(walk, thread->index, &task)) {
+        if (task.directory)
+            read_directory(walk, thread->index, &task);
+        else
+            search_task(walk, &task, &w);
+        finish_task(walk, &task, &w);
+    }
+    pthread_mutex_lock(&walk->lock);
+    walk->fatal_error |= !ok;
+    if (thread->index > 0) stats_merge_thread();
+    pthread_cond_broadcast(&walk->wake);
+    pthread_mutex_unlock(&walk->lock);
+    free_worker(&w);
+    return NULL;
+}
+
+// Own tasks first, then the top of the other deques. A thread only sleeps
+// while others run tasks that may still queue more.
+static bool take_task(struct tree_walk *walk, size_t self, struct walk_task *task) {
+    bool taken = false;
+    bool done = false;
+    while (!taken && !done) {
+        pthread_mutex_lock(&walk->lock);
+        size_t pushes = walk->pushes;
+        done = walk->pending == 0 || walk->quit || walk->fatal_error;
+        pthread_mutex_unlock(&walk->lock);
+        taken = !done && pop_task(walk->deques + self, task);
+        for (size_t i = 1; !done && !taken && i < walk->thread_count; i++)
+            taken = steal_task(walk->deques + (self + i) % walk->thread_count, task);
+        if (!done && !taken) {
+            pthread_mutex_lock(&walk->lock);
+            while (walk->pushes == pushes && walk->pending > 0 && !walk->quit && !walk->fatal_error)
+                pthread_cond_wait(&walk->wake, &walk->lock);
+            pthread_mutex_unlock(&walk->lock);
+        }
+    }
+    return taken;
+}
+
+static bool pop_task(struct walk_deque *deque, struct walk_task *task) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom > deque->top;
+    if (found) *task = deque->tasks[--deque->bottom];
+    if (deque->bottom == deque->top) deque->bottom = deque->top = 0;
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool steal_task(struct walk_deque *deque, struct walk_task *task) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom > deque->top;
+    if (found) *task = deque->tasks[deque->top++];
+    if (deque->bottom == deque->top) deque->bottom = deque->top = 0;
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Pushed last to first, so the owner pops them in directory order. They are
+// counted as pending before any thread can take them.
+static bool push_tasks(struct tree_walk *walk, size_t self, struct walk_task *tasks, size_t count) {
+    struct walk_deque *deque = walk->deques + self;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom + count > deque->capacity && deque->top > 0) {
+        memmove(deque->tasks, deque->tasks + deque->top,
+                sizeof(struct walk_task) * (deque->bottom - deque->top));
+        deque->bottom -= deque->top;
+        deque->top = 0;
+    }
+    bool ok = true;
+    if (deque->bottom + count > deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity : 64;
+        while (capacity < deque->bottom + count) capacity *= 2;
+        struct walk_task *grown = realloc(deque->tasks, sizeof(struct walk_task) * capacity);
+        ok = grown != NULL;
+        if (ok) deque->tasks = grown;
+        if (ok) deque->capacity = capacity;
+    }
+    if (ok) {
+        pthread_mutex_lock(&walk->lock);
+        walk->pending += count;
+        walk->pushes++;
+        pthread_cond_broadcast(&walk->wake);
+        pthread_mutex_unlock(&walk->lock);
+        for (size_t i = count; i > 0; i--)
+            deque->tasks[deque->bottom++] = tasks[i - 1];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    for (size_t i = 0; !ok && i < count; i++)
+        free_task(tasks + i);
+    return ok;
+}
+
+static void finish_task(struct tree_walk *walk, struct walk_task *task, const struct grep_worker *w) {
+    pthread_mutex_lock(&walk->lock);
+    walk->matched |= w->matched;
+    walk->quit |= walk->st->options.q && w->matched;
+    walk->fatal_error |= w->fatal_error;
+    walk->pending--;
+    if (walk->pending == 0 || walk->quit || walk->fatal_error)
+        pthread_cond_broadcast(&walk->wake);
+    pthread_mutex_unlock(&walk->lock);
+    free_task(task);
+}
+
+static void free_task(struct walk_task *task) {
+    free(task->path);
+    free(task->ancestors);
+}
+
+// Entries are told apart by d_type, stat is only called where it is unknown
+// and for links -R follows. -r skips links, and both skip devices, fifos and
+// sockets. Everything found is queued at once for this and idle threads.
+static void read_directory(struct tree_walk *walk, size_t self, struct walk_task *task) {
+    const struct grep_state *st = walk->st;
+    struct walk_result result = { task->path, task->root, NULL, 0, 0, false, false };
+    struct dir_reader reader;
+    struct walk_id id = { 0, 0 };
+    bool opened = open_directory(&reader, *task->path ? task->path : ".");
+    struct stat info;
+    if (!opened) {
+        result.error = errno;
+    } else if (st->options.R && fstat(reader.fd, &info) == 0) {
+        id.dev = info.st_dev;
+        id.ino = info.st_ino;
+        for (size_t i = 0; i < task->depth && !result.loop; i++)
+            result.loop = task->ancestors[i].dev == id.dev && task->ancestors[i].ino == id.ino;
+    }
+    struct walk_task *batch = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    const char *name = NULL;
+    unsigned char type = DT_UNKNOWN;
+    int error = 0;
+    bool ok = true;
+    while (ok && opened && !result.loop && next_entry(&reader, &name, &type)) {
+        if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+        error = 0;
+        if (type == DT_UNKNOWN || (type == DT_LNK && st->options.R))
+            type = entry_type(reader.fd, name, st->options.R, &error);
+        if (error != 0 && !name_excluded(st, name, false)) add_link_error(walk, task, name, error);
+        if ((type == DT_DIR || type == DT_REG) && !name_excluded(st, name, type == DT_DIR))
+            ok = add_entry(&batch, &count, &capacity, task, name, type == DT_DIR,
+                           st->options.R ? &id : NULL);
+    }
+    if (opened) result.error = reader.error;
+    if (opened) close_directory(&reader);
+    if (ok && count > 0) ok = push_tasks(walk, self, batch, count);
+    for (size_t i = 0; !ok && i < count; i++)
+        free_task(batch + i);
+    free(batch);
+    if (!ok) {
+        pthread_mutex_lock(&walk->lock);
+        walk->fatal_error = true;
+        pthread_mutex_unlock(&walk->lock);
+    }
+    if (result.error != 0 || result.loop) add_result(walk, task, &result);
+}
+
+// Subdirectories of a -R walk carry the ids of the directories above them
+static bool add_entry(struct walk_task **batch, size_t *count, size_t *capacity,
+                      const struct walk_task *parent, const char *name, bool directory,
+                      const struct walk_id *id) {
+    if (*count == *capacity) {
+        size_t grown_capacity = *capacity ? *capacity * 2 : 32;
+        struct walk_task *grown = realloc(*batch, sizeof(struct walk_task) * grown_capacity);
+        if (grown == NULL) return false;
+        *batch = grown;
+        *capacity = grown_capacity;
+    }
+    struct walk_task task = { join_path(parent->path, name), parent->root, directory, NULL, 0 };
+    bool ok = task.path != NULL;
+    if (ok && directory && id != NULL) {
+        task.depth = parent->depth + 1;
+        task.ancestors = malloc(sizeof(struct walk_id) * task.depth);
+        ok = task.ancestors != NULL;
+        if (ok && parent->depth > 0)
+            memcpy(task.ancestors, parent->ancestors, sizeof(struct walk_id) * parent->depth);
+        if (ok) task.ancestors[parent->depth] = *id;
+    }
+    if (ok)
+        (*batch)[(*count)++] = task;
+    else
+        free_task(&task);
+    return ok;
+}
+
+// Type of an entry d_type left open. A link -R can not follow is DT_UNKNOWN
+// with error set, an entry gone since the directory was read is not an error.
+static unsigned char entry_type(int dir_fd, const char *name, bool follow, int *error) {
+    struct stat info;
+    unsigned char type = DT_UNKNOWN;
+    *error = 0;
+    if (fstatat(dir_fd, name, &info, follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0) {
+        int failure = errno;
+        if (follow && fstatat(dir_fd, name, &info, AT_SYMLINK_NOFOLLOW) == 0) *error = failure;
+    } else {
+        if (S_ISDIR(info.st_mode)) type = DT_DIR;
+        else if (S_ISREG(info.st_mode)) type = DT_REG;
+        else if (S_ISLNK(info.st_mode)) type = DT_LNK;
+    }
+    return type;
+}
+
+// A dangling or looping link under -R is reported like a file that does not
+// open, "grep: tree/link: No such file or directory"
+static void add_link_error(struct tree_walk *walk, const struct walk_task *parent, const char *name,
+                           int error) {
+    struct walk_task task = { join_path(parent->path, name), parent->root, false, NULL, 0 };
+    struct walk_result result = { task.path, task.root, NULL, 0, error, false, false };
+    if (task.path != NULL) {
+        add_result(walk, &task, &result);
+    } else {
+        pthread_mutex_lock(&walk->lock);
+        walk->fatal_error = true;
+        pthread_mutex_unlock(&walk->lock);
+    }
+    free(task.path);
+}
+
+static bool open_directory(struct dir_reader *reader, const char *path) {
+    reader->fd = openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    reader->error = 0;
+#ifdef SYS_getdents64
+    reader->pos = 0;
+    reader->len = 0;
+    return reader->fd != -1;
+#else
+    reader->dir = reader->fd != -1 ? fdopendir(reader->fd) : NULL;
+    if (reader->fd != -1 && reader->dir == NULL) close(reader->fd);
+    return reader->dir != NULL;
+#endif
+}
+
+// False at the end of the directory, reader->error is set if reading failed
+static bool next_entry(struct dir_reader *reader, const char **name, unsigned char *type) {
+#ifdef SYS_getdents64
+    if (reader->pos == reader->len) {
+        long n = syscall(SYS_getdents64, reader->fd, reader->buffer, sizeof(reader->buffer));
+        if (n < 0) reader->error = errno;
+        reader->len = n > 0 ? n : 0;
+        reader->pos = 0;
+    }
+    bool found = reader->pos < reader->len;
+    if (found) {
+        struct dirent64_record *record = (struct dirent64_record*) ((char*) reader->buffer + reader->pos);
+        reader->pos += record->d_reclen;
+        *name = record->d_name;
+        *type = record->d_type;
+    }
+    return found;
+#else
+    errno = 0;
+    struct dirent *entry = readdir(reader->dir);
+    if (entry != NULL) {
+        *name = entry->d_name;
+        *type = entry->d_type;
+    }
+    reader->error = entry == NULL ? errno : 0;
+    return entry != NULL;
+#endif
+}
+
+static void close_directory(struct dir_reader *reader) {
+#ifdef SYS_getdents64
+    close(reader->fd);
+#else
+    closedir(reader->dir);
+#endif
+}
+
+// Files are searched whole into a buffer of their own, so the lines of one
+// file are never interleaved with those of another
+static void search_task(struct tree_walk *walk, struct walk_task *task, struct grep_worker *w) {
+    struct walk_result result = { task->path, task->root, NULL, 0, 0, false, false };
+    w->out = &w->buffer;
+    w->grouped = false;
+    int fd = open(task->path, O_RDONLY);
+    if (fd == -1) result.error = errno;
+    STAT_ADD(fd != -1 ? STAT_FILES_OPENED : STAT_FILES_FAILED, 1);
+    if (fd != -1) result.error = search_file(fd, task->path, w);
+    if (fd != -1) result.binary_match = w->binary_match;
+    if (fd != -1) close(fd);
+    result.output = output_release(&w->buffer, &result.size);
+    w->fatal_error |= w->buffer.error != 0;
+    w->buffer.error = 0;
+    w->out = walk->st->out;
+    add_result(walk, task, &result);
+}
+
+// Printed right away, or kept for --sort-files with the path taken over from
+// the task when there is anything to print
+static void add_result(struct tree_walk *walk, struct walk_task *task, struct walk_result *result) {
+    bool keep = walk->st->sort_files && (result->size > 0 || result->error != 0 || result->loop ||
+                                       result->binary_match);
+    pthread_mutex_lock(&walk->lock);
+    walk->file_error |= result->error != 0;
+    if (keep && walk->result_count == walk->result_capacity) {
+        size_t capacity = walk->result_capacity ? walk->result_capacity * 2 : 64;
+        struct walk_result *grown = realloc(walk->results, sizeof(struct walk_result) * capacity);
+        if (grown != NULL) walk->results = grown;
+        if (grown != NULL) walk->result_capacity = capacity;
+        walk->fatal_error |= grown == NULL;
+    }
+    if (keep && walk->result_count < walk->result_capacity) {
+        walk->results[walk->result_count++] = *result;
+        task->path = NULL;
+        result->output = NULL;
+    }
+    pthread_mutex_unlock(&walk->lock);
+    if (!walk->st->sort_files) {
+        uint64_t since = STAT_CLOCK();
+        pthread_mutex_lock(&walk->output_lock);
+        report(walk, result);
+        pthread_mutex_unlock(&walk->output_lock);
+        STAT_PHASE(PHASE_OUTPUT, since);
+    }
+    free(result->output);
+}
+
+// Context groups of different files are set off by "--"
+static void report(struct tree_walk *walk, const struct walk_result *result) {
+    const struct grep_state *st = walk->st;
+    const char *path = *result->path ? result->path : ".";
+    if (result->error != 0 && !st->options.s) {
+        errno = result->error;
+        print_error("grep", path);
+    } else if (result->loop && !st->options.s) {
+        fprintf(stderr, "grep: %s: warning: recursive directory loop\n", path);
+    }
+    if (walk->grouped && result->size > 0 && context_needed(st)) print_group_separator(st->out, st);
+    walk->grouped |= result->size > 0 || result->binary_match;
+    output_write(st->out, result->output, result->size);
+    if (st->out->terminal) output_flush(st->out);
+    if (result->binary_match) print_binary_match(path, st);
+}
+
+// Operand order first, then the paths component by component
+static int compare_results(const void *a, const void *b) {
+    const struct walk_result *x = a;
+    const struct walk_result *y = b;
+    int order = x->root < y->root ? -1 : x->root > y->root;
+    return order != 0 ? order : compare_paths(x->path, y->path);
+}
+
+// A separator sorts before any other byte, so "a/b" comes before "a.c"
+static int compare_paths(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    int x = *a == '/' ? 1 : (unsigned char) *a;
+    int y = *b == '/' ? 1 : (unsigned char) *b;
+    return x - y;
+}
+
+// Directories are left out by --exclude-dir, files by --exclude or by not
+// matching any --include
+static bool name_excluded(const struct grep_state *st, const char *name, bool directory) {
+    const struct string_array *globs = directory ? &st->exclude_dirs : &st->excludes;
+    bool excluded = false;
+    for (size_t i = 0; i < globs->count && !excluded; i++)
+        excluded = fnmatch(globs->data[i], name, 0) == 0;
+    bool included = directory || st->includes.count == 0;
+    for (size_t i = 0; i < st->includes.count && !included; i++)
+        included = fnmatch(st->includes.data[i], name, 0) == 0;
+    return excluded || !included;
+}
+
+static const char* base_name(const char *path) {
+    const char *slash = find_last(path, '/', strlen(path));
+    return slash != NULL && slash[1] ? slash + 1 : path;
+}
+
+// Names below the working directory get no "./"
+static char* join_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    size_t slash = dir_len > 0 && dir[dir_len - 1] != '/';
+    char *path = malloc(dir_len + slash + name_len + 1);
+    if (path != NULL) {
+        memcpy(path, dir, dir_len);
+        if (slash) path[dir_len] = '/';
+        memcpy(path + dir_len + slash, name, name_len + 1);
+    }
+    return path;
+}
@@ -0,0 +1,75 @@
+#ifndef TREE_WALK
+#define TREE_WALK
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Bytes of directory entries read by one getdents64() call
+#define WALK_DIRENT_BUFFER (32 * 1024)
+
+// Directory a -R walk has passed through, seen again it is a loop
+struct walk_id {
+    dev_t dev;
+    ino_t ino;
+};
+
+// A directory to read or a file to search, at or below a command line operand
+struct walk_task {
+    char *path;
+    size_t root;                // index of the operand, first key of --sort-files
+    bool directory;
+    struct walk_id *ancestors;  // -R only: directories above this one
+    size_t depth;
+};
+
+// Tasks of one thread. The owner pushes and pops at the bottom, so it walks
+// depth first; idle threads steal from the top, where the oldest and usually
+// largest subtrees are.
+struct walk_deque {
+    struct walk_task *tasks;
+    size_t top;
+    size_t bottom;
+    size_t capacity;
+    pthread_mutex_t lock;
+};
+
+// Output and error of one file or directory, kept for --sort-files
+struct walk_result {
+    char *path;
+    size_t root;
+    char *output;
+    size_t size;
+    int error;         // errno of a failed open or read
+    bool loop;         // -R came back to a directory above
+    bool binary_match;
+};
+
+// Shared by the threads of one -r run. Counters and results are guarded by
+// lock, stdout, stderr and grouped by output_lock.
+struct tree_walk {
+    const struct grep_state *st;
+    const struct pattern_table *patterns;
+    struct walk_deque *deques;
+    size_t thread_count;
+    size_t pending;      // tasks queued or running, the walk ends at 0
+    size_t pushes;       // bumped whenever tasks are queued, wakes idle threads
+    bool matched;
+    bool quit;           // -q has its answer
+    bool file_error;
+    bool fatal_error;
+    struct walk_result *results;
+    size_t result_count;
+    size_t result_capacity;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_mutex_t output_lock;
+    bool grouped;        // output was printed, a context group after it gets "--"
+};
+
+void process_tree(struct pattern_table *patterns, const struct string_array *files,
+                  struct grep_state *st);
+void exclude_operands(struct string_array *files, const struct grep_state *st);
+
+#endif  // TREE_WALK
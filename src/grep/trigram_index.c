@@ -0,0 +1,695 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <regex.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fixed_search.h"
+#include "aho_corasick.h"
+#include "input_buffer.h"
+#include "match_arena.h"
+#include "line_ring.h"
+#include "dfa.h"
+#include "prefilter.h"
+#include "../common/output.h"
+#include "s21_grep.h"
+#include "trigram_index.h"
+#include "../common/utils.h"
+#include "../common/stats.h"
+
+#ifdef __APPLE__
+#define MTIME(info) ((info).st_mtimespec)
+#else
+#define MTIME(info) ((info).st_mtim)
+#endif
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t) 7)
+
+// Posting lists while building, a power of two, and the read buffer
+#define BUILD_LISTS 4096
+#define BUILD_READ_SIZE (256 * 1024)
+
+// Widest varint of a 32-bit block id
+#define VARINT_MAX 5
+
+// Blocks of one trigram while the index is built. The lists are kept in an
+// open addressing table keyed by the trigram plus one, 0 is a free slot.
+struct posting_list {
+    uint32_t key;
+    uint32_t last;   // block added last, a block is added once
+    uint32_t count;
+    unsigned char *data;
+    size_t len;
+    size_t capacity;
+};
+
+struct index_builder {
+    struct grep_state *st;
+    struct posting_list *lists;
+    size_t list_count;
+    size_t list_capacity;
+    struct index_file *files;
+    size_t file_count;
+    size_t file_capacity;
+    struct index_block *blocks;
+    size_t block_count;
+    size_t block_capacity;
+    char *paths;     // zero-terminated, path_len leaves the zero out
+    size_t paths_len;
+    size_t paths_capacity;
+    unsigned char *buffer;
+};
+
+// A file entry with its path, for sorting the entries by path
+struct sorted_file {
+    const char *path;
+    struct index_file file;
+};
+
+static void index_directory(struct index_builder *b, const char *dir, const char *rel);
+static void index_file(struct index_builder *b, const char *full, const char *rel);
+static struct index_file* add_file(struct index_builder *b, const char *rel, const struct stat *info);
+static void add_block(struct index_builder *b, uint64_t offset, uint64_t line);
+static void add_posting(struct index_builder *b, uint32_t trigram);
+static struct posting_list* find_list(struct index_builder *b, uint32_t trigram);
+static bool grow_lists(struct index_builder *b);
+static void write_index(struct index_builder *b, const char *dir);
+static void write_sections(struct index_builder *b, struct output *out);
+static int compare_files(const void *a, const void *b);
+static int compare_lists(const void *a, const void *b);
+static void free_builder(struct index_builder *b);
+static void* reserve(void *data, size_t *capacity, size_t need, size_t size);
+static char* join_path(const char *dir, const char *name);
+static void report_error(struct grep_state *st, const char *path);
+
+static bool add_literal(struct index_search *is, const char *literal);
+static const struct index_file* find_file(struct index_search *is, const char *path,
+                                          struct trigram_index **found);
+static struct trigram_index* open_index(struct index_search *is, const char *dir);
+static bool map_index(struct trigram_index *idx);
+static bool valid_files(const struct trigram_index *idx);
+static const struct index_file* lookup_file(const struct trigram_index *idx, const char *rel);
+static bool find_candidates(struct trigram_index *idx, const struct index_search *is);
+static bool mark_literal(struct trigram_index *idx, const char *literal);
+static const struct index_trigram* find_trigram(const struct trigram_index *idx, uint32_t trigram);
+static size_t decode_postings(const struct trigram_index *idx, const struct index_trigram *t,
+                              uint32_t *ids, const uint32_t *keep, size_t keep_count);
+static int search_run(struct index_search *is, int fd, uint64_t offset, size_t len,
+                      struct file_search *fs, struct grep_worker *w);
+
+// --build-index: every regular file under dir, symbolic links are not
+// followed. The index is written under a temporary name and renamed over the
+// old one, so a search never maps a half written index.
+void build_index(const char *dir, struct grep_state *st) {
+    struct index_builder b = { st, NULL, 0, 0, NULL, 0, 0, NULL, 0, 0, NULL, 0, 0, NULL };
+    b.lists = calloc(BUILD_LISTS, sizeof(struct posting_list));
+    b.list_capacity = b.lists != NULL ? BUILD_LISTS : 0;
+    b.buffer = malloc(BUILD_READ_SIZE);
+    st->fatal_error |= b.lists == NULL || b.buffer == NULL;
+    if (!st->fatal_error) index_directory(&b, dir, "");
+    if (!st->fatal_error && !st->file_error) write_index(&b, dir);
+    free_builder(&b);
+}
+
+// rel is "" for dir itself, other directories are named relative to it
+static void index_directory(struct index_builder *b, const char *dir, const char *rel) {
+    char *path = join_path(dir, rel);
+    DIR *d = path != NULL ? opendir(path) : NULL;
+    b->st->fatal_error |= path == NULL;
+    if (path != NULL && d == NULL) report_error(b->st, path);
+    struct dirent *entry = NULL;
+    while (d != NULL && !b->st->fatal_error && (entry = readdir(d)) != NULL) {
+        const char *name = entry->d_name;
+        // an index is not indexed, nor is one being written
+        if (!strcmp(name, ".") || !strcmp(name, "..") || !strncmp(name, INDEX_NAME, strlen(INDEX_NAME)))
+            continue;
+        char *child = join_path(rel, name);
+        char *full = child != NULL ? join_path(dir, child) : NULL;
+        struct stat info;
+        if (full == NULL)                     b->st->fatal_error = true;
+        else if (lstat(full, &info) != 0)     report_error(b->st, full);
+        else if (S_ISDIR(info.st_mode))       index_directory(b, dir, child);
+        else if (S_ISREG(info.st_mode))       index_file(b, full, child);
+        free(child);
+        free(full);
+    }
+    if (d != NULL) closedir(d);
+    free(path);
+}
+
+// The file is read once. Trigrams go to the block they are in, a block ends
+// with the first newline after INDEX_BLOCK_SIZE bytes, so no line and no
+// trigram crosses blocks. The size and mtime are taken before the read: a
+// file written meanwhile is stale right away.
+static void index_file(struct index_builder *b, const char *full, const char *rel) {
+    int fd = open(full, O_RDONLY);
+    struct stat info;
+    int error = fd == -1 || fstat(fd, &info) != 0 ? errno : 0;
+    STAT_ADD(fd != -1 ? STAT_FILES_OPENED : STAT_FILES_FAILED, 1);
+    struct index_file *file = error == 0 ? add_file(b, rel, &info) : NULL;
+    uint64_t offset = 0, line = 0, block_start = 0;
+    uint32_t trigram = 0;
+    size_t run = 0;
+    bool cut = false;
+    ssize_t n = file != NULL ? 1 : 0;
+    while (n != 0 && error == 0 && !b->st->fatal_error) {
+        uint64_t since = STAT_CLOCK();
+        n = read(fd, b->buffer, BUILD_READ_SIZE);
+        STAT_PHASE(PHASE_READ, since);
+        if (n < 0 && errno != EINTR) error = errno;
+        if (n <= 0) continue;
+        STAT_ADD(STAT_BYTES_READ, n);
+        file->has_nul |= memchr(b->buffer, '\0', n) != NULL;
+        for (ssize_t i = 0; i < n; i++) {
+            unsigned char ch = fold_table[b->buffer[i]];
+            if (cut) {
+                block_start = offset + i;
+                add_block(b, block_start, line);
+                cut = false;
+            }
+            if (ch == '\n') {
+                line++;
+                run = 0;
+                cut = offset + i + 1 - block_start >= INDEX_BLOCK_SIZE;
+            } else {
+                trigram = (trigram << 8 | ch) & 0xffffff;
+                if (++run >= 3) add_posting(b, trigram);
+            }
+        }
+        offset += n;
+    }
+    if (file != NULL) file->block_count = b->block_count - file->first_block;
+    // its blocks stay, without a file they are never searched
+    if (file != NULL && error != 0) b->file_count--;
+    if (error != 0) report_error(b->st, full);
+    if (fd != -1) close(fd);
+}
+
+static struct index_file* add_file(struct index_builder *b, const char *rel, const struct stat *info) {
+    size_t len = strlen(rel);
+    struct index_file *files = reserve(b->files, &b->file_capacity, b->file_count + 1,
+                                       sizeof(struct index_file));
+    if (files != NULL) b->files = files;
+    char *paths = reserve(b->paths, &b->paths_capacity, b->paths_len + len + 1, 1);
+    if (paths != NULL) b->paths = paths;
+    b->st->fatal_error |= files == NULL || paths == NULL;
+    if (b->st->fatal_error) return NULL;
+    struct index_file *file = b->files + b->file_count++;
+    file->path = b->paths_len;
+    file->size = info->st_size;
+    file->mtime_sec = MTIME(*info).tv_sec;
+    file->mtime_nsec = MTIME(*info).tv_nsec;
+    file->first_block = b->block_count;
+    file->block_count = 0;
+    file->path_len = len;
+    file->has_nul = false;
+    memcpy(b->paths + b->paths_len, rel, len + 1);
+    b->paths_len += len + 1;
+    add_block(b, 0, 0);
+    return file;
+}
+
+static void add_block(struct index_builder *b, uint64_t offset, uint64_t line) {
+    struct index_block *blocks = reserve(b->blocks, &b->block_capacity, b->block_count + 1,
+                                         sizeof(struct index_block));
+    if (blocks != NULL) b->blocks = blocks;
+    b->st->fatal_error |= blocks == NULL || b->block_count == UINT32_MAX;
+    if (b->st->fatal_error) return;
+    b->blocks[b->block_count].offset = offset;
+    b->blocks[b->block_count].line = line;
+    b->block_count++;
+}
+
+// Appends the current block to the list of the trigram as a varint of its
+// distance to the block before, the first one as it is
+static void add_posting(struct index_builder *b, uint32_t trigram) {
+    uint32_t block = b->block_count - 1;
+    struct posting_list *list = find_list(b, trigram);
+    if (list == NULL || (list->count > 0 && list->last == block)) return;
+    unsigned char *data = reserve(list->data, &list->capacity, list->len + VARINT_MAX, 1);
+    b->st->fatal_error |= data == NULL;
+    if (data == NULL) return;
+    list->data = data;
+    uint32_t delta = list->count > 0 ? block - list->last : block;
+    for (; delta >= 0x80; delta >>= 7)
+        data[list->len++] = (delta & 0x7f) | 0x80;
+    data[list->len++] = delta;
+    list->last = block;
+    list->count++;
+}
+
+static struct posting_list* find_list(struct index_builder *b, uint32_t trigram) {
+    if (2 * (b->list_count + 1) > b->list_capacity && !grow_lists(b)) return NULL;
+    size_t mask = b->list_capacity - 1;
+    uint32_t h = (trigram ^ trigram >> 11) * 0x9e3779b1u;
+    size_t i = (h ^ h >> 15) & mask;
+    while (b->lists[i].key != 0 && b->lists[i].key != trigram + 1)
+        i = (i + 1) & mask;
+    if (b->lists[i].key == 0) {
+        b->lists[i].key = trigram + 1;
+        b->list_count++;
+    }
+    return b->lists + i;
+}
+
+static bool grow_lists(struct index_builder *b) {
+    size_t capacity = b->list_capacity * 2;
+    struct posting_list *lists = calloc(capacity, sizeof(struct posting_list));
+    b->st->fatal_error |= lists == NULL;
+    if (lists == NULL) return false;
+    for (size_t i = 0; i < b->list_capacity; i++) {
+        if (b->lists[i].key == 0) continue;
+        uint32_t trigram = b->lists[i].key - 1;
+        uint32_t h = (trigram ^ trigram >> 11) * 0x9e3779b1u;
+        size_t j = (h ^ h >> 15) & (capacity - 1);
+        while (lists[j].key != 0)
+            j = (j + 1) & (capacity - 1);
+        lists[j] = b->lists[i];
+    }
+    free(b->lists);
+    b->lists = lists;
+    b->list_capacity = capacity;
+    return true;
+}
+
+static void write_index(struct index_builder *b, const char *dir) {
+    char *temp = join_path(dir, INDEX_NAME ".tmp");
+    char *path = join_path(dir, INDEX_NAME);
+    int fd = temp != NULL && path != NULL ? open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    struct output out = { NULL, 0, 0, -1, false, 0 };
+    b->st->fatal_error |= temp == NULL || path == NULL;
+    if (fd != -1) b->st->fatal_error |= !output_init(&out, fd, OUTPUT_BUFFER_SIZE);
+    if (fd != -1 && !b->st->fatal_error) write_sections(b, &out);
+    if (fd != -1) output_flush(&out);
+    errno = out.error;
+    if (fd != -1 && close(fd) != 0 && out.error == 0) out.error = errno;
+    if (fd != -1 && (out.error != 0 || b->st->fatal_error)) unlink(temp);
+    if (fd == -1 || out.error != 0) {
+        if (out.error != 0) errno = out.error;
+        if (temp != NULL) print_error("grep", temp);
+        b->st->file_error = true;
+    } else if (!b->st->fatal_error && rename(temp, path) != 0) {
+        report_error(b->st, path);
+    }
+    output_free(&out);
+    free(temp);
+    free(path);
+}
+
+static void write_sections(struct index_builder *b, struct output *out) {
+    struct sorted_file *files = malloc(sizeof(struct sorted_file) * (b->file_count + 1));
+    struct posting_list **lists = malloc(sizeof(struct posting_list*) * (b->list_count + 1));
+    b->st->fatal_error |= files == NULL || lists == NULL;
+    size_t list_count = 0;
+    uint64_t postings_size = 0;
+    for (size_t i = 0; lists != NULL && i < b->list_capacity; i++) {
+        if (b->lists[i].key == 0) continue;
+        lists[list_count++] = b->lists + i;
+        postings_size += b->lists[i].len;
+    }
+    if (!b->st->fatal_error) {
+        for (size_t i = 0; i < b->file_count; i++) {
+            files[i].path = b->paths + b->files[i].path;
+            files[i].file = b->files[i];
+        }
+        qsort(files, b->file_count, sizeof(struct sorted_file), compare_files);
+        qsort(lists, list_count, sizeof(struct posting_list*), compare_lists);
+        struct index_header header = { INDEX_MAGIC, INDEX_BLOCK_SIZE, 0, b->file_count,
+                                       b->block_count, list_count, postings_size, b->paths_len };
+        output_write(out, (const char*) &header, sizeof(header));
+        for (size_t i = 0; i < b->file_count; i++)
+            output_write(out, (const char*) &files[i].file, sizeof(struct index_file));
+        output_write(out, (const char*) b->blocks, sizeof(struct index_block) * b->block_count);
+        uint64_t offset = 0;
+        for (size_t i = 0; i < list_count; i++) {
+            struct index_trigram trigram = { lists[i]->key - 1, lists[i]->count, offset };
+            output_write(out, (const char*) &trigram, sizeof(trigram));
+            offset += lists[i]->len;
+        }
+        for (size_t i = 0; i < list_count; i++)
+            output_write(out, (const char*) lists[i]->data, lists[i]->len);
+        for (; offset < ALIGN8(postings_size); offset++)
+            output_char(out, '\0');
+        output_write(out, b->paths, b->paths_len);
+    }
+    free(files);
+    free(lists);
+}
+
+static int compare_files(const void *a, const void *b) {
+    return strcmp(((const struct sorted_file*) a)->path, ((const struct sorted_file*) b)->path);
+}
+
+static int compare_lists(const void *a, const void *b) {
+    uint32_t x = (*(struct posting_list* const*) a)->key;
+    uint32_t y = (*(struct posting_list* const*) b)->key;
+    return (x > y) - (x < y);
+}
+
+static void free_builder(struct index_builder *b) {
+    for (size_t i = 0; i < b->list_capacity; i++)
+        free(b->lists[i].data);
+    free(b->lists);
+    free(b->files);
+    free(b->blocks);
+    free(b->paths);
+    free(b->buffer);
+}
+
+// Room for need elements of size bytes, grown by doubling. NULL when out of
+// memory, data is left as it was then.
+static void* reserve(void *data, size_t *capacity, size_t need, size_t size) {
+    if (need <= *capacity) return data;
+    size_t grown = *capacity > 0 ? *capacity : 16;
+    while (grown < need)
+        grown *= 2;
+    void *moved = realloc(data, grown * size);
+    if (moved != NULL) *capacity = grown;
+    return moved;
+}
+
+// dir/name, or just the one of them that is not empty
+static char* join_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+    if (path != NULL) {
+        memcpy(path, dir, dir_len);
+        if (dir_len > 0 && name_len > 0) path[dir_len++] = '/';
+        memcpy(path + dir_len, name, name_len + 1);
+    }
+    return path;
+}
+
+static void report_error(struct grep_state *st, const char *path) {
+    if (!st->options.s) print_error("grep", path);
+    st->file_error = true;
+}
+
+// --use-index: each pattern gives the literals one of which is in all its
+// matches, a fixed pattern itself, a regex the ones the DFA analysis finds.
+// False when some pattern has no literal of three bytes, or when lines
+// without a match are printed too (-v, context): the index cannot tell then
+// which blocks to skip, and every file is searched in full.
+bool index_search_init(struct index_search *is, const struct pattern_table *patterns,
+                       const struct grep_state *st) {
+    memset(is, 0, sizeof(*is));
+    bool ok = !st->options.v && !context_needed(st) && patterns->count > 0;
+    for (size_t i = 0; ok && i < patterns->count; i++) {
+        const struct pattern *p = patterns->data + i;
+        const char *source = p->source;
+        struct dfa_literals found;
+        if (p->empty)
+            ok = false;
+        else if (p->fixed)
+            ok = add_literal(is, source);
+        else if (dfa_literals(&source, 1, st->cflags, &found))
+            for (size_t j = 0; ok && j < found.count; j++)
+                ok = add_literal(is, found.strings[j]);
+        else
+            ok = false;
+    }
+    if (!ok) index_search_free(is);
+    return ok;
+}
+
+static bool add_literal(struct index_search *is, const char *literal) {
+    char **literals = realloc(is->literals, sizeof(char*) * (is->literal_count + 1));
+    if (literals != NULL) is->literals = literals;
+    char *copy = literals != NULL && strlen(literal) >= 3 && !strchr(literal, '\n') ? strdup(literal) : NULL;
+    if (copy != NULL) is->literals[is->literal_count++] = copy;
+    return copy != NULL;
+}
+
+// A file the nearest index has as it is now is searched in its candidate
+// blocks only, the runs of them read with pread(). Line numbers start from
+// the counts the index has. Other files are searched in full.
+int index_search_file(struct index_search *is, int fd, char *filename, struct grep_worker *w) {
+    struct trigram_index *idx = NULL;
+    const struct index_file *file = find_file(is, filename, &idx);
+    struct stat info;
+    bool fresh = file != NULL && !file->has_nul && fstat(fd, &info) == 0 &&
+                 (uint64_t) info.st_size == file->size && MTIME(info).tv_sec == file->mtime_sec &&
+                 MTIME(info).tv_nsec == file->mtime_nsec;
+    if (!fresh) return search_file(fd, filename, w);
+    struct file_search fs = { filename, 1, 0, false, false, 0, 0, NULL, false };
+    int error = 0;
+    uint32_t i = file->first_block;
+    uint32_t end = file->first_block + file->block_count;
+    while (i < end && !fs.done && error == 0 && !w->fatal_error) {
+        uint32_t last = i + 1;
+        uint64_t from = idx->blocks[i].offset;
+        while (idx->candidates[i] && last < end && idx->candidates[last] &&
+               idx->blocks[last].offset - from < INDEX_RUN_SIZE)
+            last++;
+        uint64_t to = last < end ? idx->blocks[last].offset : file->size;
+        fs.line_number = idx->blocks[i].line + 1;
+        if (idx->candidates[i]) error = search_run(is, fd, from, to - from, &fs, w);
+        i = last;
+    }
+    end_file(&fs, w);
+    return error;
+}
+
+// One run of candidate blocks, searched like a chunk of -j. A file cut
+// short after the check is searched as far as it goes.
+static int search_run(struct index_search *is, int fd, uint64_t offset, size_t len,
+                      struct file_search *fs, struct grep_worker *w) {
+    char *buffer = reserve(is->buffer, &is->capacity, len + 1, 1);
+    w->fatal_error |= buffer == NULL;
+    if (buffer == NULL) return 0;
+    is->buffer = buffer;
+    size_t got = 0;
+    int error = 0;
+    ssize_t n = 1;
+    uint64_t since = STAT_CLOCK();
+    while (got < len && n != 0 && error == 0) {
+        n = pread(fd, buffer + got, len - got, offset + got);
+        if (n < 0 && errno != EINTR) error = errno;
+        if (n > 0) got += n;
+    }
+    STAT_PHASE(PHASE_READ, since);
+    STAT_ADD(STAT_BYTES_READ, got);
+    if (got > 0 && error == 0) {
+        since = STAT_CLOCK();
+        search_region(buffer, got, fs, w);
+        STAT_PHASE(PHASE_MATCH, since);
+        since = STAT_CLOCK();
+        if (w->out->terminal) output_flush(w->out);
+        STAT_PHASE(PHASE_OUTPUT, since);
+    }
+    return error;
+}
+
+// The nearest directory above the operand with an index that has it.
+// Directories are looked up by name, "." stands for a relative operand's
+// working directory.
+static const struct index_file* find_file(struct index_search *is, const char *path,
+                                          struct trigram_index **found) {
+    const struct index_file *file = NULL;
+    size_t len = strlen(path);
+    char *dir = malloc(len + 2);
+    const char *end = path + len;
+    while (dir != NULL && file == NULL && end != NULL) {
+        const char *slash = find_last(path, '/', end - path);
+        const char *rel = slash != NULL ? slash + 1 : path;
+        if (slash != NULL) {
+            size_t dir_len = slash > path ? (size_t) (slash - path) : 1;
+            memcpy(dir, path, dir_len);
+            dir[dir_len] = '\0';
+        } else {
+            strcpy(dir, ".");
+        }
+        struct trigram_index *idx = slash != NULL || *path != '/' ? open_index(is, dir) : NULL;
+        file = idx != NULL ? lookup_file(idx, rel) : NULL;
+        if (file != NULL) *found = idx;
+        end = slash;
+    }
+    free(dir);
+    return file;
+}
+
+// Opened once per directory, a directory without a usable index is
+// remembered too
+static struct trigram_index* open_index(struct index_search *is, const char *dir) {
+    for (size_t i = 0; i < is->index_count; i++) {
+        if (!strcmp(is->indexes[i].dir, dir))
+            return is->indexes[i].usable ? is->indexes + i : NULL;
+    }
+    struct trigram_index *indexes = reserve(is->indexes, &is->index_capacity, is->index_count + 1,
+                                            sizeof(struct trigram_index));
+    if (indexes == NULL) return NULL;
+    is->indexes = indexes;
+    struct trigram_index *idx = indexes + is->index_count;
+    memset(idx, 0, sizeof(*idx));
+    idx->dir = strdup(dir);
+    if (idx->dir == NULL) return NULL;
+    is->index_count++;
+    idx->usable = map_index(idx) && find_candidates(idx, is);
+    return idx->usable ? idx : NULL;
+}
+
+// The sections must add up to the size of the file
+static bool map_index(struct trigram_index *idx) {
+    char *path = join_path(idx->dir, INDEX_NAME);
+    int fd = path != NULL ? open(path, O_RDONLY) : -1;
+    struct stat info;
+    bool ok = fd != -1 && fstat(fd, &info) == 0 && (size_t) info.st_size >= sizeof(struct index_header);
+    void *data = ok ? mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (fd != -1) close(fd);
+    free(path);
+    if (data == MAP_FAILED) return false;
+    idx->data = data;
+    idx->size = info.st_size;
+    const struct index_header *h = data;
+    uint64_t size = idx->size;
+    ok = !memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) && h->file_count <= size &&
+         h->block_count <= size && h->block_count < UINT32_MAX && h->trigram_count <= size &&
+         h->postings_size <= size && h->paths_size <= size;
+    uint64_t files_at = sizeof(struct index_header);
+    uint64_t blocks_at = files_at + h->file_count * sizeof(struct index_file);
+    uint64_t trigrams_at = blocks_at + h->block_count * sizeof(struct index_block);
+    uint64_t postings_at = trigrams_at + h->trigram_count * sizeof(struct index_trigram);
+    uint64_t paths_at = postings_at + ALIGN8(h->postings_size);
+    ok = ok && paths_at + h->paths_size == size;
+    if (ok) {
+        idx->header = h;
+        idx->files = (const struct index_file*) (idx->data + files_at);
+        idx->blocks = (const struct index_block*) (idx->data + blocks_at);
+        idx->trigrams = (const struct index_trigram*) (idx->data + trigrams_at);
+        idx->postings = idx->data + postings_at;
+        idx->paths = (const char*) idx->data + paths_at;
+        ok = valid_files(idx);
+    }
+    return ok;
+}
+
+// Blocks of a file go up from offset 0 and stay within the file
+static bool valid_files(const struct trigram_index *idx) {
+    bool ok = true;
+    for (uint64_t i = 0; ok && i < idx->header->file_count; i++) {
+        const struct index_file *f = idx->files + i;
+        ok = f->path + f->path_len < idx->header->paths_size && f->block_count > 0 &&
+             (uint64_t) f->first_block + f->block_count <= idx->header->block_count &&
+             idx->blocks[f->first_block].offset == 0;
+        for (uint32_t j = 1; ok && j < f->block_count; j++) {
+            const struct index_block *block = idx->blocks + f->first_block + j;
+            ok = block[-1].offset < block->offset && block->offset < f->size;
+        }
+    }
+    return ok;
+}
+
+static const struct index_file* lookup_file(const struct trigram_index *idx, const char *rel) {
+    size_t lo = 0, hi = idx->header->file_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int order = strcmp(idx->paths + idx->files[mid].path, rel);
+        if (order == 0) return idx->files + mid;
+        if (order < 0) lo = mid + 1;
+        else           hi = mid;
+    }
+    return NULL;
+}
+
+// Blocks with every trigram of one of the literals
+static bool find_candidates(struct trigram_index *idx, const struct index_search *is) {
+    idx->candidates = calloc(idx->header->block_count + 1, 1);
+    bool ok = idx->candidates != NULL;
+    for (size_t i = 0; ok && i < is->literal_count; i++)
+        ok = mark_literal(idx, is->literals[i]);
+    return ok;
+}
+
+// The rarest trigram is decoded first, the others only narrow its blocks down
+static bool mark_literal(struct trigram_index *idx, const char *literal) {
+    size_t len = strlen(literal);
+    const struct index_trigram *rarest = NULL;
+    bool absent = false;
+    for (size_t i = 0; i + 3 <= len && !absent; i++) {
+        const unsigned char *s = (const unsigned char*) literal + i;
+        const struct index_trigram *t = find_trigram(idx, fold_table[s[0]] << 16 |
+                                                          fold_table[s[1]] << 8 | fold_table[s[2]]);
+        absent = t == NULL;
+        if (t != NULL && (rarest == NULL || t->count < rarest->count)) rarest = t;
+    }
+    if (absent) return true;
+    uint32_t *ids = malloc(sizeof(uint32_t) * (rarest->count + 1));
+    if (ids == NULL) return false;
+    size_t count = decode_postings(idx, rarest, ids, NULL, 0);
+    for (size_t i = 0; i + 3 <= len && count > 0; i++) {
+        const unsigned char *s = (const unsigned char*) literal + i;
+        const struct index_trigram *t = find_trigram(idx, fold_table[s[0]] << 16 |
+                                                          fold_table[s[1]] << 8 | fold_table[s[2]]);
+        if (t != rarest) count = decode_postings(idx, t, ids, ids, count);
+    }
+    for (size_t i = 0; i < count; i++)
+        idx->candidates[ids[i]] = 1;
+    free(ids);
+    return true;
+}
+
+static const struct index_trigram* find_trigram(const struct trigram_index *idx, uint32_t trigram) {
+    size_t lo = 0, hi = idx->header->trigram_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (idx->trigrams[mid].trigram < trigram) lo = mid + 1;
+        else                                      hi = mid;
+    }
+    return lo < idx->header->trigram_count && idx->trigrams[lo].trigram == trigram ? idx->trigrams + lo : NULL;
+}
+
+// The blocks of t into ids. With keep only the ones also in keep are left,
+// keep may be ids itself. A list that runs past its end or out of the blocks
+// is broken: all of its blocks are taken then, so nothing is missed.
+static size_t decode_postings(const struct trigram_index *idx, const struct index_trigram *t,
+                              uint32_t *ids, const uint32_t *keep, size_t keep_count) {
+    uint64_t end = t + 1 < idx->trigrams + idx->header->trigram_count ? t[1].postings
+                                                                     : idx->header->postings_size;
+    uint64_t pos = t->postings;
+    bool broken = pos > end || end > idx->header->postings_size;
+    uint64_t id = 0;
+    size_t count = 0, k = 0;
+    for (uint32_t i = 0; i < t->count && !broken && (keep == NULL || k < keep_count); i++) {
+        uint64_t delta = 0;
+        unsigned shift = 0;
+        unsigned char byte = 0x80;
+        while (byte & 0x80 && pos < end && shift < 35) {
+            byte = idx->postings[pos++];
+            delta |= (uint64_t) (byte & 0x7f) << shift;
+            shift += 7;
+        }
+        id += delta;
+        broken = byte & 0x80 || (i > 0 && delta == 0) || id >= idx->header->block_count;
+        while (!broken && keep != NULL && k < keep_count && keep[k] < id)
+            k++;
+        if (!broken && keep == NULL) ids[count++] = id;
+        else if (!broken && k < keep_count && keep[k] == id) ids[count++] = keep[k++];
+    }
+    if (broken) {
+        memset(idx->candidates, 1, idx->header->block_count);
+        count = 0;
+    }
+    return count;
+}
+
+void index_search_free(struct index_search *is) {
+    for (size_t i = 0; i < is->literal_count; i++)
+        free(is->literals[i]);
+    free(is->literals);
+    for (size_t i = 0; i < is->index_count; i++) {
+        if (is->indexes[i].data != NULL) munmap(is->indexes[i].data, is->indexes[i].size);
+        free(is->indexes[i].candidates);
+        free(is->indexes[i].dir);
+    }
+    free(is->indexes);
+    free(is->buffer);
+    memset(is, 0, sizeof(*is));
+}
@@ -0,0 +1,92 @@
+#ifndef TRIGRAM_INDEX
+#define TRIGRAM_INDEX
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// File --build-index writes into the directory it indexes
+#define INDEX_NAME ".s21_grep_index"
+#define INDEX_MAGIC "S21GIX01"
+
+// Files are cut into blocks at the first line end after this many bytes
+#define INDEX_BLOCK_SIZE (64 * 1024)
+
+// Adjacent candidate blocks are read and searched together up to this size
+#define INDEX_RUN_SIZE (1024 * 1024)
+
+// On-disk layout, in host byte order, mapped as it is. The header is followed
+// by the files sorted by path, the blocks of all files, the trigrams sorted by
+// value, their posting lists and the paths. Every section starts 8-aligned.
+struct index_header {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t file_count;
+    uint64_t block_count;
+    uint64_t trigram_count;
+    uint64_t postings_size;
+    uint64_t paths_size;
+};
+
+// A file with the size and mtime it had when indexed: once either changes
+// it is searched in full
+struct index_file {
+    uint64_t path;         // offset into the paths, relative to the indexed directory
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t first_block;
+    uint32_t block_count;
+    uint32_t path_len;
+    uint32_t has_nul;      // binary files are always searched in full
+};
+
+// Blocks start at a line start, so a match never crosses one
+struct index_block {
+    uint64_t offset;
+    uint64_t line;         // lines of the file before the block
+};
+
+// Blocks with the three bytes in one line, folded like -i does. Ids go up,
+// each one is stored as a varint of its distance to the one before.
+struct index_trigram {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t postings;     // offset into the posting lists
+};
+
+// An index mapped into memory, or a directory found to have none
+struct trigram_index {
+    char *dir;
+    bool usable;
+    unsigned char *data;
+    size_t size;
+    const struct index_header *header;
+    const struct index_file *files;
+    const struct index_block *blocks;
+    const struct index_trigram *trigrams;
+    const unsigned char *postings;
+    const char *paths;
+    unsigned char *candidates;  // per block: it may hold a line the patterns match
+};
+
+// --use-index: the literals one of which every match contains, and the
+// indexes of the operands' directories opened so far
+struct index_search {
+    char **literals;
+    size_t literal_count;
+    struct trigram_index *indexes;
+    size_t index_count;
+    size_t index_capacity;
+    char *buffer;          // candidate blocks are read into
+    size_t capacity;
+};
+
+void build_index(const char *dir, struct grep_state *st);
+bool index_search_init(struct index_search *is, const struct pattern_table *patterns,
+                       const struct grep_state *st);
+int index_search_file(struct index_search *is, int fd, char *filename, struct grep_worker *w);
+void index_search_free(struct index_search *is);
+
+#endif  // TRIGRAM_INDEX